@@ -0,0 +1,1961 @@
+/*
+ * agent.c
+ *
+ * Agente unificado:
+ * ./agent [opciones] <ip_recolector> <puerto> <ip_logica_agente> [periodo_ms] [fuentes]
+ *
+ * Opciones:
+ *   -s <archivo>  guarda en este archivo lo que no se pudo enviar y lo
+ *                 reenvía al reconectar (sin -s lo no enviado se pierde)
+ *   -S <KB>       tamaño máximo del spool (por defecto 1024 KB)
+ *   -D <política> al llenarse el spool descarta "oldest" (lo más antiguo,
+ *                 por defecto) o "newest" (lo nuevo)
+ *   -R <líneas/s> ritmo máximo de reenvío del spool (por defecto 100)
+ *   -u            envía por UDP en vez de TCP (sin conexión ni confirmación:
+ *                 lo que se pierde con el collector caído no se detecta salvo
+ *                 que llegue un ICMP "port unreachable")
+ *   -m <KB>       con un collector local (ip_recolector "unix:<ruta>"), envía
+ *                 por un anillo en memoria compartida de <KB> (potencia de 2,
+ *                 4..65536) en vez de por el socket
+ *
+ * ip_recolector puede ser "unix:<ruta>" para un collector en la misma
+ * máquina (opción -L del collector); el puerto se ignora.
+ *
+ * Cada métrica es una "fuente" (source_t) con tres operaciones:
+ *   init    prepara la fuente (abrir /proc, etc.)
+ *   sample  toma una muestra en cada tick
+ *   encode  escribe sus líneas en el buffer de envío compartido
+ * Todas las fuentes comparten una conexión TCP, un timerfd y un buffer, así
+ * que cada host necesita un solo proceso y una sola conexión al collector.
+ * Cada conexión empieza con
+ *   HELLO;<ip_logica>;agent=<programa>;period_ms=<ms>;sources=<fuentes>
+ * y a partir de ahí las líneas llevan <ip_logica> vacío ("CPU;;..."): el
+ * collector ya sabe de qué host son. Por UDP (-u) el nombre va siempre.
+ * 'fuentes' es una lista separada por comas (por defecto "cpu,mem").
+ *
+ * Fuentes disponibles:
+ *   cpu  lee /proc/stat y envía
+ *        CPU;<ip_logica>;<usage>;<user>;<sys>;<idle>;<iowait>;<steal>;<n>;<vector>
+ *        donde <vector> lleva dos dígitos hex (00..64) de uso por núcleo.
+ *   mem  lee /proc/meminfo y envía
+ *        MEM;<ip_logica>;<mem_used_MB>;<MemFree_MB>;<SwapTotal_MB>;<SwapFree_MB>
+ *   procs recorre /proc/<pid>/stat y envía los -N procesos (5 por defecto,
+ *        máximo 8) que más CPU y más memoria residente usan:
+ *        PROC;<ip_logica>;<nprocs>;<top_cpu>;<top_rss>
+ *        (no está en la lista por defecto)
+ *
+ * Para añadir una fuente basta con escribir sus tres funciones y agregarla
+ * a all_sources[].
+ *
+ * Muestrea cada periodo_ms (por defecto 2000, mínimo 10) con un timerfd
+ * CLOCK_MONOTONIC alineado a la hora real.
+ *
+ * Supresión por banda muerta y muestreo adaptativo:
+ *   -d <puntos>   sólo envía una fuente si algún valor (en % : uso de CPU,
+ *                 de cada núcleo, memoria usada/libre, swap libre) se movió
+ *                 más de <puntos> desde su último envío
+ *   -H <ms>       con -d, envía "HB;<ip_logica>;<ms>" cada <ms> para que el
+ *                 collector sepa que el host sigue vivo y sin cambios
+ *                 (por defecto 5 periodos)
+ *   -F <ms>       con -d, periodo de muestreo rápido tras un cambio (por
+ *                 defecto periodo_ms/4, mínimo 10)
+ *
+ * La conexión al collector nunca frena el muestreo: el connect es no
+ * bloqueante y, si falla, se reintenta con backoff exponencial aleatorio
+ * (hasta 30 s). Con el collector caído se sigue muestreando (y guardando en
+ * el spool con -s).
+ *
+ * Por TCP el agente también escucha al collector, que cuando se atrasa
+ * puede mandar "CTL;interval=<ms>;batch=<n>;pause=<fuentes>": alarga el
+ * periodo (nunca por debajo de periodo_ms), junta <n> ticks por envío con
+ * las líneas marcadas "@<ts>;" y deja de muestrear las fuentes pausadas.
+ * Si el collector es parte de un cluster y nuestro host es de otro nodo,
+ * responde "REDIRECT;host:puerto" y el agente se conecta a ese nodo (si
+ * deja de responder, vuelve al collector de la línea de comandos).
+ *
+ * agent_cpu.c y agent_mem.c incluyen este archivo con otra lista de fuentes
+ * por defecto.
+ *
+ * Compilar:
+ * gcc -std=c11 -Wall -Wextra -o agent agent.c
+ */
+
+/* _GNU_SOURCE para SOCK_NONBLOCK/SOCK_CLOEXEC, srandom/random y sendmmsg */
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+/* Nombre del programa y fuentes por defecto (los redefinen agent_cpu.c y
+ * agent_mem.c antes de incluir este archivo). */
+#ifndef AGENT_NAME
+#define AGENT_NAME "agent"
+#endif
+#ifndef AGENT_DEFAULT_SOURCES
+#define AGENT_DEFAULT_SOURCES "cpu,mem"
+#endif
+
+volatile sig_atomic_t keep_running = 1;
+
+void handle_sigint(int sig) {
+    (void)sig;
+    keep_running = 0;
+}
+
+/* Reloj monotónico en ms */
+long long now_mono_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ------------------- INTERFAZ DE FUENTES -------------------- */
+
+typedef struct {
+    const char *name;
+    /* Prepara la fuente. Devuelve 0 si está lista o -1 en error. */
+    int (*init)(void);
+    /* Toma una muestra. Devuelve 0 si hay algo que enviar, 1 si todavía no
+     * (p.ej. cpu necesita dos muestras para un delta) o -1 en error. */
+    int (*sample)(void);
+    /* Escribe las líneas de la última muestra en buf. Devuelve los bytes
+     * escritos o -1 si no caben. */
+    int (*encode)(char *buf, size_t size, const char *ip_logica);
+    /* Libera lo que abrió init. */
+    void (*fini)(void);
+    /* Copia en out los valores de la última muestra en puntos porcentuales
+     * (para la banda muerta de -d). Devuelve cuántos escribió. */
+    int (*values)(double *out, int max);
+} source_t;
+
+/* ------------------- FUENTE CPU -------------------- */
+
+/* Contadores de una línea "cpu"/"cpuN" de /proc/stat (en jiffies).
+ * guest y guest_nice no se leen porque ya están incluidos en user y nice. */
+typedef struct {
+    unsigned long user;
+    unsigned long nice;
+    unsigned long system;
+    unsigned long idle;
+    unsigned long iowait;
+    unsigned long irq;
+    unsigned long softirq;
+    unsigned long steal;
+} cpu_stats_t;
+
+#define CPU_FIELDS (sizeof(cpu_stats_t) / sizeof(unsigned long))
+
+/* Máximo número de núcleos que se reportan */
+#define MAX_CORES 256
+
+/* Una lectura completa: línea agregada y una por núcleo */
+typedef struct {
+    cpu_stats_t total;
+    int ncores;
+    cpu_stats_t core[MAX_CORES];
+} cpu_snapshot_t;
+
+/* /proc/stat se abre una sola vez y se relee con pread(fd, ..., 0) sobre un
+ * buffer reutilizado: sin fopen/fclose ni stdio en cada muestra. */
+static int stat_fd = -1;
+static char stat_buf[32768];   /* líneas cpu de hasta MAX_CORES núcleos */
+
+/* Lee un entero decimal sin signo y avanza *p. Devuelve -1 si no hay dígitos. */
+static int scan_ulong(const char **p, unsigned long *out) {
+    const char *s = *p;
+    while (*s == ' ') s++;
+    if (*s < '0' || *s > '9') return -1;
+    unsigned long v = 0;
+    while (*s >= '0' && *s <= '9')
+        v = v * 10 + (unsigned long)(*s++ - '0');
+    *out = v;
+    *p = s;
+    return 0;
+}
+
+/* Lee los campos de una línea cpu a partir de *p. Los kernels antiguos
+ * tienen menos columnas: las que falten quedan en 0. */
+static void scan_cpu_line(const char **p, cpu_stats_t *st) {
+    unsigned long *f = (unsigned long *)st;
+    size_t i = 0;
+    while (i < CPU_FIELDS && scan_ulong(p, &f[i]) == 0)
+        i++;
+    for (; i < CPU_FIELDS; i++)
+        f[i] = 0;
+}
+
+/* Lee la línea agregada y todas las líneas cpuN en una sola pasada. */
+int read_cpu_info(cpu_snapshot_t *snap) {
+    if (stat_fd == -1) {
+        stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+        if (stat_fd == -1) {
+            perror("open(/proc/stat)");
+            return -1;
+        }
+    }
+
+    ssize_t n = pread(stat_fd, stat_buf, sizeof(stat_buf) - 1, 0);
+    if (n <= 0) {
+        perror("pread(/proc/stat)");
+        close(stat_fd);          /* se reabre en la próxima muestra */
+        stat_fd = -1;
+        return -1;
+    }
+    stat_buf[n] = '\0';
+
+    /* Primera línea: "cpu  user nice system idle iowait irq softirq steal ..." */
+    if (strncmp(stat_buf, "cpu ", 4) != 0) {
+        fprintf(stderr, "No se pudo leer la línea de cpu\n");
+        return -1;
+    }
+    const char *p = stat_buf + 4;
+    scan_cpu_line(&p, &snap->total);
+
+    /* Siguientes líneas: "cpuN ..." hasta la primera que no empiece por cpu */
+    snap->ncores = 0;
+    for (;;) {
+        p = strchr(p, '\n');
+        if (!p || strncmp(++p, "cpu", 3) != 0) break;
+        if (snap->ncores == MAX_CORES) break;
+        p += 3;
+        while (*p >= '0' && *p <= '9') p++;   /* número de núcleo */
+        scan_cpu_line(&p, &snap->core[snap->ncores++]);
+    }
+
+    return 0;
+}
+
+/* Porcentajes de un intervalo. */
+typedef struct {
+    double usage;    /* todo lo que no es idle ni iowait */
+    double user;     /* user + nice */
+    double system;   /* system + irq + softirq */
+    double idle;
+    double iowait;
+    double steal;    /* tiempo robado por el hipervisor */
+} cpu_pct_t;
+
+/* Diferencia de un contador; si retrocede (p.ej. núcleo reiniciado por
+ * hotplug) se toma como 0 en vez de dar un valor enorme. */
+static unsigned long delta(unsigned long prev, unsigned long curr) {
+    return curr >= prev ? curr - prev : 0;
+}
+
+void calcular_deltas(const cpu_stats_t *prev, const cpu_stats_t *curr,
+                     cpu_pct_t *pct) {
+    unsigned long d_user    = delta(prev->user,    curr->user);
+    unsigned long d_nice    = delta(prev->nice,    curr->nice);
+    unsigned long d_system  = delta(prev->system,  curr->system);
+    unsigned long d_idle    = delta(prev->idle,    curr->idle);
+    unsigned long d_iowait  = delta(prev->iowait,  curr->iowait);
+    unsigned long d_irq     = delta(prev->irq,     curr->irq);
+    unsigned long d_softirq = delta(prev->softirq, curr->softirq);
+    unsigned long d_steal   = delta(prev->steal,   curr->steal);
+
+    unsigned long total = d_user + d_nice + d_system + d_idle +
+                          d_iowait + d_irq + d_softirq + d_steal;
+
+    if (total == 0) total = 1;
+
+    pct->usage  = 100.0 * (total - d_idle - d_iowait) / total;
+    pct->user   = 100.0 * (d_user + d_nice) / total;
+    pct->system = 100.0 * (d_system + d_irq + d_softirq) / total;
+    pct->idle   = 100.0 * d_idle   / total;
+    pct->iowait = 100.0 * d_iowait / total;
+    pct->steal  = 100.0 * d_steal  / total;
+}
+
+/* Forma el mensaje CPU con el vector de uso por núcleo. Devuelve la
+ * longitud o -1 si no cabe en el buffer. */
+static int format_cpu_msg(char *msg, size_t size, const char *ip_logica,
+                          const cpu_snapshot_t *prev, const cpu_snapshot_t *curr) {
+    static const char hex[] = "0123456789abcdef";
+    cpu_pct_t pct;
+    calcular_deltas(&prev->total, &curr->total, &pct);
+
+    /* Si cambió el número de núcleos sólo comparamos los comunes */
+    int ncores = curr->ncores < prev->ncores ? curr->ncores : prev->ncores;
+
+    int n = snprintf(msg, size, "CPU;%s;%.2f;%.2f;%.2f;%.2f;%.2f;%.2f;%d;",
+                     ip_logica, pct.usage, pct.user, pct.system, pct.idle,
+                     pct.iowait, pct.steal, ncores);
+    if (n < 0 || (size_t)n + 2 * ncores + 2 > size) return -1;
+
+    for (int i = 0; i < ncores; i++) {
+        cpu_pct_t core;
+        calcular_deltas(&prev->core[i], &curr->core[i], &core);
+        int v = (int)(core.usage + 0.5);
+        msg[n++] = hex[v >> 4];
+        msg[n++] = hex[v & 0xf];
+    }
+    msg[n++] = '\n';
+    msg[n] = '\0';
+    return n;
+}
+
+/* Muestra del tick anterior y del actual (se intercambian cada tick) */
+static cpu_snapshot_t cpu_snaps[2];
+static cpu_snapshot_t *cpu_prev = &cpu_snaps[0], *cpu_curr = &cpu_snaps[1];
+static int cpu_have_prev = 0;
+
+static int cpu_init(void) {
+    cpu_have_prev = 0;
+    return 0;
+}
+
+static int cpu_sample(void) {
+    /* El tick que se va a leer pasa a ser el actual */
+    cpu_snapshot_t *tmp = cpu_prev; cpu_prev = cpu_curr; cpu_curr = tmp;
+
+    if (read_cpu_info(cpu_curr) != 0) {
+        cpu_have_prev = 0;                  /* el delta ya no es válido */
+        return -1;
+    }
+    /* El primer tick sólo da la referencia para el siguiente */
+    if (!cpu_have_prev) {
+        cpu_have_prev = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int cpu_encode(char *buf, size_t size, const char *ip_logica) {
+    return format_cpu_msg(buf, size, ip_logica, cpu_prev, cpu_curr);
+}
+
+static void cpu_fini(void) {
+    if (stat_fd != -1) close(stat_fd);
+    stat_fd = -1;
+}
+
+/* Porcentajes agregados y uso de cada núcleo (redondeado como en el vector
+ * que se envía, así un cambio invisible en la línea no cuenta). */
+static int cpu_values(double *out, int max) {
+    cpu_pct_t pct;
+    calcular_deltas(&cpu_prev->total, &cpu_curr->total, &pct);
+    int n = 0;
+    out[n++] = pct.usage;
+    out[n++] = pct.user;
+    out[n++] = pct.system;
+    out[n++] = pct.iowait;
+    out[n++] = pct.steal;
+
+    int ncores = cpu_curr->ncores < cpu_prev->ncores ? cpu_curr->ncores : cpu_prev->ncores;
+    for (int i = 0; i < ncores && n < max; i++) {
+        cpu_pct_t core;
+        calcular_deltas(&cpu_prev->core[i], &cpu_curr->core[i], &core);
+        out[n++] = (int)(core.usage + 0.5);
+    }
+    return n;
+}
+
+/* ------------------- FUENTE MEM -------------------- */
+
+/* Estructura para guardar métricas leídas */
+typedef struct {
+    long mem_total_kb;
+    long mem_available_kb;
+    long mem_free_kb;
+    long swap_total_kb;
+    long swap_free_kb;
+} meminfo_t;
+
+/* /proc/meminfo se abre una sola vez y se relee con pread(fd, ..., 0) sobre
+ * un buffer reutilizado, sin stdio ni sscanf por línea. */
+static int meminfo_fd = -1;
+static char meminfo_buf[8192];
+
+/* Campos de /proc/meminfo que nos interesan y dónde guardarlos. */
+typedef struct {
+    const char *key;   /* nombre incluyendo ':' */
+    size_t len;        /* strlen(key) */
+    size_t offset;     /* offsetof(meminfo_t, campo) */
+} meminfo_key_t;
+
+static const meminfo_key_t meminfo_keys[] = {
+    { "MemTotal:",     9,  offsetof(meminfo_t, mem_total_kb) },
+    { "MemFree:",      8,  offsetof(meminfo_t, mem_free_kb) },
+    { "MemAvailable:", 13, offsetof(meminfo_t, mem_available_kb) },
+    { "SwapTotal:",    10, offsetof(meminfo_t, swap_total_kb) },
+    { "SwapFree:",     9,  offsetof(meminfo_t, swap_free_kb) },
+};
+#define N_MEMINFO_KEYS (sizeof(meminfo_keys) / sizeof(meminfo_keys[0]))
+
+/* Lee /proc/meminfo y extrae los campos requeridos.
+ * Devuelve 0 si tuvo éxito, -1 en caso de error.
+ */
+int read_meminfo(meminfo_t *m) {
+    if (!m) return -1;
+    if (meminfo_fd == -1) {
+        meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+        if (meminfo_fd == -1) {
+            perror("open(/proc/meminfo)");
+            return -1;
+        }
+    }
+
+    ssize_t n = pread(meminfo_fd, meminfo_buf, sizeof(meminfo_buf) - 1, 0);
+    if (n <= 0) {
+        perror("pread(/proc/meminfo)");
+        close(meminfo_fd);       /* se reabre en el próximo ciclo */
+        meminfo_fd = -1;
+        return -1;
+    }
+    meminfo_buf[n] = '\0';
+
+    /* inicializar con -1 para detectar ausencia */
+    m->mem_total_kb = -1;
+    m->mem_available_kb = -1;
+    m->mem_free_kb = -1;
+    m->swap_total_kb = -1;
+    m->swap_free_kb = -1;
+
+    /* Recorremos las líneas "Clave:   valor kB"; en cuanto tenemos todos
+     * los campos dejamos de mirar (SwapFree está hacia la mitad del archivo). */
+    const char *p = meminfo_buf;
+    const char *end = meminfo_buf + n;
+    size_t found = 0;
+    while (p < end && found < N_MEMINFO_KEYS) {
+        for (size_t k = 0; k < N_MEMINFO_KEYS; k++) {
+            const meminfo_key_t *mk = &meminfo_keys[k];
+            if ((size_t)(end - p) > mk->len && memcmp(p, mk->key, mk->len) == 0) {
+                const char *q = p + mk->len;
+                while (*q == ' ') q++;
+                long val = 0;
+                while (*q >= '0' && *q <= '9')
+                    val = val * 10 + (*q++ - '0');
+                *(long *)((char *)m + mk->offset) = val;
+                found++;
+                break;
+            }
+        }
+        /* Siguiente línea */
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        p = nl + 1;
+    }
+
+    /* Verificar que tenemos al menos los campos obligatorios */
+    if (m->mem_total_kb < 0 || m->mem_available_kb < 0 || m->mem_free_kb < 0) {
+        fprintf(stderr, "No se pudieron leer todos los campos requeridos en /proc/meminfo\n");
+        return -1;
+    }
+    /* Swap puede ser 0 - aceptable */
+    if (m->swap_total_kb < 0) m->swap_total_kb = 0;
+    if (m->swap_free_kb < 0) m->swap_free_kb = 0;
+
+    return 0;
+}
+
+static meminfo_t mem_last;
+
+static int mem_init(void) {
+    return 0;
+}
+
+static int mem_sample(void) {
+    return read_meminfo(&mem_last) == 0 ? 0 : -1;
+}
+
+static int mem_encode(char *buf, size_t size, const char *ip_logica) {
+    const meminfo_t *m = &mem_last;
+    double mem_used_mb = (m->mem_total_kb - m->mem_available_kb) / 1024.0;
+    double mem_free_mb = m->mem_free_kb / 1024.0;
+    double swap_total_mb = m->swap_total_kb / 1024.0;
+    double swap_free_mb = m->swap_free_kb / 1024.0;
+
+    int n = snprintf(buf, size, "MEM;%s;%.2f;%.2f;%.2f;%.2f\n",
+                     ip_logica, mem_used_mb, mem_free_mb,
+                     swap_total_mb, swap_free_mb);
+    return (n < 0 || (size_t)n >= size) ? -1 : n;
+}
+
+static void mem_fini(void) {
+    if (meminfo_fd != -1) close(meminfo_fd);
+    meminfo_fd = -1;
+}
+
+/* Memoria usada y libre como % de MemTotal y swap libre como % del swap. */
+static int mem_values(double *out, int max) {
+    const meminfo_t *m = &mem_last;
+    (void)max;
+    double total = m->mem_total_kb > 0 ? m->mem_total_kb : 1;
+    out[0] = 100.0 * (m->mem_total_kb - m->mem_available_kb) / total;
+    out[1] = 100.0 * m->mem_free_kb / total;
+    out[2] = m->swap_total_kb > 0 ? 100.0 * m->swap_free_kb / m->swap_total_kb : 0;
+    return 3;
+}
+
+/* ------------------- FUENTE PROCS -------------------- */
+
+/* Top-N procesos por CPU y por memoria residente. En cada muestra se
+ * recorre /proc con getdents64 sobre un dirfd abierto una sola vez (en
+ * tandas de 32 KB, sin opendir/readdir) y de cada proceso se lee sólo
+ * /proc/<pid>/stat, que ya trae utime, stime, starttime y rss (lo mismo que
+ * daría statm), con pread sobre un fd que se mantiene abierto entre
+ * muestras: una sola llamada al sistema por proceso y muestra. Si se acaban
+ * los descriptores se cae a openat/read/close.
+ *
+ * Línea enviada:
+ *   PROC;<ip_logica>;<nprocs>;<top_cpu>;<top_rss>
+ * donde cada lista es "pid:comando:cpu_pct:rss_MB" separados por ','. El %
+ * de CPU es de un núcleo (como en top: puede pasar de 100). */
+
+#define PROC_TOP_MAX 8          /* cabe en una línea de 1 KB del collector */
+
+static int proc_top_n = 5;      /* -N */
+
+/* Proceso visto en la última muestra */
+typedef struct {
+    int pid;                    /* 0 = hueco libre */
+    int fd;                     /* /proc/<pid>/stat abierto, o -1 */
+    unsigned long long ticks;   /* utime + stime */
+    unsigned long long start;   /* starttime: distingue un pid reutilizado */
+} proc_slot_t;
+
+/* Tabla hash (direccionamiento abierto) pid -> proc_slot_t. Hay dos: la de
+ * la muestra anterior y la que se llena en la actual; al terminar se
+ * cierran los fds de los procesos que ya no existen y se intercambian. */
+typedef struct {
+    proc_slot_t *slots;
+    size_t cap;                 /* potencia de 2 */
+    size_t n;
+} proc_table_t;
+
+typedef struct {
+    int pid;
+    char comm[16];
+    double cpu;                 /* % de un núcleo */
+    unsigned long rss_kb;
+} proc_info_t;
+
+static int proc_dirfd = -1;
+static proc_table_t proc_tabs[2];
+static proc_table_t *proc_prev = &proc_tabs[0], *proc_cur = &proc_tabs[1];
+static char proc_dents[32768];
+static char proc_stat_buf[1024];
+static long proc_hz, proc_page_kb;
+static long long proc_last_ms;       /* instante (monotónico) de la muestra anterior */
+static int proc_fds_exhausted;
+
+static proc_info_t proc_top_cpu[PROC_TOP_MAX], proc_top_rss[PROC_TOP_MAX];
+static int proc_n_cpu, proc_n_rss, proc_count;
+
+/* Entrada de getdents64 (el kernel no la exporta en un header de usuario) */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static size_t proc_hash(int pid, size_t cap) {
+    return ((uint32_t)pid * 2654435761u) & (cap - 1);
+}
+
+static int proc_table_init(proc_table_t *t, size_t cap) {
+    t->slots = calloc(cap, sizeof(proc_slot_t));
+    if (!t->slots) return -1;
+    t->cap = cap;
+    t->n = 0;
+    return 0;
+}
+
+/* Busca pid; si no está devuelve el hueco donde insertarlo */
+static proc_slot_t *proc_table_find(proc_table_t *t, int pid) {
+    size_t i = proc_hash(pid, t->cap);
+    while (t->slots[i].pid != 0 && t->slots[i].pid != pid)
+        i = (i + 1) & (t->cap - 1);
+    return &t->slots[i];
+}
+
+/* Duplica la tabla cuando pasa de la mitad de ocupación */
+static int proc_table_grow(proc_table_t *t) {
+    proc_table_t bigger;
+    if (proc_table_init(&bigger, t->cap * 2) != 0) return -1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].pid == 0) continue;
+        *proc_table_find(&bigger, t->slots[i].pid) = t->slots[i];
+        bigger.n++;
+    }
+    free(t->slots);
+    *t = bigger;
+    return 0;
+}
+
+static int procs_init(void) {
+    proc_dirfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_dirfd == -1) {
+        perror("open(/proc)");
+        return -1;
+    }
+    if (proc_table_init(proc_prev, 1024) != 0 || proc_table_init(proc_cur, 1024) != 0)
+        return -1;
+    proc_hz = sysconf(_SC_CLK_TCK);
+    proc_page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    /* Un fd por proceso: subimos el límite blando hasta el duro */
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return 0;
+}
+
+/* Lee /proc/<pid>/stat en proc_stat_buf reutilizando el fd de la muestra
+ * anterior si lo hay. Devuelve los bytes leídos o -1 (el proceso terminó). */
+static ssize_t proc_read_stat(proc_slot_t *s, const char *name) {
+    if (s->fd != -1) {
+        ssize_t n = pread(s->fd, proc_stat_buf, sizeof(proc_stat_buf) - 1, 0);
+        if (n > 0) return n;
+        close(s->fd);            /* el proceso murió (ESRCH): pid reutilizado */
+        s->fd = -1;
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), "%s/stat", name);
+    int fd = openat(proc_dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == EMFILE || errno == ENFILE) proc_fds_exhausted = 1;
+        return -1;
+    }
+    ssize_t n = pread(fd, proc_stat_buf, sizeof(proc_stat_buf) - 1, 0);
+    if (proc_fds_exhausted || n <= 0)
+        close(fd);               /* sin fds de sobra: no lo guardamos */
+    else
+        s->fd = fd;
+    return n;
+}
+
+/* Extrae comm, utime+stime, starttime y rss de una línea de stat.
+ * comm va entre paréntesis y puede tener espacios: se busca el último ')'. */
+static int proc_parse_stat(char *buf, ssize_t len, proc_info_t *pi,
+                           unsigned long long *ticks, unsigned long long *start) {
+    buf[len] = '\0';
+    char *open_p = memchr(buf, '(', len);
+    char *close_p = strrchr(buf, ')');
+    if (!open_p || !close_p || close_p < open_p) return -1;
+
+    /* comm sin caracteres que rompan el formato de la línea */
+    size_t clen = close_p - open_p - 1;
+    if (clen > sizeof(pi->comm) - 1) clen = sizeof(pi->comm) - 1;
+    for (size_t i = 0; i < clen; i++) {
+        char c = open_p[1 + i];
+        pi->comm[i] = (c == ';' || c == ':' || c == ',' || c <= ' ') ? '_' : c;
+    }
+    pi->comm[clen] = '\0';
+
+    /* Tras ") " vienen los campos 3 (state) en adelante */
+    const char *p = close_p + 2;
+    if (p >= buf + len) return -1;
+    p++;                                /* state (un carácter) */
+    unsigned long f[21];                /* campos 4..24 (índice = campo - 4) */
+    for (int i = 0; i <= 20; i++) {
+        while (*p == ' ') p++;
+        if (*p == '-') p++;             /* tpgid es -1 sin terminal: no lo usamos */
+        if (scan_ulong(&p, &f[i]) != 0)
+            return -1;
+    }
+    *ticks = (unsigned long long)f[14 - 4] + f[15 - 4];
+    *start = f[22 - 4];
+    pi->rss_kb = f[24 - 4] * proc_page_kb;
+    return 0;
+}
+
+/* Inserta pi en la lista top (ordenada de mayor a menor por la clave) */
+static void proc_top_insert(proc_info_t *top, int *n, const proc_info_t *pi, int by_rss) {
+    int pos = *n;
+    while (pos > 0 && (by_rss ? pi->rss_kb > top[pos - 1].rss_kb
+                              : pi->cpu > top[pos - 1].cpu))
+        pos--;
+    if (pos >= proc_top_n) return;
+    int last = *n < proc_top_n ? *n : proc_top_n - 1;
+    memmove(&top[pos + 1], &top[pos], (last - pos) * sizeof(*top));
+    top[pos] = *pi;
+    if (*n < proc_top_n) (*n)++;
+}
+
+static int procs_sample(void) {
+    long long now = now_mono_ms();
+    double elapsed = (now - proc_last_ms) / 1000.0;
+    int first = proc_last_ms == 0;
+    proc_last_ms = now;
+
+    proc_n_cpu = proc_n_rss = proc_count = 0;
+    if (lseek(proc_dirfd, 0, SEEK_SET) == -1) return -1;
+
+    for (;;) {
+        long nread = syscall(SYS_getdents64, proc_dirfd, proc_dents, sizeof(proc_dents));
+        if (nread == -1) {
+            perror("getdents64(/proc)");
+            return -1;
+        }
+        if (nread == 0) break;
+
+        for (long off = 0; off < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(proc_dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] < '1' || name[0] > '9') continue;   /* no es un pid */
+            int pid = 0;
+            for (const char *c = name; *c; c++) pid = pid * 10 + (*c - '0');
+
+            /* Lo que sabíamos de este pid pasa a la tabla de esta muestra */
+            proc_slot_t *old = proc_table_find(proc_prev, pid);
+            proc_slot_t s = { pid, -1, 0, 0 };
+            int known = old->pid == pid;
+            if (known) {
+                s = *old;
+                old->fd = -1;        /* el fd ya no es de la tabla vieja */
+            }
+
+            proc_info_t pi;
+            unsigned long long ticks, start;
+            ssize_t n = proc_read_stat(&s, name);
+            if (n <= 0 || proc_parse_stat(proc_stat_buf, n, &pi, &ticks, &start) != 0) {
+                if (s.fd != -1) close(s.fd);
+                continue;            /* terminó mientras lo leíamos */
+            }
+            if (!known || start != s.start)
+                s.ticks = ticks;     /* proceso nuevo: sin delta todavía */
+            pi.pid = pid;
+            pi.cpu = (!first && elapsed > 0 && ticks >= s.ticks)
+                         ? 100.0 * (ticks - s.ticks) / proc_hz / elapsed : 0;
+            s.ticks = ticks;
+            s.start = start;
+
+            if (proc_cur->n * 2 >= proc_cur->cap && proc_table_grow(proc_cur) != 0) {
+                if (s.fd != -1) close(s.fd);
+                continue;
+            }
+            *proc_table_find(proc_cur, pid) = s;
+            proc_cur->n++;
+
+            proc_count++;
+            proc_top_insert(proc_top_cpu, &proc_n_cpu, &pi, 0);
+            proc_top_insert(proc_top_rss, &proc_n_rss, &pi, 1);
+        }
+    }
+
+    /* Los procesos que no aparecieron ya no existen: cerramos sus fds */
+    for (size_t i = 0; i < proc_prev->cap; i++)
+        if (proc_prev->slots[i].pid != 0 && proc_prev->slots[i].fd != -1)
+            close(proc_prev->slots[i].fd);
+    memset(proc_prev->slots, 0, proc_prev->cap * sizeof(proc_slot_t));
+    proc_prev->n = 0;
+    if (proc_prev->cap < proc_cur->cap) {
+        free(proc_prev->slots);
+        if (proc_table_init(proc_prev, proc_cur->cap) != 0) return -1;
+    }
+    proc_table_t *tmp = proc_prev; proc_prev = proc_cur; proc_cur = tmp;
+
+    /* La primera pasada sólo da la referencia de ticks */
+    return first ? 1 : 0;
+}
+
+/* Escribe una lista "pid:comm:cpu:rss_MB,..." */
+static int procs_format_list(char *buf, size_t size, const proc_info_t *top, int n) {
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        int w = snprintf(buf + len, size - len, "%s%d:%s:%.1f:%.1f", i ? "," : "",
+                         top[i].pid, top[i].comm, top[i].cpu, top[i].rss_kb / 1024.0);
+        if (w < 0 || (size_t)w >= size - len) return -1;
+        len += (size_t)w;
+    }
+    return (int)len;
+}
+
+static int procs_encode(char *buf, size_t size, const char *ip_logica) {
+    int n = snprintf(buf, size, "PROC;%s;%d;", ip_logica, proc_count);
+    if (n < 0 || (size_t)n >= size) return -1;
+    int w = procs_format_list(buf + n, size - n, proc_top_cpu, proc_n_cpu);
+    if (w < 0 || (size_t)(n + w + 1) >= size) return -1;
+    n += w;
+    buf[n++] = ';';
+    w = procs_format_list(buf + n, size - n, proc_top_rss, proc_n_rss);
+    if (w < 0 || (size_t)(n + w + 1) >= size) return -1;
+    n += w;
+    buf[n++] = '\n';
+    buf[n] = '\0';
+    return n;
+}
+
+static void procs_fini(void) {
+    for (int t = 0; t < 2; t++) {
+        for (size_t i = 0; i < proc_tabs[t].cap; i++)
+            if (proc_tabs[t].slots[i].pid != 0 && proc_tabs[t].slots[i].fd != -1)
+                close(proc_tabs[t].slots[i].fd);
+        free(proc_tabs[t].slots);
+        proc_tabs[t].slots = NULL;
+        proc_tabs[t].cap = 0;
+    }
+    if (proc_dirfd != -1) close(proc_dirfd);
+    proc_dirfd = -1;
+}
+
+/* CPU de los procesos más activos y RSS de los más grandes (en % de la
+ * memoria física), para la banda muerta de -d. */
+static int procs_values(double *out, int max) {
+    static double phys_kb;
+    if (phys_kb == 0)
+        phys_kb = (double)sysconf(_SC_PHYS_PAGES) * proc_page_kb;
+    int n = 0;
+    for (int i = 0; i < proc_n_cpu && n < max; i++)
+        out[n++] = proc_top_cpu[i].cpu;
+    for (int i = 0; i < proc_n_rss && n < max; i++)
+        out[n++] = 100.0 * proc_top_rss[i].rss_kb / phys_kb;
+    return n;
+}
+
+/* ------------------- REGISTRO DE FUENTES -------------------- */
+
+static const source_t all_sources[] = {
+    { "cpu", cpu_init, cpu_sample, cpu_encode, cpu_fini, cpu_values },
+    { "mem", mem_init, mem_sample, mem_encode, mem_fini, mem_values },
+    { "procs", procs_init, procs_sample, procs_encode, procs_fini, procs_values },
+};
+#define N_ALL_SOURCES (sizeof(all_sources) / sizeof(all_sources[0]))
+
+/* Fuentes activas (en el orden en que se pidieron) */
+static const source_t *sources[N_ALL_SOURCES];
+static size_t n_sources = 0;
+
+/* Activa las fuentes de una lista separada por comas.
+ * Devuelve 0 si todas existen o -1 si alguna es desconocida. */
+int select_sources(const char *list) {
+    char tmp[128];
+    strncpy(tmp, list, sizeof(tmp) - 1);
+    tmp[sizeof(tmp) - 1] = '\0';
+
+    char *save;
+    for (char *name = strtok_r(tmp, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        const source_t *found = NULL;
+        for (size_t i = 0; i < N_ALL_SOURCES; i++)
+            if (strcmp(all_sources[i].name, name) == 0)
+                found = &all_sources[i];
+        if (!found) {
+            fprintf(stderr, "Fuente desconocida: %s\n", name);
+            return -1;
+        }
+        /* Ignoramos duplicados */
+        int dup = 0;
+        for (size_t i = 0; i < n_sources; i++)
+            if (sources[i] == found) dup = 1;
+        if (!dup) sources[n_sources++] = found;
+    }
+    return n_sources > 0 ? 0 : -1;
+}
+
+/* ---------------- SUPRESIÓN POR BANDA MUERTA ----------------- */
+
+/* Con -d <puntos> una fuente sólo se envía si alguno de sus valores se
+ * movió más de <puntos> puntos porcentuales desde lo último que envió. Lo
+ * que no se envía sigue vigente en el collector, que lo sabe por los
+ * heartbeats "HB;<ip_logica>;<intervalo_ms>" (cada -H ms). */
+
+#define MAX_VALUES (8 + MAX_CORES)
+
+typedef struct {
+    double sent[MAX_VALUES];    /* valores de la última línea enviada */
+    int n_sent;                 /* 0 = todavía no se envió nada */
+} deadband_t;
+
+static double deadband = -1;    /* puntos porcentuales; < 0 = desactivada */
+static deadband_t db_state[N_ALL_SOURCES];
+
+/* Devuelve 1 si la fuente i (ya muestreada) tiene que enviarse. */
+int deadband_changed(size_t i) {
+    if (deadband < 0) return 1;
+
+    double cur[MAX_VALUES];
+    int n = sources[i]->values(cur, MAX_VALUES);
+    deadband_t *d = &db_state[i];
+    int changed = n != d->n_sent;
+    for (int k = 0; k < n && !changed; k++) {
+        double diff = cur[k] - d->sent[k];
+        changed = diff > deadband || diff < -deadband;
+    }
+    if (changed) {
+        memcpy(d->sent, cur, n * sizeof(double));
+        d->n_sent = n;
+    }
+    return changed;
+}
+
+/* ------------------- SPOOL EN DISCO -------------------- */
+
+/* Cuando no se puede enviar, las líneas se guardan (con la marca de tiempo
+ * de la muestra, "@<epoch_ms>;<línea>") en un buffer circular dentro de un
+ * archivo proyectado en memoria con mmap. Al reconectar se reenvían en
+ * orden, a un ritmo limitado, para no saturar al collector. Como el archivo
+ * persiste, un reinicio del agente tampoco pierde lo pendiente.
+ *
+ * Disposición del archivo: una cabecera de SPOOL_HDR_SIZE bytes y a
+ * continuación 'capacity' bytes de datos. Cada registro es una longitud de
+ * 2 bytes seguida de la línea. head y tail son desplazamientos lógicos que
+ * sólo crecen; la posición real es desplazamiento % capacity. */
+
+#define SPOOL_MAGIC    0x53504c31u   /* "SPL1" */
+#define SPOOL_HDR_SIZE 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hdr_size;
+    uint64_t capacity;   /* bytes de datos */
+    uint64_t head;       /* desplazamiento del registro más antiguo */
+    uint64_t tail;       /* desplazamiento donde va el próximo registro */
+    uint64_t dropped;    /* registros descartados por falta de espacio */
+} spool_hdr_t;
+
+/* Qué hacer cuando el spool está lleno */
+typedef enum { DROP_OLDEST, DROP_NEWEST } drop_policy_t;
+
+static spool_hdr_t *spool = NULL;      /* NULL = spool desactivado */
+static char *spool_data;
+static drop_policy_t spool_policy = DROP_OLDEST;
+
+/* Abre (o crea) el spool en 'path' con 'capacity' bytes de datos. Si el
+ * archivo ya tenía un spool válido de la misma capacidad se conserva su
+ * contenido. Devuelve 0 si todo fue bien o -1 en error. */
+int spool_open(const char *path, uint64_t capacity) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    size_t size = SPOOL_HDR_SIZE + capacity;
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                          /* el mapeo sigue siendo válido */
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    spool = p;
+    spool_data = (char *)p + SPOOL_HDR_SIZE;
+    if (spool->magic != SPOOL_MAGIC || spool->hdr_size != SPOOL_HDR_SIZE ||
+        spool->capacity != capacity || spool->tail < spool->head ||
+        spool->tail - spool->head > capacity) {
+        /* Archivo nuevo, de otra capacidad o corrupto: empezamos vacío */
+        memset(spool, 0, sizeof(*spool));
+        spool->magic = SPOOL_MAGIC;
+        spool->hdr_size = SPOOL_HDR_SIZE;
+        spool->capacity = capacity;
+    } else if (spool->tail > spool->head) {
+        fprintf(stderr, "Spool: %llu bytes pendientes de una ejecución anterior\n",
+                (unsigned long long)(spool->tail - spool->head));
+    }
+    return 0;
+}
+
+/* Copia n bytes hacia/desde el buffer circular dando la vuelta si hace falta */
+static void ring_write(uint64_t off, const void *src, size_t n) {
+    size_t pos = off % spool->capacity;
+    size_t first = n < spool->capacity - pos ? n : spool->capacity - pos;
+    memcpy(spool_data + pos, src, first);
+    memcpy(spool_data, (const char *)src + first, n - first);
+}
+
+static void ring_read(uint64_t off, void *dst, size_t n) {
+    size_t pos = off % spool->capacity;
+    size_t first = n < spool->capacity - pos ? n : spool->capacity - pos;
+    memcpy(dst, spool_data + pos, first);
+    memcpy((char *)dst + first, spool_data, n - first);
+}
+
+/* Guarda una línea. Si no hay sitio aplica la política de descarte. */
+void spool_append(const char *line, size_t len) {
+    uint16_t rec_len = (uint16_t)len;
+    uint64_t need = sizeof(rec_len) + len;
+    if (need > spool->capacity) return;
+
+    while (spool->capacity - (spool->tail - spool->head) < need) {
+        if (spool_policy == DROP_NEWEST) {
+            spool->dropped++;
+            return;
+        }
+        /* DROP_OLDEST: liberamos el registro más antiguo */
+        uint16_t old_len;
+        ring_read(spool->head, &old_len, sizeof(old_len));
+        spool->head += sizeof(old_len) + old_len;
+        spool->dropped++;
+    }
+    ring_write(spool->tail, &rec_len, sizeof(rec_len));
+    ring_write(spool->tail + sizeof(rec_len), line, len);
+    spool->tail += need;   /* se publica al final: el registro ya está entero */
+}
+
+/* Guarda en el spool cada línea de buf con el prefijo "@<ts_ms>;". */
+void spool_lines(const char *buf, size_t len, long long ts_ms) {
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = (nl ? nl + 1 : end) - p;
+        char rec[4200];
+        int h = snprintf(rec, sizeof(rec), "@%lld;", ts_ms);
+        if (h > 0 && h + n <= sizeof(rec)) {
+            memcpy(rec + h, p, n);
+            spool_append(rec, h + n);
+        }
+        p += n;
+    }
+}
+
+/* Guarda en el spool cada línea de buf tal cual (ya llevan su prefijo). */
+void spool_stamped(const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = (nl ? nl + 1 : end) - p;
+        spool_append(p, n);
+        p += n;
+    }
+}
+
+/* Copia en dst las líneas de buf con el prefijo "@<ts_ms>;" (las que no
+ * caben se descartan enteras). Devuelve los bytes escritos. */
+size_t stamp_lines(char *dst, size_t size, const char *buf, size_t len, long long ts_ms) {
+    const char *p = buf, *end = buf + len;
+    size_t out = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t n = (nl ? nl + 1 : end) - p;
+        int h = snprintf(dst + out, size - out, "@%lld;", ts_ms);
+        if (h > 0 && out + h + n <= size) {
+            memcpy(dst + out + h, p, n);
+            out += h + n;
+        }
+        p += n;
+    }
+    return out;
+}
+
+/* Copia en buf hasta 'max' registros pendientes sin sacarlos del spool.
+ * Devuelve los bytes copiados y deja en *new_head el head a confirmar con
+ * spool_commit cuando el envío haya salido bien. */
+size_t spool_peek(char *buf, size_t size, int max, uint64_t *new_head) {
+    uint64_t off = spool->head;
+    size_t len = 0;
+    while (max-- > 0 && off < spool->tail) {
+        uint16_t rec_len;
+        ring_read(off, &rec_len, sizeof(rec_len));
+        if (len + rec_len > size) break;
+        ring_read(off + sizeof(rec_len), buf + len, rec_len);
+        len += rec_len;
+        off += sizeof(rec_len) + rec_len;
+    }
+    *new_head = off;
+    return len;
+}
+
+void spool_commit(uint64_t new_head) {
+    /* Un DROP_OLDEST durante el envío pudo adelantar head más allá */
+    if (new_head > spool->head) spool->head = new_head;
+}
+
+/* Hora real en ms desde epoch (marca de tiempo de las muestras) */
+long long now_wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ------------------- RED Y TIEMPO -------------------- */
+
+/* ------------------- CONEXIÓN AL COLLECTOR -------------------- */
+
+/* Anillo SPSC en memoria compartida con un collector local (misma
+ * estructura que en collector.c). El agente escribe líneas completas y
+ * avanza 'tail'; el collector consume y avanza 'head'. Si 'waiting' vale 1
+ * el collector está dormido y hay que escribir en el eventfd. */
+#define SHM_CACHE_LINE 64
+typedef struct {
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t head;
+    _Alignas(SHM_CACHE_LINE) _Atomic uint64_t tail;
+    _Alignas(SHM_CACHE_LINE) _Atomic uint32_t waiting;
+    uint32_t size;
+    _Alignas(SHM_CACHE_LINE) char data[];
+} shm_ring_t;
+
+
+/* La conexión es una pequeña máquina de estados que avanza desde el bucle
+ * principal sin bloquearlo nunca:
+ *   LINK_DOWN        sin socket; se reintenta cuando llega next_attempt
+ *   LINK_CONNECTING  connect() no bloqueante en curso (se espera POLLOUT)
+ *   LINK_UP          conectado
+ * Las direcciones se resuelven una vez y se guardan; sólo se vuelven a
+ * resolver tras varias rondas fallidas (por si cambió el DNS). Entre rondas
+ * se espera un tiempo aleatorio en [0, min(BACKOFF_MAX_MS, BACKOFF_BASE_MS
+ * * 2^fallos)] ("full jitter"), así que cuando el collector vuelve los
+ * agentes no reconectan todos a la vez. Mientras tanto se sigue muestreando
+ * (y guardando en el spool si está activo). */
+
+#define CONNECT_TIMEOUT_MS 3000
+#define BACKOFF_BASE_MS    500
+#define BACKOFF_MAX_MS     30000
+#define RERESOLVE_ROUNDS   3      /* rondas fallidas antes de volver a resolver */
+
+typedef enum { LINK_DOWN, LINK_CONNECTING, LINK_UP } link_state_t;
+
+typedef struct {
+    const char *host;           /* IP o nombre del collector */
+    const char *port;
+    const char *orig_host;      /* collector de la línea de comandos */
+    const char *orig_port;
+    char redir[64];             /* "host:puerto" de un REDIRECT (host\0puerto) */
+    struct addrinfo *addrs;     /* direcciones resueltas (caché) */
+    struct addrinfo *cur;       /* dirección que se está probando */
+    int fd;
+    link_state_t state;
+    int failures;               /* rondas fallidas seguidas */
+    long long next_attempt;     /* ms monotónicos del próximo intento */
+    long long deadline;         /* ms monotónicos límite del connect en curso */
+    long send_timeout_ms;       /* tope de un send bloqueado (SO_SNDTIMEO) */
+    int udp;                    /* 1 = datagramas en vez de TCP */
+    const char *hello;          /* línea HELLO que abre cada conexión TCP */
+    int fresh;                  /* recién conectado (todavía sin heartbeat) */
+    char rbuf[256];             /* líneas CTL recibidas todavía incompletas */
+    size_t rlen;
+    /* Collector local ("unix:<ruta>"): la dirección no sale de getaddrinfo */
+    int is_unix;
+    struct addrinfo ux_ai;
+    struct sockaddr_un ux_sa;
+    /* Anillo en memoria compartida con el collector (-m, sólo unix:) */
+    size_t shm_size;            /* bytes pedidos con -m (0 = sin anillo) */
+    shm_ring_t *ring;           /* NULL = todo va por el socket */
+    int ring_efd;
+    uint64_t ring_tail;         /* copia propia de ring->tail */
+} link_t;
+
+void link_init(link_t *l, const char *host, const char *port, long send_timeout_ms) {
+    memset(l, 0, sizeof(*l));
+    l->host = l->orig_host = host;
+    l->port = l->orig_port = port;
+    l->fd = -1;
+    l->state = LINK_DOWN;
+    l->send_timeout_ms = send_timeout_ms;
+    l->next_attempt = now_mono_ms();   /* primer intento inmediato */
+    srandom((unsigned)(getpid() ^ l->next_attempt));
+}
+
+/* Libera las direcciones resueltas (la de un socket Unix no es de
+ * getaddrinfo). */
+static void link_free_addrs(link_t *l) {
+    if (l->addrs && l->addrs != &l->ux_ai) freeaddrinfo(l->addrs);
+    l->addrs = NULL;
+}
+
+/* Resuelve host:port. Si es una IP literal no hay consulta DNS.
+ * "unix:<ruta>" es un collector local por socket Unix (port se ignora). */
+static int link_resolve(link_t *l) {
+    if (strncmp(l->host, "unix:", 5) == 0) {
+        if (strlen(l->host + 5) >= sizeof(l->ux_sa.sun_path)) return -1;
+        memset(&l->ux_sa, 0, sizeof(l->ux_sa));
+        l->ux_sa.sun_family = AF_UNIX;
+        strcpy(l->ux_sa.sun_path, l->host + 5);
+        memset(&l->ux_ai, 0, sizeof(l->ux_ai));
+        l->ux_ai.ai_family = AF_UNIX;
+        l->ux_ai.ai_socktype = l->udp ? SOCK_DGRAM : SOCK_STREAM;
+        l->ux_ai.ai_addr = (struct sockaddr *)&l->ux_sa;
+        l->ux_ai.ai_addrlen = sizeof(l->ux_sa);
+        l->addrs = &l->ux_ai;
+        l->is_unix = 1;
+        return 0;
+    }
+    l->is_unix = 0;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;    /* IPv4 o IPv6 */
+    hints.ai_socktype = l->udp ? SOCK_DGRAM : SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    int rc = getaddrinfo(l->host, l->port, &hints, &l->addrs);
+    if (rc != 0) {
+        hints.ai_flags = 0;
+        rc = getaddrinfo(l->host, l->port, &hints, &l->addrs);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        l->addrs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Suelta el anillo compartido (el collector hace lo mismo al ver el cierre). */
+static void shm_close(link_t *l) {
+    if (!l->ring) return;
+    munmap(l->ring, sizeof(shm_ring_t) + l->shm_size);
+    close(l->ring_efd);
+    l->ring = NULL;
+}
+
+/* Crea el anillo (memfd sellado contra encogerse + eventfd), se lo pasa al
+ * collector con SCM_RIGHTS junto a la línea "SHM;<tamaño>" y lo deja listo
+ * para link_send. Si algo falla se sigue sólo por el socket. */
+static void shm_open_ring(link_t *l) {
+    size_t map_len = sizeof(shm_ring_t) + l->shm_size;
+    int memfd = memfd_create("agent-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int efd = eventfd(0, EFD_CLOEXEC);
+    void *p = MAP_FAILED;
+    if (memfd >= 0 && efd >= 0 && ftruncate(memfd, map_len) == 0 &&
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0)
+        p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) {
+        perror("anillo compartido");
+        if (memfd >= 0) close(memfd);
+        if (efd >= 0) close(efd);
+        return;
+    }
+    shm_ring_t *r = p;     /* ftruncate lo dejó en ceros: head = tail = 0 */
+    r->size = (uint32_t)l->shm_size;
+
+    char line[32];
+    int len = snprintf(line, sizeof(line), "SHM;%zu\n", l->shm_size);
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { line, (size_t)len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    int fds[2] = { memfd, efd };
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int ok = sendmsg(l->fd, &msg, MSG_NOSIGNAL) == len;
+    close(memfd);          /* el mapeo sigue vivo; el collector tiene su copia */
+    if (!ok) {
+        munmap(p, map_len);
+        close(efd);
+        return;
+    }
+    l->ring = r;
+    l->ring_efd = efd;
+    l->ring_tail = 0;
+}
+
+/* Escribe buf (líneas completas) en el anillo. Devuelve 0 o -1 si no cabe. */
+static int shm_put(link_t *l, const char *buf, size_t len) {
+    shm_ring_t *r = l->ring;
+    uint64_t size = l->shm_size;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (size - (l->ring_tail - head) < len) return -1;
+
+    size_t off = l->ring_tail & (size - 1);
+    size_t first = len < size - off ? len : size - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, len - first);
+    l->ring_tail += len;
+    /* Publicamos y miramos si el collector duerme (ver shm_poll en collector.c) */
+    atomic_store(&r->tail, l->ring_tail);
+    if (atomic_load(&r->waiting)) {
+        uint64_t one = 1;
+        ssize_t w = write(l->ring_efd, &one, sizeof(one));
+        (void)w;            /* sólo falla si el contador desborda */
+    }
+    return 0;
+}
+
+/* Cierra el socket y programa el próximo intento con backoff y jitter. */
+void link_fail(link_t *l, long long now) {
+    shm_close(l);
+    if (l->fd != -1) close(l->fd);
+    l->fd = -1;
+    l->state = LINK_DOWN;
+    l->cur = NULL;
+    l->failures++;
+
+    if (l->failures % RERESOLVE_ROUNDS == 0) {
+        link_free_addrs(l);             /* la próxima ronda vuelve a resolver */
+        /* El nodo al que nos redirigieron no responde: volvemos al original,
+         * que nos dirá quién es ahora el dueño */
+        l->host = l->orig_host;
+        l->port = l->orig_port;
+    }
+
+    int shift = l->failures < 16 ? l->failures : 16;
+    long long cap = (long long)BACKOFF_BASE_MS << shift;
+    if (cap > BACKOFF_MAX_MS) cap = BACKOFF_MAX_MS;
+    long long wait = random() % (cap + 1);
+    l->next_attempt = now + wait;
+    fprintf(stderr, "No se pudo conectar a %s:%s, reintento en %lld ms\n",
+            l->host, l->port, wait);
+}
+
+/* Envia todo el buffer (sendall). Devuelve 0 si todo enviado, -1 en error. */
+int send_all(int fd, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        /* MSG_NOSIGNAL: si el collector se cae, error en vez de SIGPIPE */
+        ssize_t sent = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            perror("send");
+            return -1;
+        }
+        if (sent == 0) {
+            /* conexión cerrada inesperadamente */
+            return -1;
+        }
+        total += (size_t)sent;
+    }
+    return 0;
+}
+
+/* El connect terminó bien: dejamos el socket en modo bloqueante, pero con
+ * un tope de tiempo por send para que un collector atascado no frene el
+ * muestreo más de un periodo. */
+static void link_established(link_t *l) {
+    int fl = fcntl(l->fd, F_GETFL);
+    fcntl(l->fd, F_SETFL, fl & ~O_NONBLOCK);
+    struct timeval tv = { l->send_timeout_ms / 1000, (l->send_timeout_ms % 1000) * 1000 };
+    setsockopt(l->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* Lo primero que ve el collector es quiénes somos */
+    if (!l->udp && l->hello && send_all(l->fd, l->hello, strlen(l->hello)) != 0) {
+        link_fail(l, now_mono_ms());
+        return;
+    }
+    if (l->is_unix && !l->udp && l->shm_size)
+        shm_open_ring(l);
+
+    l->state = LINK_UP;
+    l->failures = 0;
+    l->fresh = 1;
+    l->rlen = 0;
+    fprintf(stderr, "Conectado a %s:%s\n", l->host, l->port);
+}
+
+/* Lanza un connect no bloqueante a la dirección l->cur o a las siguientes.
+ * Si ninguna dirección admite el intento, cuenta como ronda fallida. */
+static void link_try_next(link_t *l, long long now) {
+    for (; l->cur; l->cur = l->cur->ai_next) {
+        struct addrinfo *a = l->cur;
+        int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        a->ai_protocol);
+        if (fd == -1) continue;
+        /* En UDP connect sólo fija el destino y termina al momento */
+        if (l->udp && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            l->fd = fd;
+            link_established(l);
+            return;
+        }
+        if (!l->udp && (connect(fd, a->ai_addr, a->ai_addrlen) == 0 || errno == EINPROGRESS)) {
+            l->fd = fd;
+            l->state = LINK_CONNECTING;
+            l->deadline = now + CONNECT_TIMEOUT_MS;
+            return;
+        }
+        close(fd);
+    }
+    link_fail(l, now);
+}
+
+/* Avanza la máquina de estados: arranca intentos vencidos y corta los
+ * connect que superaron CONNECT_TIMEOUT_MS. */
+void link_step(link_t *l, long long now) {
+    if (l->state == LINK_DOWN && now >= l->next_attempt) {
+        if (!l->addrs && link_resolve(l) != 0) {
+            link_fail(l, now);
+            return;
+        }
+        l->cur = l->addrs;
+        link_try_next(l, now);
+    } else if (l->state == LINK_CONNECTING && now >= l->deadline) {
+        close(l->fd);                   /* probamos la siguiente dirección */
+        l->fd = -1;
+        l->cur = l->cur->ai_next;
+        link_try_next(l, now);
+    }
+}
+
+/* El socket en LINK_CONNECTING quedó listo para escribir: vemos si conectó. */
+void link_on_writable(link_t *l, long long now) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+        link_established(l);
+        return;
+    }
+    close(l->fd);
+    l->fd = -1;
+    l->cur = l->cur->ai_next;
+    link_try_next(l, now);
+}
+
+/* Envía buf por la conexión. En UDP las líneas se agrupan en datagramas de
+ * hasta UDP_PAYLOAD bytes (sin partir ninguna línea) y salen de a
+ * UDP_BATCH datagramas por llamada con sendmmsg. Devuelve 0 o -1. */
+#define UDP_PAYLOAD 1400     /* cabe en una trama Ethernet sin fragmentar */
+#define UDP_BATCH   64
+
+int link_send(link_t *l, const char *buf, size_t len) {
+    /* Con anillo, lo que no cabe sale por el socket */
+    if (l->ring && shm_put(l, buf, len) == 0)
+        return 0;
+    if (!l->udp)
+        return send_all(l->fd, buf, len);
+
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    size_t off = 0;
+    while (off < len) {
+        int n = 0;
+        for (; off < len && n < UDP_BATCH; n++) {
+            /* Tantas líneas completas como quepan (al menos una) */
+            size_t end = off;
+            while (end < len) {
+                const char *nl = memchr(buf + end, '\n', len - end);
+                size_t next = nl ? (size_t)(nl - buf) + 1 : len;
+                if (next - off > UDP_PAYLOAD && end > off) break;
+                end = next;
+            }
+            iov[n].iov_base = (void *)(buf + off);
+            iov[n].iov_len = end - off;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            off = end;
+        }
+        for (int sent = 0; sent < n; ) {
+            int r = sendmmsg(l->fd, msgs + sent, n - sent, 0);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            sent += r;
+        }
+    }
+    return 0;
+}
+
+/* Milisegundos que poll puede esperar sin perder un evento de la conexión
+ * (-1 si sólo hay que esperar al timer de muestreo o al socket). */
+int link_poll_timeout(const link_t *l, long long now) {
+    long long until;
+    if (l->state == LINK_DOWN) until = l->next_attempt;
+    else if (l->state == LINK_CONNECTING) until = l->deadline;
+    else return -1;
+    return until <= now ? 0 : (int)(until - now);
+}
+
+/* Se perdió una conexión establecida: se reintenta tras un backoff corto. */
+void link_lost(link_t *l, long long now) {
+    l->failures = 0;
+    link_fail(l, now);
+}
+
+/* El collector indicó (REDIRECT) que nuestro host lo atiende otro nodo del
+ * cluster: cerramos y conectamos en seguida a 'target' ("host:puerto"). */
+void link_redirect(link_t *l, const char *target, long long now) {
+    const char *colon = strrchr(target, ':');
+    if (!colon || colon == target || strlen(target) >= sizeof(l->redir)) return;
+    strcpy(l->redir, target);
+    l->redir[colon - target] = '\0';
+    colon = l->redir + (colon - target);
+    fprintf(stderr, "Redirigido a %s:%s\n", l->redir, colon + 1);
+
+    if (l->fd != -1) close(l->fd);
+    shm_close(l);
+    link_free_addrs(l);
+    l->fd = -1;
+    l->cur = NULL;
+    l->host = l->redir;
+    l->port = colon + 1;
+    l->state = LINK_DOWN;
+    l->failures = 0;
+    l->next_attempt = now;
+}
+
+/* Lee lo que el collector mandó por la conexión (TCP) y llama a on_line
+ * con cada línea completa, sin el '\n'. Las líneas que no caben en rbuf
+ * se descartan. Si el collector cerró o hubo un error, la conexión se da
+ * por perdida. on_line puede cerrar la conexión (REDIRECT): entonces no se
+ * procesa nada más. */
+void link_read(link_t *l, long long now, void (*on_line)(link_t *l, char *line)) {
+    ssize_t n = recv(l->fd, l->rbuf + l->rlen, sizeof(l->rbuf) - 1 - l->rlen, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "El collector cerró la conexión. Reintentando.\n");
+        link_lost(l, now);
+        return;
+    }
+    if (n < 0) return;
+    l->rlen += (size_t)n;
+
+    char *p = l->rbuf, *end = l->rbuf + l->rlen, *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        *nl = '\0';
+        on_line(l, p);
+        if (l->state != LINK_UP) {
+            l->rlen = 0;
+            return;
+        }
+        p = nl + 1;
+    }
+    l->rlen = end - p;
+    if (l->rlen == sizeof(l->rbuf) - 1) l->rlen = 0;   /* línea demasiado larga */
+    memmove(l->rbuf, p, l->rlen);
+}
+
+/* (Re)programa el timerfd para que venza cada 'period_ms', con el primer
+ * vencimiento alineado a un múltiplo del periodo en la hora real: todos los
+ * agentes con el mismo periodo muestrean en los mismos instantes.
+ * Devuelve 0 o -1 en error. */
+int arm_tick_timer(int tfd, long period_ms) {
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    /* Cuánto falta para el próximo múltiplo del periodo en hora real */
+    long long period_ns = period_ms * 1000000LL;
+    long long real_ns = real.tv_sec * 1000000000LL + real.tv_nsec;
+    long long wait_ns = period_ns - real_ns % period_ns;
+    long long first_ns = mono.tv_sec * 1000000000LL + mono.tv_nsec + wait_ns;
+
+    struct itimerspec its;
+    its.it_value.tv_sec = first_ns / 1000000000LL;
+    its.it_value.tv_nsec = first_ns % 1000000000LL;
+    its.it_interval.tv_sec = period_ms / 1000;
+    its.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("timerfd_settime");
+        return -1;
+    }
+    return 0;
+}
+
+/* Crea el timerfd CLOCK_MONOTONIC de muestreo (ver arm_tick_timer).
+ * Devuelve el fd o -1 en error. */
+int make_tick_timer(long period_ms) {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+    if (arm_tick_timer(tfd, period_ms) != 0) {
+        close(tfd);
+        return -1;
+    }
+    return tfd;
+}
+
+/* Espera al siguiente vencimiento del timer. Devuelve el número de periodos
+ * vencidos (más de 1 si nos retrasamos) o 0 si lo interrumpió una señal. */
+unsigned long long wait_tick(int tfd) {
+    uint64_t expirations;
+    ssize_t r = read(tfd, &expirations, sizeof(expirations));
+    if (r != sizeof(expirations)) return 0;
+    return expirations;
+}
+
+/* Muestra el tiempo de CPU consumido por el propio agente (getrusage). */
+void report_own_cpu(const char *name) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return;
+    fprintf(stderr, "%s: CPU propia usr=%ld.%03lds sys=%ld.%03lds\n", name,
+            (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+            (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000);
+}
+
+/* ---------------------- MAIN ------------------------ */
+
+#define BURST_PERIODS 2   /* periodos de muestreo rápido tras un cambio */
+#define BATCH_MAX     16  /* tope de ticks por envío que acepta un CTL */
+
+static const char *ip_logica;      /* nombre lógico del agente */
+static int verbose;                /* log de cada envío */
+static int replay_per_tick;        /* líneas del spool reenviadas por tick */
+static long replay_rate = 100;     /* -R: líneas/s reenviadas del spool */
+static long hb_ms;                 /* intervalo de heartbeat con -d */
+static long long last_hb;          /* ms monotónicos del último heartbeat */
+static int tick_fd = -1;           /* timerfd de muestreo */
+static long base_period_ms;        /* periodo pedido en la línea de comandos */
+static long period_ms;             /* periodo vigente (un CTL puede alargarlo) */
+static long fast_ms;               /* -F: periodo rápido del muestreo adaptativo */
+static long stride = 1;            /* ticks del timer por periodo */
+
+/* Control de ritmo pedido por el collector (líneas CTL) */
+static int batch_ticks = 1;        /* ticks que se juntan en un solo envío */
+static int paused[N_ALL_SOURCES];  /* fuentes pausadas (índice en sources[]) */
+static int announce_hb;            /* anunciar el nuevo intervalo en el próximo tick */
+static char batch_buf[65536];      /* líneas con "@ts;" a la espera del envío */
+static size_t batch_len;
+static int batch_n;                /* ticks acumulados en batch_buf */
+
+/* Fija el periodo de muestreo vigente: recalcula el paso del muestreo
+ * adaptativo (ver main) y el ritmo de reenvío del spool, y reprograma el
+ * timer si ya existe. Devuelve 0 o -1. */
+int set_period(long ms) {
+    period_ms = ms;
+    stride = 1;
+    if (deadband >= 0 && fast_ms < period_ms) stride = period_ms / fast_ms;
+    /* Líneas del spool que se reenvían como máximo en cada tick */
+    replay_per_tick = (int)((replay_rate * period_ms + 999) / 1000);
+    return tick_fd == -1 ? 0 : arm_tick_timer(tick_fd, period_ms / stride);
+}
+
+/* ¿Aparece 'name' en la lista separada por comas? */
+static int in_list(const char *list, const char *name) {
+    size_t n = strlen(name);
+    for (const char *p = list; *p; ) {
+        size_t len = strcspn(p, ",");
+        if (len == n && strncmp(p, name, n) == 0) return 1;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return 0;
+}
+
+/* Aplica una línea CTL del collector:
+ *   CTL;interval=<ms>;batch=<n>;pause=<fuente,...>
+ * con la que pide bajar el ritmo cuando no da abasto (y recuperarlo
+ * después). Las claves que faltan no cambian nada. El periodo nunca baja
+ * del pedido en la línea de comandos. */
+void apply_ctl(char *line) {
+    char *save, *kv;
+    for (kv = strtok_r(line + 4, ";", &save); kv; kv = strtok_r(NULL, ";", &save)) {
+        if (strncmp(kv, "interval=", 9) == 0) {
+            long ms = atol(kv + 9);
+            if (ms < base_period_ms) ms = base_period_ms;
+            if (ms != period_ms) {
+                fprintf(stderr, "Collector: periodo %ld -> %ld ms\n", period_ms, ms);
+                set_period(ms);
+                announce_hb = 1;
+            }
+        } else if (strncmp(kv, "batch=", 6) == 0) {
+            int n = atoi(kv + 6);
+            if (n < 1) n = 1;
+            if (n > BATCH_MAX) n = BATCH_MAX;
+            if (n != batch_ticks) {
+                fprintf(stderr, "Collector: %d ticks por envío\n", n);
+                batch_ticks = n;
+                announce_hb = 1;
+            }
+        } else if (strncmp(kv, "pause=", 6) == 0) {
+            for (size_t i = 0; i < n_sources; i++) {
+                int p = in_list(kv + 6, sources[i]->name);
+                if (p != paused[i])
+                    fprintf(stderr, "Collector: fuente %s %s\n", sources[i]->name,
+                            p ? "pausada" : "reanudada");
+                paused[i] = p;
+            }
+        }
+    }
+}
+
+/* Línea recibida del collector: CTL (control de ritmo) o REDIRECT (el host
+ * lo atiende otro nodo del cluster). Las demás se ignoran. */
+void on_collector_line(link_t *link, char *line) {
+    if (strncmp(line, "CTL;", 4) == 0)
+        apply_ctl(line);
+    else if (strncmp(line, "REDIRECT;", 9) == 0)
+        link_redirect(link, line + 9, now_mono_ms());
+}
+
+/* Un tick de muestreo: cada fuente muestrea y añade sus líneas al buffer
+ * compartido, que sale en un solo envío. Sin conexión, va al spool. Con -d
+ * sólo van las fuentes que salieron de su banda muerta, más un heartbeat
+ * cada hb_ms. Si el collector pidió lotes (batch > 1), las líneas se
+ * guardan con su marca de tiempo y salen juntas cada batch_ticks ticks.
+ * 'replay' indica si en este tick toca reenviar del spool.
+ * Devuelve cuántas fuentes cambiaron. */
+int do_tick(link_t *link, int replay) {
+    static char msg[4096];
+    long long ts_ms = now_wall_ms();
+    size_t len = 0;
+    int changed = 0;
+    /* Por TCP la conexión ya se identificó con HELLO: las líneas van sin
+     * nombre. También las que van al spool, que sólo se reenvían por una
+     * conexión nueva (con su HELLO). UDP no tiene sesión. */
+    const char *name = link->udp ? ip_logica : "";
+    for (size_t i = 0; i < n_sources; i++) {
+        if (paused[i])
+            continue;   /* el collector pidió no muestrearla */
+        if (sources[i]->sample() != 0)
+            continue;   /* error o todavía sin datos: se reintenta en el próximo tick */
+        if (!deadband_changed(i))
+            continue;   /* dentro de la banda: lo enviado sigue vigente */
+        changed++;
+        int n = sources[i]->encode(msg + len, sizeof(msg) - len, name);
+        if (n < 0) {
+            fprintf(stderr, "Error construyendo el mensaje de %s\n", sources[i]->name);
+            continue;
+        }
+        len += (size_t)n;
+    }
+
+    /* El heartbeat también anuncia el intervalo a un collector recién
+     * conectado, que así ajusta su umbral STALE para este host. Si un CTL
+     * espació los envíos, se anuncia en seguida el nuevo intervalo para que
+     * el host no pase a STALE. */
+    long long now = now_mono_ms();
+    if ((deadband >= 0 && (link->fresh || now - last_hb >= hb_ms)) || announce_hb) {
+        long every = period_ms * batch_ticks;
+        int n = snprintf(msg + len, sizeof(msg) - len, "HB;%s;%ld\n", name,
+                         hb_ms > every ? hb_ms : every);
+        if (n > 0 && (size_t)n < sizeof(msg) - len) {
+            len += (size_t)n;
+            last_hb = now;
+            link->fresh = 0;
+            announce_hb = 0;
+        }
+    }
+
+    if (link->state != LINK_UP) {
+        /* Guardamos la muestra (y el lote pendiente); se reenviará al reconectar */
+        if (spool) {
+            spool_stamped(batch_buf, batch_len);
+            spool_lines(msg, len, ts_ms);
+        }
+        batch_len = 0;
+        batch_n = 0;
+        return changed;
+    }
+
+    const char *out = msg;
+    size_t out_len = len;
+    if (batch_ticks > 1 || batch_len > 0) {
+        /* Modo lote: el envío sale al completar batch_ticks ticks (o antes
+         * si el buffer va por la mitad) */
+        batch_len += stamp_lines(batch_buf + batch_len, sizeof(batch_buf) - batch_len,
+                                 msg, len, ts_ms);
+        if (++batch_n < batch_ticks && batch_len < sizeof(batch_buf) / 2)
+            return changed;
+        out = batch_buf;
+        out_len = batch_len;
+        batch_len = 0;
+        batch_n = 0;
+    }
+
+    /* Un solo envío con las líneas de todas las fuentes */
+    if (out_len > 0 && link_send(link, out, out_len) != 0) {
+        fprintf(stderr, "Fallo al enviar. Cerrando socket y reintentando.\n");
+        link_lost(link, now_mono_ms());
+        if (spool) {
+            if (out == batch_buf) spool_stamped(out, out_len);
+            else spool_lines(msg, len, ts_ms);
+        }
+        return changed;
+    } else if (out_len > 0 && verbose) {
+        /* Envío OK: log local en stderr */
+        fprintf(stderr, "Enviado: %.*s", (int)out_len, out);
+    }
+
+    /* Reenviamos una tanda limitada de lo pendiente en el spool */
+    if (replay && spool && spool->tail > spool->head) {
+        static char replay_buf[65536];
+        uint64_t new_head;
+        size_t rlen = spool_peek(replay_buf, sizeof(replay_buf), replay_per_tick, &new_head);
+        if (link_send(link, replay_buf, rlen) == 0) {
+            spool_commit(new_head);
+        } else {
+            fprintf(stderr, "Fallo al reenviar el spool. Cerrando socket.\n");
+            link_lost(link, now_mono_ms());
+        }
+    }
+    return changed;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [-u] [-m KB] [-s spool] [-S KB] [-D oldest|newest] [-R lineas_s]\n"
+            "          [-d puntos] [-H heartbeat_ms] [-F periodo_rapido_ms] [-N top_procesos]\n"
+            "          <ip_recolector> <puerto> <ip_logica_agente> [periodo_ms] [fuentes]\n"
+            "  fuentes: lista separada por comas (por defecto %s)\n",
+            prog, AGENT_DEFAULT_SOURCES);
+}
+
+int main(int argc, char *argv[]) {
+    const char *spool_path = NULL;
+    long spool_kb = 1024;
+    int c;
+    int udp = 0;
+    long shm_kb = 0;
+    while ((c = getopt(argc, argv, "s:S:D:R:d:H:F:N:um:")) != -1) {
+        switch (c) {
+        case 'u': udp = 1; break;
+        case 'm': shm_kb = atol(optarg); break;
+        case 'N': proc_top_n = atoi(optarg); break;
+        case 'd': deadband = atof(optarg); break;
+        case 'H': hb_ms = atol(optarg); break;
+        case 'F': fast_ms = atol(optarg); break;
+        case 's': spool_path = optarg; break;
+        case 'S': spool_kb = atol(optarg); break;
+        case 'R': replay_rate = atol(optarg); break;
+        case 'D':
+            if (strcmp(optarg, "oldest") == 0) spool_policy = DROP_OLDEST;
+            else if (strcmp(optarg, "newest") == 0) spool_policy = DROP_NEWEST;
+            else { usage(argv[0]); return EXIT_FAILURE; }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int npos = argc - optind;
+    if (npos < 3 || npos > 5 || spool_kb <= 0 || replay_rate <= 0 ||
+        hb_ms < 0 || fast_ms < 0 || proc_top_n < 1 || proc_top_n > PROC_TOP_MAX ||
+        shm_kb < 0 || (shm_kb & (shm_kb - 1)) || (shm_kb && (shm_kb < 4 || shm_kb > 65536))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *ip_recolector = argv[optind];
+    const char *puerto_str = argv[optind + 1];
+    const char *ip_logica_agente = argv[optind + 2];
+    base_period_ms = (npos >= 4) ? atol(argv[optind + 3]) : 2000; /* intervalo de envío */
+    const char *source_list = (npos == 5) ? argv[optind + 4] : AGENT_DEFAULT_SOURCES;
+
+    if (base_period_ms < 10) {
+        fprintf(stderr, "El periodo mínimo es 10 ms\n");
+        return EXIT_FAILURE;
+    }
+    if (select_sources(source_list) != 0)
+        return EXIT_FAILURE;
+    if (spool_path && spool_open(spool_path, (uint64_t)spool_kb * 1024) != 0)
+        return EXIT_FAILURE;
+
+    /* Muestreo adaptativo (sólo con -d): el timer va a periodo_rapido y en
+     * calma se muestrea una vez por periodo; cuando una fuente sale de su
+     * banda se muestrea en cada tick rápido durante BURST_PERIODS periodos
+     * para no perder la forma del pico. */
+    if (deadband >= 0) {
+        if (hb_ms == 0) hb_ms = 5 * base_period_ms;
+        if (fast_ms == 0) fast_ms = base_period_ms / 4;
+        if (fast_ms < 10) fast_ms = 10;
+    }
+    set_period(base_period_ms);
+    for (size_t i = 0; i < n_sources; i++) {
+        if (sources[i]->init() != 0) {
+            fprintf(stderr, "No se pudo iniciar la fuente %s\n", sources[i]->name);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Capturar SIGINT para terminar ordenadamente */
+    struct sigaction sa;
+    sa.sa_handler = handle_sigint;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+
+    int tfd = tick_fd = make_tick_timer(period_ms / stride);
+    if (tfd == -1) return EXIT_FAILURE;
+
+    /* Con periodos cortos no escribimos una línea de log por envío */
+    verbose = period_ms >= 1000;
+    ip_logica = ip_logica_agente;
+
+    /* La conexión se establece en segundo plano desde el bucle */
+    link_t link;
+    link_init(&link, ip_recolector, puerto_str, period_ms < 1000 ? period_ms : 1000);
+    link.udp = udp;
+    link.shm_size = (size_t)shm_kb * 1024;
+
+    /* Identificación y metadatos, una vez por conexión */
+    static char hello[256];
+    snprintf(hello, sizeof(hello), "HELLO;%s;agent=%s;period_ms=%ld;sources=%s\n",
+             ip_logica, AGENT_NAME, period_ms, source_list);
+    link.hello = hello;
+
+    long burst = 0;                 /* ticks rápidos que quedan de ráfaga */
+    long long last_slot = -1;       /* último periodo en que se muestreó */
+
+    while (keep_running) {
+        /* Esperamos al timer de muestreo, al connect en curso, a una línea
+         * del collector o al próximo reintento, lo que llegue antes (SIGINT
+         * interrumpe poll) */
+        struct pollfd pfd[2];
+        int nfds = 1;
+        pfd[0].fd = tfd;
+        pfd[0].events = POLLIN;
+        if (link.state == LINK_CONNECTING || (link.state == LINK_UP && !link.udp)) {
+            pfd[1].fd = link.fd;
+            pfd[1].events = link.state == LINK_CONNECTING ? POLLOUT : POLLIN;
+            nfds = 2;
+        }
+        int r = poll(pfd, nfds, link_poll_timeout(&link, now_mono_ms()));
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        long long now = now_mono_ms();
+        if (nfds == 2 && pfd[1].revents) {
+            if (pfd[1].events == POLLOUT) link_on_writable(&link, now);
+            else link_read(&link, now, on_collector_line);
+        }
+        link_step(&link, now);
+
+        if (pfd[0].revents & POLLIN) {
+            unsigned long long ticks = wait_tick(tfd);
+            if (ticks > 1 && verbose)
+                fprintf(stderr, "Aviso: %llu periodos perdidos\n", ticks - 1);
+            if (ticks == 0) continue;
+            burst = burst > (long)ticks ? burst - (long)ticks : 0;
+
+            /* Las muestras en calma siguen alineadas a periodo_ms */
+            long long slot = now_wall_ms() / period_ms;
+            if (stride == 1 || burst > 0 || slot != last_slot) {
+                int base = stride == 1 || slot != last_slot;
+                last_slot = slot;
+                if (do_tick(&link, base) > 0 && stride > 1)
+                    burst = BURST_PERIODS * stride;
+            }
+        }
+    }
+
+    if (link.fd != -1) close(link.fd);
+    for (size_t i = 0; i < n_sources; i++)
+        sources[i]->fini();
+    close(tfd);
+    if (spool && spool->dropped > 0)
+        fprintf(stderr, "Spool: %llu líneas descartadas por falta de espacio\n",
+                (unsigned long long)spool->dropped);
+    report_own_cpu(AGENT_NAME);
+    fprintf(stderr, AGENT_NAME " terminado.\n");
+    return EXIT_SUCCESS;
+}
@@ -5,262 +5,3891 @@
  *
  * ./collector <puerto>
  *
- * Acepta múltiples conexiones TCP, recibe líneas tipo:
+ * Acepta múltiples conexiones TCP y datagramas UDP en el mismo puerto, y
+ * recibe líneas tipo:
  *  MEM;ip;memUsed;memFree;swapTotal;swapFree
- *  CPU;ip;cpuUsage;userPct;sysPct;idlePct
+ *  CPU;ip;cpuUsage;userPct;sysPct;idlePct[;iowaitPct;stealPct;nCores;vector]
+ *  HB;ip;intervalo_ms
+ *  PROC;ip;nProcs;topCpu;topRss
+ *  HELLO;ip[;clave=valor...]
+ *
+ * Por TCP un agente puede identificarse una vez con HELLO; a partir de ahí
+ * sus líneas llevan 'ip' vacío ("CPU;;...") y van a la entrada de su host.
+ * Por esa misma conexión el collector le puede devolver
+ *  CTL;interval=<ms>;batch=<n>;pause=<fuente,...>
+ * para que baje el ritmo cuando la ingesta se atrasa (ver CONTROL DE INGESTA).
+ *
+ * Los agentes con supresión por banda muerta sólo envían CPU/MEM cuando los
+ * valores cambian y mandan "HB" cada intervalo_ms para indicar que siguen
+ * vivos y que lo último enviado sigue vigente.
+ *
+ * Por UDP cada datagrama lleva una o más líneas de datos completas (sólo
+ * texto; los comandos STATS/HISTORY/TOP necesitan TCP para la respuesta).
+ *
+ * Cualquier línea de datos puede ir precedida de "@<epoch_ms>;" con el instante
+ * en que se tomó la muestra (los agentes lo usan al reenviar muestras que no
+ * pudieron enviar). Sin prefijo se toma la hora de llegada.
+ *
+ * En las líneas PROC, topCpu y topRss son listas "pid:comando:cpuPct:rssMB"
+ * separadas por ',' con los procesos que más CPU y más memoria usan.
+ *
+ * En las líneas CPU, 'vector' lleva el uso de cada núcleo como dos dígitos
+ * hexadecimales (00..64) por núcleo.
  *
  * Mantiene una tabla con la última info por IP y un hilo visualizador
  * que imprime cada 2 segundos.
+ *
+ * Opciones:
+ *  -a <archivo>  reglas de alerta (ver sección ALERT RULES más abajo)
+ *  -A <destino>  destino de los eventos de alerta: un archivo de log
+ *                (por defecto "alerts.log") o "unix:<ruta>" para enviarlos
+ *                como datagramas a un socket Unix.
+ *  -I <seg>      intervalo de envío esperado de los agentes (por defecto 2)
+ *  -S <n>        marca un host como STALE tras n intervalos sin datos (3)
+ *  -T <seg>      libera la entrada de un host tras <seg> sin datos (60)
+ *  -t <seg>      cierra conexiones que no envían una línea completa en <seg>
+ *                segundos (30)
+ *  -U <host:puerto> modo relay: además de mostrarlos, reenvía cada -I
+ *                segundos los datos de sus hosts (medias y últimos valores)
+ *                a un collector padre por una conexión TCP (ver THREAD: RELAY)
+ *  -C <nodos>    cluster: lista "host:puerto,..." de collectors que se
+ *                reparten los hosts por hash consistente (ver CLUSTER)
+ *  -M <nodo>     con -C, cuál de los nodos de la lista es este
+ *  -L <ruta>     acepta también agentes locales por un socket Unix, que
+ *                pueden enviar por un anillo en memoria compartida (ver
+ *                INGESTA POR MEMORIA COMPARTIDA)
+ *  -W <n>        workers que parsean y aplican las líneas (2, máximo
+ *                WORKERS_MAX); cada uno es dueño de una parte de la tabla
+ *                de hosts (ver WORKERS)
+ *  -c <n>        conexiones abiertas a la vez (256); las demás se cierran
+ *                al aceptarlas
+ *  -H <n>        hosts que caben en la tabla (64); la parte de cada
+ *                worker tiene -H / -W entradas más un margen (ver table_plan)
+ *  -B <MB>       presupuesto de memoria (ver PRESUPUESTO DE MEMORIA); sin
+ *                -c, el límite de conexiones sale de él
+ *  -P <cpus>     fija los workers a estas CPUs, p. ej. "0-3" (ver AFINIDAD
+ *                Y NUMA)
+ *  -E <cpus>     limita los hilos de E/S a estas CPUs y atiende cada
+ *                conexión en la CPU que recibe sus paquetes
+ *  -X <nombre>   publica la tabla de hosts en el segmento de memoria
+ *                compartida <nombre> (p. ej. "/collector"), con el formato
+ *                de collector_shm.h (ver EXPORTACIÓN EN MEMORIA COMPARTIDA)
  */
 
-// Definimos esta macro para habilitar ciertas funciones POSIX (como sigaction)
-// según el estándar POSIX 2008. Esto puede afectar qué funciones expone la libc.
-#define _POSIX_C_SOURCE 200809L
+// Definimos esta macro para habilitar ciertas funciones POSIX (como sigaction)
+// según el estándar POSIX 2008. Esto puede afectar qué funciones expone la libc.
+#define _POSIX_C_SOURCE 200809L
+// recvmmsg es una extensión de Linux.
+#define _GNU_SOURCE
+
+// Includes estándar de C
+#include <stdio.h>      // printf, fprintf, etc.
+#include <stdarg.h>     // va_list (buf_printf)
+#include <stdlib.h>     // malloc, free, atof, exit...
+#include <string.h>     // memset, strcmp, strncpy, strtok...
+#include <unistd.h>     // close, sleep, read, write...
+#include <errno.h>      // errno y mensajes de error
+#include <signal.h>     // manejo de señales (sigaction, SIGINT)
+#include <pthread.h>    // hilos POSIX (pthread_t, pthread_create, mutex...)
+#include <ctype.h>      // funciones sobre caracteres (isspace en el parser de reglas)
+#include <time.h>       // clock_gettime, nanosleep, time, strftime
+#include <math.h>       // isfinite (valores que mandan los agentes)
+#include <stdint.h>     // uint64_t (ticks de la rueda de temporizadores)
+#include <stdatomic.h>  // campos atómicos compartidos con el hilo temporizador
+#include <semaphore.h>  // sem_t: despertar a los workers cuando llega una tanda
+#include <sched.h>      // sched_yield, sched_getcpu, cpu_set_t (afinidad de los hilos)
+
+// Includes para sockets
+#include <sys/types.h>  // tipos como socklen_t
+#include <sys/socket.h> // socket, bind, listen, accept, recv...
+#include <netdb.h>      // getaddrinfo, struct addrinfo
+#include <arpa/inet.h>  // funciones para direcciones IP (inet_ntoa, etc.)
+#include <sys/un.h>     // struct sockaddr_un (destino de alertas "unix:")
+#include <sys/time.h>   // struct timeval (SO_RCVTIMEO del socket UDP)
+#include <sys/ioctl.h>  // ioctl(FIONREAD): bytes pendientes en un socket
+#include <poll.h>       // poll (consultas en paralelo, socket + eventfd)
+#include <fcntl.h>      // F_GET_SEALS (memfd de los agentes locales)
+#include <sys/mman.h>   // mmap del anillo compartido con un agente local
+#include <sys/stat.h>   // fstat del memfd, chmod del socket Unix
+
+#include "collector_shm.h"  // Formato de la tabla exportada con -X
+
+// Número de hosts (IPs) que se pueden almacenar simultáneamente si no se
+// indica otro con -H
+#define DEFAULT_HOSTS 64
+
+// Tamaño máximo de línea de texto que esperamos recibir por el socket
+// (una línea CPU con el vector de 256 núcleos ocupa unos 600 bytes)
+#define MAX_LINE 1024
+
+// Máximo número de núcleos por host que se guardan
+#define MAX_CORES 256
+
+// Variable global que indica si el programa debe seguir corriendo.
+// Se marca como volatile y de tipo sig_atomic_t para que sea segura
+// al modificarla desde un manejador de señal.
+volatile sig_atomic_t keep_running = 1;
+
+/**************** TIMING WHEEL ****************/
+// Rueda de temporizadores jerárquica (al estilo del kernel de Linux).
+// El tiempo avanza en ticks de TW_TICK_MS. Hay TW_LEVELS niveles de TW_SIZE
+// ranuras: el nivel 0 cubre los próximos 64 ticks con resolución de 1 tick,
+// el nivel 1 los próximos 64*64 con resolución de 64 ticks, etc. Cuando el
+// nivel 0 da la vuelta, la ranura correspondiente del nivel 1 se "cascadea"
+// (sus temporizadores se reinsertan y bajan de nivel).
+// Insertar, cancelar y disparar son O(1); los temporizadores son nodos
+// intrusivos de una lista doblemente enlazada, sin memoria dinámica.
+//
+// La rueda no tiene mutex propio: quien la usa la protege con su propio lock
+// y los callbacks se ejecutan con ese lock tomado.
+
+#define TW_TICK_MS 100   // Resolución de un tick (ms)
+#define TW_BITS    6
+#define TW_SIZE    (1 << TW_BITS)   // 64 ranuras por nivel
+#define TW_MASK    (TW_SIZE - 1)
+#define TW_LEVELS  4     // 64^4 ticks de 100 ms = unos 19 días de horizonte
+
+typedef struct tw_timer {
+    struct tw_timer *next, *prev;   // Enlaces en la lista de la ranura
+    uint64_t expires;               // Tick absoluto de vencimiento
+    void (*cb)(struct tw_timer *t, void *arg); // Función al vencer
+    void *arg;                      // Argumento para cb
+} tw_timer_t;
+
+typedef struct {
+    uint64_t now;                          // Último tick procesado
+    tw_timer_t slots[TW_LEVELS][TW_SIZE];  // Cabeceras (listas circulares)
+} twheel_t;
+
+// Reloj monotónico en segundos (no le afectan los cambios de hora).
+double now_mono(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Convierte segundos monotónicos a ticks de la rueda.
+uint64_t tw_ticks(double sec) {
+    return (uint64_t)(sec * 1000.0 / TW_TICK_MS);
+}
+
+// Inicializa la rueda en el tick 'now' con todas las ranuras vacías.
+void tw_init(twheel_t *w, uint64_t now) {
+    w->now = now;
+    for (int l = 0; l < TW_LEVELS; l++)
+        for (int i = 0; i < TW_SIZE; i++)
+            w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+}
+
+// Indica si el temporizador está insertado en alguna ranura.
+int tw_pending(const tw_timer_t *t) {
+    return t->next != NULL;
+}
+
+// Inserta 't' en la ranura que corresponde a su vencimiento.
+// Requiere t->expires >= w->now.
+static void tw_link(twheel_t *w, tw_timer_t *t) {
+    uint64_t delta = t->expires - w->now;
+
+    // Elegimos el nivel más bajo cuyo rango cubre el vencimiento.
+    int level = 0;
+    while (level < TW_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TW_BITS * (level + 1))))
+        level++;
+    // Más allá del horizonte: se queda en el último nivel y se recascadea.
+    uint64_t at = t->expires;
+    uint64_t max = w->now + ((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1;
+    if (at > max) at = max;
+
+    tw_timer_t *head = &w->slots[level][(at >> (TW_BITS * level)) & TW_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// Programa 't' para que venza en el tick 'expires' (lo mueve si ya estaba).
+void tw_schedule(twheel_t *w, tw_timer_t *t, uint64_t expires) {
+    if (tw_pending(t)) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+    }
+    // Un vencimiento ya pasado se dispara en el próximo tick.
+    t->expires = expires > w->now ? expires : w->now + 1;
+    tw_link(w, t);
+}
+
+// Cancela 't' si estaba programado.
+void tw_cancel(tw_timer_t *t) {
+    if (!tw_pending(t)) return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// Reinserta todos los temporizadores de una ranura (bajan de nivel).
+static void tw_cascade(twheel_t *w, int level, int idx) {
+    tw_timer_t *head = &w->slots[level][idx];
+    tw_timer_t *t = head->next;
+    head->next = head->prev = head;
+    while (t != head) {
+        tw_timer_t *next = t->next;
+        tw_link(w, t);
+        t = next;
+    }
+}
+
+// Avanza la rueda hasta el tick 'now' ejecutando los temporizadores vencidos.
+// Los callbacks pueden volver a programar su propio temporizador.
+void tw_advance(twheel_t *w, uint64_t now) {
+    while (w->now < now) {
+        w->now++;
+        int idx = w->now & TW_MASK;
+
+        // Al completar una vuelta de un nivel bajamos la ranura del siguiente.
+        for (int l = 1; l < TW_LEVELS; l++) {
+            if (((w->now >> (TW_BITS * (l - 1))) & TW_MASK) != 0) break;
+            tw_cascade(w, l, (w->now >> (TW_BITS * l)) & TW_MASK);
+        }
+
+        // Sacamos la lista de la ranura antes de ejecutar los callbacks.
+        tw_timer_t *head = &w->slots[0][idx];
+        tw_timer_t *t = head->next;
+        head->next = head->prev = head;
+        while (t != head) {
+            tw_timer_t *next = t->next;
+            t->next = t->prev = NULL;
+            if (t->expires <= w->now)
+                t->cb(t, t->arg);
+            else
+                tw_link(w, t);   // recortado por el horizonte: sigue esperando
+            t = next;
+        }
+    }
+}
+
+/**************** HISTORY ****************/
+// Historial reciente de cada host: los últimos HISTORY_LEN puntos de una
+// métrica, ordenados por la marca de tiempo de la muestra. Las muestras en
+// vivo se añaden al final en O(1); las reenviadas por un agente tras una
+// desconexión (más antiguas) se insertan en su sitio.
+
+#define HISTORY_LEN 120   // 4 minutos a un punto cada 2 s
+
+typedef struct {
+    int64_t ts_ms;        // Instante de la muestra (ms desde epoch)
+    float value;
+} hist_point_t;
+
+typedef struct {
+    hist_point_t pts[HISTORY_LEN];   // Buffer circular
+    int start;                       // Índice del punto más antiguo
+    int n;                           // Puntos guardados
+} history_t;
+
+// Punto i-ésimo en orden cronológico (0 = el más antiguo).
+hist_point_t *history_at(history_t *hh, int i) {
+    return &hh->pts[(hh->start + i) % HISTORY_LEN];
+}
+
+// Igual, para leer una copia que no se puede modificar (instantáneas).
+const hist_point_t *history_get(const history_t *hh, int i) {
+    return &hh->pts[(hh->start + i) % HISTORY_LEN];
+}
+
+// Inserta un punto manteniendo el orden por marca de tiempo. Si el
+// historial está lleno se descarta el más antiguo (o el nuevo, si es aún
+// más antiguo que todos).
+void history_add(history_t *hh, int64_t ts_ms, float value) {
+    if (hh->n == HISTORY_LEN) {
+        if (ts_ms < history_at(hh, 0)->ts_ms) return;
+        hh->start = (hh->start + 1) % HISTORY_LEN;
+        hh->n--;
+    }
+    // Desplazamos una posición los puntos más recientes que el nuevo.
+    int i = hh->n;
+    while (i > 0 && history_at(hh, i - 1)->ts_ms > ts_ms) {
+        *history_at(hh, i) = *history_at(hh, i - 1);
+        i--;
+    }
+    history_at(hh, i)->ts_ms = ts_ms;
+    history_at(hh, i)->value = value;
+    hh->n++;
+}
+
+// Hora real en milisegundos desde epoch (marca de tiempo de las muestras).
+int64_t now_wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Máximo de procesos por lista en las líneas PROC
+#define PROC_TOP_MAX 8
+// Tope de los valores de un proceso: %CPU (100 por núcleo) y MB residentes
+// (1 PB). Con ellos una línea de TOP ocupa menos de PROC_LINE_MAX bytes.
+#define PROC_CPU_MAX  (100.0f * MAX_CORES)
+#define PROC_RSS_MAX  1e9f
+#define PROC_LINE_MAX 64
+
+// Un proceso de las listas top-N de un host.
+typedef struct {
+    int pid;
+    char comm[16];               // Nombre del ejecutable (truncado como en /proc)
+    float cpu;                   // % de CPU (de un núcleo, puede pasar de 100)
+    float rss_mb;                // Memoria residente (MB)
+} proc_entry_t;
+
+// Nombre de host registrado (ver NOMBRES DE HOSTS): 1..max, 0 es ninguno.
+typedef uint32_t name_id_t;
+
+#define NAME_MAX_LEN 255         // Largo máximo de un nombre de host
+
+// Estructura que almacena la información de un host (una IP).
+typedef struct {
+    _Atomic uint32_t seq;        // Seqlock: impar mientras el worker dueño escribe
+    name_id_t id;                // Nombre o IP del host (0 si la entrada está libre)
+    float cpu_usage;             // Porcentaje de uso total de CPU
+    float cpu_user;              // Porcentaje de tiempo de CPU en modo usuario
+    float cpu_sys;               // Porcentaje de tiempo de CPU en modo sistema
+    float cpu_idle;              // Porcentaje de tiempo de CPU inactiva
+    float cpu_iowait;            // Porcentaje de tiempo esperando E/S
+    float cpu_steal;             // Porcentaje de tiempo robado por el hipervisor
+    int ncores;                  // Núcleos en core_pct (0 si el agente no los envía)
+    int core_max_idx;            // Núcleo más cargado
+    unsigned char core_pct[MAX_CORES]; // Uso de cada núcleo (0..100)
+    float mem_used;              // Memoria usada (en MB)
+    float mem_free;              // Memoria libre (en MB)
+    float swap_t;                // Swap total (en MB)
+    float swap_f;                // Swap libre (en MB)
+    int has_cpu;                 // Bandera: 1 si ya hay datos de CPU válidos
+    int has_mem;                 // Bandera: 1 si ya hay datos de memoria válidos
+    int has_procs;               // Bandera: 1 si ya hay listas de procesos
+    int nprocs;                  // Procesos en el host
+    int n_top_cpu, n_top_rss;    // Entradas válidas de cada lista
+    proc_entry_t top_cpu[PROC_TOP_MAX]; // Procesos con más CPU (de mayor a menor)
+    proc_entry_t top_rss[PROC_TOP_MAX]; // Procesos con más memoria residente
+    int64_t cpu_ts;              // Marca de tiempo (ms) de los datos de CPU actuales
+    int64_t mem_ts;              // Marca de tiempo (ms) de los datos de memoria actuales
+    int64_t procs_ts;            // Marca de tiempo (ms) de las listas de procesos
+    history_t cpu_hist;          // Historial de cpu_usage
+    history_t mem_hist;          // Historial de mem_used
+    double last_seen;            // Instante (monotónico) del último mensaje
+    int stale;                   // 1 si lleva demasiados intervalos sin datos
+    double hb_interval;          // Intervalo de heartbeat del agente (s), 0 si no envía HB
+    int pinned;                  // Conexiones enlazadas con HELLO (no se libera)
+    char meta[96];               // Metadatos del HELLO (agente, periodo, fuentes)
+    // Acumulados para el collector padre (modo relay, -U). Sólo crecen: el
+    // hilo relay recuerda los de su vuelta anterior y reenvía la diferencia
+    uint32_t relay_n_cpu, relay_n_mem; // Muestras recibidas
+    uint32_t relay_n_procs;      // Líneas PROC recibidas
+    uint32_t relay_n_hb;         // Heartbeats (sigue vivo sin cambios)
+    double relay_cpu[6];         // Sumas de usage, user, sys, idle, iowait, steal
+    double relay_mem[4];         // Sumas de used, free, swapT, swapF
+    tw_timer_t timer;            // Temporizador de caducidad en la rueda de su worker
+} host_info_t;
+
+// Tabla global que guarda la información de hasta max_hosts máquinas (-H).
+// Se reserva entera al arrancar (su tamaño no depende de la carga) y cada
+// worker escribe primero su parte, que queda así en su nodo NUMA.
+host_info_t *hosts = NULL;
+int max_hosts = DEFAULT_HOSTS;
+int part_size = 0;              // Entradas de la parte de cada worker
+int table_size = 0;             // Entradas de la tabla (n_workers partes)
+
+// Hosts en la tabla (entre todos los workers); nunca pasa de max_hosts.
+// Sólo cambia al crear o liberar una entrada, no con cada línea.
+static atomic_int hosts_used;
+
+// La tabla no tiene mutex: las líneas las parsean y aplican -W workers y el
+// worker w es el único que escribe en las entradas de su parte,
+// hosts[part_lo(w)] .. hosts[part_lo(w + 1) - 1] (ver WORKERS). Los demás
+// hilos leen copias coherentes con el seqlock de cada entrada (host_read) o,
+// para recorrerla entera, la última instantánea (ver SNAPSHOTS).
+#define WORKERS_MAX 16
+int n_workers = 2;
+
+// Worker del hilo actual (-1 si no es un worker) y su rueda con los
+// temporizadores de caducidad de sus hosts.
+static _Thread_local int worker_id = -1;
+static _Thread_local twheel_t *host_wheel;
+
+// Primera entrada de la parte del worker w (part_lo(n_workers) es table_size).
+static inline int part_lo(int w) {
+    return w * part_size;
+}
+
+// Tamaño de las partes. El hash no reparte los hosts exactamente por igual:
+// con -H / -W entradas justas, la parte de un worker se llenaría antes que
+// la tabla. Cada parte lleva un margen de unas cuatro desviaciones típicas
+// del reparto (4 veces la raíz de -H / -W) más 16 entradas; el total de
+// hosts sigue limitado a -H con hosts_used.
+void table_plan(void) {
+    int per = (max_hosts + n_workers - 1) / n_workers;
+    int r = 1;
+    while (r * r < per)
+        r++;
+    part_size = n_workers == 1 ? per : per + 4 * r + 16;
+    table_size = n_workers * part_size;
+}
+
+// Parámetros de caducidad (opciones -I, -S y -T).
+double expected_interval = 2.0; // Intervalo de envío de los agentes (s)
+int stale_intervals = 3;        // Intervalos perdidos antes de marcar STALE
+double host_ttl = 60.0;         // Segundos sin datos antes de liberar la entrada
+
+// Collector padre al que se reenvían los datos (opción -U), NULL si ninguno.
+const char *relay_host = NULL, *relay_port = NULL;
+
+/**************** SELF STATS ****************/
+// Métricas internas del propio collector. Cada hilo escribe en una ranura
+// propia (alineada a línea de caché para no compartirla con otros hilos) y
+// las ranuras se suman sólo al leer (dashboard y comando STATS).
+// Los histogramas son log-lineales al estilo HDR: cada potencia de 2 se divide
+// en HIST_SUB sub-cubetas, lo que da un error relativo máximo de 1/HIST_SUB.
+
+#define CACHE_LINE    64
+#define STAT_SLOTS    32                      // Ranuras (hilos) independientes
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)    // 8 sub-cubetas: error <= 12.5%
+#define HIST_BUCKETS  (64 * HIST_SUB)         // Cubre todo el rango de uint64_t
+
+// Contadores monotónicos.
+typedef enum {
+    ST_MSG_CPU,       // Líneas CPU procesadas
+    ST_MSG_MEM,       // Líneas MEM procesadas
+    ST_MSG_HB,        // Heartbeats (valores sin cambios)
+    ST_MSG_PROC,      // Líneas PROC procesadas
+    ST_MSG_HELLO,     // Conexiones identificadas con HELLO
+    ST_MSG_CMD,       // Comandos (STATS)
+    ST_MSG_BAD,       // Líneas desconocidas o mal formadas
+    ST_MSG_REPLAY,    // Líneas con marca de tiempo (reenviadas por un agente)
+    ST_MSG_LATE,      // Líneas más antiguas que los datos actuales (sólo historial)
+    ST_BYTES_RX,      // Bytes recibidos por los sockets
+    ST_UDP_DGRAMS,    // Datagramas UDP recibidos
+    ST_UDP_BATCHES,   // Llamadas a recvmmsg que devolvieron datos
+    ST_ACCEPTS,       // Conexiones aceptadas
+    ST_CTL_SENT,      // Líneas CTL enviadas a los agentes
+    ST_RELAY_LINES,   // Líneas reenviadas al collector padre (-U)
+    ST_RELAY_BATCHES, // Tandas reenviadas
+    ST_RELAY_FAILS,   // Tandas perdidas (padre caído o envío fallido)
+    ST_REDIRECTS,     // Agentes enviados a su nodo del cluster
+    ST_PROXIED,       // Consultas reenviadas a otros nodos
+    ST_SHM_LINES,     // Líneas leídas de anillos en memoria compartida
+    ST_SHM_WAKEUPS,   // Veces que un agente despertó al collector (eventfd)
+    ST_CONN_REFUSED,  // Conexiones rechazadas (límite -c o presupuesto -B)
+    ST_HOST_REFUSED,  // Hosts nuevos sin sitio en la tabla (-H)
+    ST_MEM_REFUSED,   // Respuestas a consultas sin memoria en el presupuesto
+    ST_UDP_SHED,      // Líneas UDP descartadas con la cola del worker llena
+    ST_CONN_STEERED,  // Conexiones atendidas en la CPU que recibe sus paquetes
+    ST_XNODE_BATCHES, // Tandas armadas en un nodo NUMA y procesadas en otro
+    ST_XNODE_BYTES,   // Bytes de esas tandas
+    ST_SNAP_PUBLISHED,// Instantáneas de la tabla publicadas
+    ST_SNAP_SKIPPED,  // Publicaciones saltadas por no haber buffer libre
+    ST_COUNT
+} stat_counter_t;
+
+static const char *stat_names[ST_COUNT] = {
+    "msg_cpu", "msg_mem", "msg_hb", "msg_proc", "msg_hello", "msg_cmd", "msg_bad", "msg_replay", "msg_late",
+    "bytes_rx", "udp_dgrams", "udp_batches", "accepts", "ctl_sent",
+    "relay_lines", "relay_batches", "relay_fails", "redirects", "proxied",
+    "shm_lines", "shm_wakeups", "conn_refused", "host_refused", "mem_refused",
+    "udp_shed", "conn_steered", "xnode_batches", "xnode_bytes",
+    "snap_published", "snap_skipped"
+};
+
+// Histogramas de latencia (en nanosegundos).
+typedef enum {
+    H_IO,             // Separar y repartir en tandas un bloque recibido
+    H_QUEUE_WAIT,     // Espera de una tanda en la cola de su worker
+    H_PARSE,          // Tiempo de procesar una línea (en el worker)
+    H_RENDER,         // Tiempo de dibujar el dashboard
+    H_SNAPSHOT,       // Tiempo de copiar la tabla en una instantánea
+    H_COUNT
+} stat_hist_t;
+
+static const char *hist_names[H_COUNT] = {
+    "io_ns", "queue_wait_ns", "parse_ns", "render_ns", "snapshot_ns"
+};
+
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t counters[ST_COUNT];
+    _Atomic uint64_t hist[H_COUNT][HIST_BUCKETS];
+} stat_slot_t;
+
+// Suma de todas las ranuras en un instante dado.
+typedef struct {
+    uint64_t counters[ST_COUNT];
+    uint64_t hist[H_COUNT][HIST_BUCKETS];
+} stat_totals_t;
+
+stat_slot_t stat_slots[STAT_SLOTS];
+_Atomic unsigned stat_next_slot = 0;           // Reparto de ranuras a hilos
+static _Thread_local stat_slot_t *my_stats;    // Ranura del hilo actual
+
+// Ranura del hilo actual (se asigna la primera vez, en round robin). Si hay
+// más hilos que ranuras varios comparten una, por eso se suma atómicamente.
+static inline stat_slot_t *stats_slot(void) {
+    if (!my_stats)
+        my_stats = &stat_slots[atomic_fetch_add(&stat_next_slot, 1) % STAT_SLOTS];
+    return my_stats;
+}
+
+// Suma 'v' al contador 'c' del hilo actual.
+static inline void stat_add(stat_counter_t c, uint64_t v) {
+    atomic_fetch_add_explicit(&stats_slot()->counters[c], v, memory_order_relaxed);
+}
+
+// Cubeta del histograma para un valor.
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Valor mínimo que cae en la cubeta 'b' (inversa de hist_bucket).
+static inline uint64_t hist_value(int b) {
+    if (b < HIST_SUB) return b;
+    int shift = b / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + b % HIST_SUB) << shift;
+}
+
+// Registra una muestra de 'v' ns en el histograma 'h' del hilo actual.
+static inline void stat_record(stat_hist_t h, uint64_t v) {
+    atomic_fetch_add_explicit(&stats_slot()->hist[h][hist_bucket(v)], 1,
+                              memory_order_relaxed);
+}
+
+// Reloj monotónico en nanosegundos (para medir latencias).
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Suma todas las ranuras en 't'.
+void stats_collect(stat_totals_t *t) {
+    memset(t, 0, sizeof(*t));
+    for (int s = 0; s < STAT_SLOTS; s++) {
+        for (int c = 0; c < ST_COUNT; c++)
+            t->counters[c] += atomic_load_explicit(&stat_slots[s].counters[c],
+                                                   memory_order_relaxed);
+        for (int h = 0; h < H_COUNT; h++)
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                t->hist[h][b] += atomic_load_explicit(&stat_slots[s].hist[h][b],
+                                                      memory_order_relaxed);
+    }
+}
+
+// Número de muestras de un histograma agregado.
+uint64_t hist_count(const uint64_t *hist) {
+    uint64_t n = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        n += hist[b];
+    return n;
+}
+
+// Valor del percentil 'p' (0..100) de un histograma agregado.
+uint64_t hist_percentile(const uint64_t *hist, double p) {
+    uint64_t total = hist_count(hist);
+    if (total == 0) return 0;
+    uint64_t target = (uint64_t)(total * p / 100.0);
+    if (target >= total) target = total - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > target) return hist_value(b);
+    }
+    return 0;
+}
+
+/**************** PRESUPUESTO DE MEMORIA ****************/
+// La memoria que el collector usa de forma duradera o según la carga se
+// reserva contra un presupuesto (-B, en MB; sin -B no hay límite pero se
+// lleva igual la cuenta):
+//  - al arrancar, lo fijo: la tabla de hosts (con su historial), el estado
+//    de las alertas, los buffers de UDP y del relay y el tope de las colas
+//    de los workers;
+//  - por conexión, su estructura, la pila de su hilo y sus tandas en curso;
+//  - por consulta, el buffer de la respuesta (HOSTS y reenvíos del cluster).
+// Lo que no cabe se rechaza (la conexión o la consulta) en lugar de pedir
+// más memoria. Con -B y sin -c el límite de conexiones se calcula con el
+// presupuesto, así que el máximo se conoce desde la configuración.
+
+size_t mem_budget = 0;                 // Bytes (-B); 0 = sin límite
+_Atomic size_t mem_reserved = 0;       // Bytes reservados ahora
+
+// Reserva 'n' bytes del presupuesto. Devuelve 0 o -1 si no caben.
+int mem_reserve(size_t n) {
+    size_t cur = atomic_load(&mem_reserved);
+    do {
+        if (mem_budget && cur + n > mem_budget) return -1;
+    } while (!atomic_compare_exchange_weak(&mem_reserved, &cur, cur + n));
+    return 0;
+}
+
+void mem_release(size_t n) {
+    atomic_fetch_sub(&mem_reserved, n);
+}
+
+// Memoria sin tocar (mmap) para las estructuras que reparte AFINIDAD Y NUMA:
+// cada página se asigna en el nodo del hilo que la escribe primero. No se
+// libera nunca. Devuelve NULL si falla.
+void *node_alloc(size_t n) {
+    void *p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// malloc dentro del presupuesto: NULL si no cabe (cuenta en mem_refused).
+void *mem_alloc(size_t n) {
+    if (mem_reserve(n) != 0) {
+        stat_add(ST_MEM_REFUSED, 1);
+        return NULL;
+    }
+    void *p = malloc(n);
+    if (!p) mem_release(n);
+    return p;
+}
+
+void mem_free(void *p, size_t n) {
+    if (!p) return;
+    free(p);
+    mem_release(n);
+}
+
+/************ NOMBRES DE HOSTS ************/
+// Cada nombre de host se registra una vez y recibe un id denso de 32 bits;
+// la tabla, los eventos de alerta y el relay guardan y comparan ids, y el
+// texto está una sola vez en name_str[id] (con su hash en name_hash[id]).
+// Los nombres pueden tener hasta NAME_MAX_LEN bytes: las líneas con nombres
+// más largos se rechazan enteras, no se truncan.
+//
+// Como la tabla, los ids de un host los da y los libera sólo su worker: el
+// worker w usa los ids name_lo(w) .. name_lo(w + 1) - 1 y un índice propio
+// nombre -> entrada (direccionamiento abierto, sin atómicos). Al liberarse
+// un host su id pasa una cuarentena hasta que ninguna instantánea ni lector
+// pueda tenerlo (snap_quiescent) y luego se reutiliza con otro nombre.
+
+char (*name_str)[NAME_MAX_LEN + 1];   // Texto de cada id ([0] = "")
+uint64_t *name_hash;                  // ring_hash de cada nombre
+int names_per_worker;                 // Ids de cada worker (names_init)
+
+typedef struct {
+    uint32_t *slots;          // Índice: entrada de la tabla + 1 (0: vacío)
+    uint32_t mask;            // Tamaño del índice - 1 (potencia de 2)
+    name_id_t next_fresh;     // Primer id del worker aún sin usar
+    name_id_t *grace_id;      // Ids liberados en cuarentena (cola circular)
+    uint64_t *grace_epoch;    // Época en que se liberó cada uno
+    int grace_head, grace_n;
+} name_index_t;
+
+static _Thread_local name_index_t *my_names;   // Índice del worker actual
+
+// De SNAPSHOTS: la cuarentena se mide en épocas de las instantáneas.
+uint64_t snap_retire_epoch(void);
+int snap_quiescent(uint64_t epoch);
+
+// FNV-1a con una mezcla final (los nombres parecidos, "nodo#1", "nodo#2",
+// quedan lejos). Indexa los nombres y reparte los hosts entre workers y en
+// el anillo del cluster.
+uint64_t ring_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Primer id del worker w.
+static inline name_id_t name_lo(int w) {
+    return 1 + (name_id_t)w * names_per_worker;
+}
+
+// Texto de un id ("" para 0). Un id sacado de una instantánea es válido
+// mientras se tenga la instantánea.
+static inline const char *name_of(name_id_t id) {
+    return name_str[id];
+}
+
+// Ids por worker: el doble de su parte de la tabla, para que los que están
+// en cuarentena no dejen sin id a los hosts nuevos.
+static int names_per(void) {
+    return 2 * (part_size + 1);
+}
+
+// Tamaño del índice de un worker (carga de 1/2 como mucho).
+static uint32_t names_slots(void) {
+    uint32_t n = 1;
+    while (n < 2u * (part_size + 1))
+        n <<= 1;
+    return n;
+}
+
+// Bytes de los nombres y sus índices (reservados al arrancar).
+size_t names_mem(void) {
+    size_t ids = (size_t)n_workers * names_per() + 1;
+    return ids * (NAME_MAX_LEN + 1 + sizeof(uint64_t)) +
+           (size_t)n_workers * (sizeof(name_index_t) + names_slots() * sizeof(uint32_t) +
+                                names_per() * (sizeof(name_id_t) + sizeof(uint64_t)));
+}
+
+// Reserva los textos y hashes de todos los ids, sin tocarlos: cada página
+// queda en el nodo del worker que la escribe. Devuelve 0 o -1.
+int names_init(void) {
+    names_per_worker = names_per();
+    size_t ids = (size_t)n_workers * names_per_worker + 1;
+    name_str = node_alloc(ids * sizeof(*name_str));
+    name_hash = node_alloc(ids * sizeof(*name_hash));
+    return name_str && name_hash ? 0 : -1;
+}
+
+// Índice del worker actual (en su hilo, ya en su CPU). Devuelve 0 o -1.
+int names_worker_init(void) {
+    name_index_t *x = node_alloc(sizeof(*x));
+    if (!x) return -1;
+    x->mask = names_slots() - 1;
+    x->slots = node_alloc((size_t)(x->mask + 1) * sizeof(uint32_t));
+    x->grace_id = node_alloc(names_per_worker * sizeof(name_id_t));
+    x->grace_epoch = node_alloc(names_per_worker * sizeof(uint64_t));
+    x->next_fresh = name_lo(worker_id);
+    my_names = x;
+    return x->slots && x->grace_id && x->grace_epoch ? 0 : -1;
+}
+
+// Id libre del worker actual: uno nunca usado o el más antiguo que ya salió
+// de la cuarentena. 0 si no hay.
+name_id_t names_alloc(void) {
+    name_index_t *x = my_names;
+    if (x->next_fresh < name_lo(worker_id + 1))
+        return x->next_fresh++;
+    if (x->grace_n > 0 && snap_quiescent(x->grace_epoch[x->grace_head])) {
+        name_id_t id = x->grace_id[x->grace_head];
+        x->grace_head = (x->grace_head + 1) % names_per_worker;
+        x->grace_n--;
+        return id;
+    }
+    return 0;
+}
+
+// Pone en cuarentena el id de un host cuya entrada ya se liberó.
+void names_release(name_id_t id) {
+    name_index_t *x = my_names;
+    int tail = (x->grace_head + x->grace_n) % names_per_worker;
+    x->grace_id[tail] = id;
+    x->grace_epoch[tail] = snap_retire_epoch();
+    x->grace_n++;
+}
+
+/**************** ALERT RULES ****************/
+// Motor de reglas de alerta evaluado en la ingesta (no hay hilo que haga
+// polling). Las reglas se leen de un archivo con una regla por línea:
+//
+//   <nombre> <metrica> <op> <umbral> [for <segundos>]
+//
+//   cpu_alta   cpu_usage     >  90 for 60
+//   swap_baja  swap_free_pct <  10
+//
+// Las líneas vacías y las que empiezan por '#' se ignoran.
+// Se compilan una sola vez al arrancar y se indexan por métrica, de modo que
+// cada muestra sólo evalúa las reglas de las métricas que acaba de actualizar.
+// El estado pendiente/disparada se guarda por (host, regla).
+
+// Máximo número de reglas que se pueden cargar.
+#define MAX_RULES 128
+
+// Métricas sobre las que se pueden escribir reglas.
+typedef enum {
+    M_CPU_USAGE,
+    M_CPU_USER,
+    M_CPU_SYS,
+    M_CPU_IDLE,
+    M_CPU_IOWAIT,
+    M_CPU_STEAL,
+    M_CPU_CORE_MAX,    // uso del núcleo más cargado (detecta núcleos saturados)
+    M_MEM_USED,
+    M_MEM_FREE,
+    M_SWAP_TOTAL,
+    M_SWAP_FREE,
+    M_SWAP_FREE_PCT,   // derivada: 100 * swap_f / swap_t
+    M_COUNT
+} metric_id_t;
+
+// Nombres de las métricas tal como se escriben en el archivo de reglas.
+static const char *metric_names[M_COUNT] = {
+    "cpu_usage", "cpu_user", "cpu_sys", "cpu_idle",
+    "cpu_iowait", "cpu_steal", "cpu_core_max",
+    "mem_used", "mem_free", "swap_total", "swap_free", "swap_free_pct"
+};
+
+// Métricas que actualiza cada tipo de mensaje.
+static const metric_id_t cpu_metrics[] = {
+    M_CPU_USAGE, M_CPU_USER, M_CPU_SYS, M_CPU_IDLE,
+    M_CPU_IOWAIT, M_CPU_STEAL, M_CPU_CORE_MAX
+};
+static const metric_id_t mem_metrics[] = {
+    M_MEM_USED, M_MEM_FREE, M_SWAP_TOTAL, M_SWAP_FREE, M_SWAP_FREE_PCT
+};
+
+// Operadores de comparación soportados.
+typedef enum { OP_GT, OP_GE, OP_LT, OP_LE, OP_EQ, OP_NE } rule_op_t;
+static const char *op_names[] = { ">", ">=", "<", "<=", "==", "!=" };
+
+// Regla ya compilada.
+typedef struct {
+    char name[32];        // Nombre de la regla (aparece en los eventos)
+    metric_id_t metric;   // Métrica que evalúa
+    rule_op_t op;         // Operador de comparación
+    float threshold;      // Umbral
+    double for_sec;       // Segundos que debe cumplirse antes de disparar
+} alert_rule_t;
+
+// Estado de una regla para un host concreto.
+typedef enum { ALERT_INACTIVE = 0, ALERT_PENDING, ALERT_FIRING } alert_state_t;
+
+typedef struct {
+    unsigned char state;  // alert_state_t
+    double since;         // Instante (monotónico) en que empezó a cumplirse
+} alert_slot_t;
+
+// Evento generado por una transición (se emite tras la escritura del host).
+typedef struct {
+    int rule;             // Índice de la regla
+    name_id_t host;       // Host que la provocó
+    float value;          // Valor observado
+    int firing;           // 1 = FIRING, 0 = RESOLVED
+} alert_event_t;
+
+alert_rule_t rules[MAX_RULES];
+int n_rules = 0;
+
+// Índice por métrica: las reglas de la métrica m son
+// rule_by_metric[rule_first[m] .. rule_first[m] + rule_count[m] - 1].
+int rule_by_metric[MAX_RULES];
+int rule_first[M_COUNT];
+int rule_count[M_COUNT];
+
+// Estado por (host, regla): alert_slots[host_idx * n_rules + regla].
+// Cada fila la escribe sólo el worker dueño del host, igual que la tabla.
+alert_slot_t *alert_slots = NULL;
+
+// Número de alertas en estado FIRING (lo actualizan todos los workers).
+_Atomic int alerts_firing = 0;
+
+// Destino de los eventos: archivo de log o socket Unix de datagramas.
+FILE *alert_log = NULL;
+int alert_sock = -1;
+struct sockaddr_un alert_addr;
+pthread_mutex_t alert_out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Devuelve el id de una métrica a partir de su nombre, o -1 si no existe.
+int metric_from_name(const char *name) {
+    for (int i = 0; i < M_COUNT; i++)
+        if (strcmp(metric_names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+// Devuelve el id de un operador a partir de su texto, o -1 si no existe.
+int op_from_name(const char *name) {
+    for (int i = 0; i < (int)(sizeof(op_names) / sizeof(op_names[0])); i++)
+        if (strcmp(op_names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+// Carga y compila las reglas de 'path'. Devuelve 0 si todo fue bien o -1 si
+// el archivo no existe o alguna regla es inválida (se indica la línea).
+int load_rules(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        // Saltamos espacios iniciales, líneas vacías y comentarios.
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+
+        if (n_rules == MAX_RULES) {
+            fprintf(stderr, "%s:%d: demasiadas reglas (máximo %d)\n",
+                    path, lineno, MAX_RULES);
+            fclose(f);
+            return -1;
+        }
+
+        char name[32], metric[32], op[4], kw[8];
+        float threshold;
+        double for_sec = 0;
+        int n = sscanf(p, "%31s %31s %3s %f %7s %lf",
+                       name, metric, op, &threshold, kw, &for_sec);
+        int m = (n >= 4) ? metric_from_name(metric) : -1;
+        int o = (n >= 4) ? op_from_name(op) : -1;
+        if (n < 4 || n == 5 || m < 0 || o < 0 ||
+            (n == 6 && (strcmp(kw, "for") != 0 || for_sec < 0))) {
+            fprintf(stderr, "%s:%d: regla inválida: %s", path, lineno, p);
+            fclose(f);
+            return -1;
+        }
+
+        alert_rule_t *r = &rules[n_rules++];
+        strncpy(r->name, name, sizeof(r->name));
+        r->name[sizeof(r->name) - 1] = '\0';
+        r->metric = m;
+        r->op = o;
+        r->threshold = threshold;
+        r->for_sec = for_sec;
+    }
+    fclose(f);
+
+    // Construimos el índice por métrica (counting sort por métrica).
+    memset(rule_count, 0, sizeof(rule_count));
+    for (int i = 0; i < n_rules; i++)
+        rule_count[rules[i].metric]++;
+    int pos = 0;
+    for (int m = 0; m < M_COUNT; m++) {
+        rule_first[m] = pos;
+        pos += rule_count[m];
+    }
+    int fill[M_COUNT];
+    memcpy(fill, rule_first, sizeof(fill));
+    for (int i = 0; i < n_rules; i++)
+        rule_by_metric[fill[rules[i].metric]++] = i;
+
+    // Estado inicial: todas las reglas inactivas para todos los hosts.
+    if (n_rules > 0) {
+        alert_slots = node_alloc((size_t)table_size * n_rules * sizeof(alert_slot_t));
+        if (!alert_slots) {
+            perror("mmap");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Abre el destino de los eventos de alerta.
+int open_alert_output(const char *dest) {
+    if (strncmp(dest, "unix:", 5) == 0) {
+        alert_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (alert_sock < 0) {
+            perror("socket");
+            return -1;
+        }
+        memset(&alert_addr, 0, sizeof(alert_addr));
+        alert_addr.sun_family = AF_UNIX;
+        strncpy(alert_addr.sun_path, dest + 5, sizeof(alert_addr.sun_path) - 1);
+        return 0;
+    }
+    alert_log = fopen(dest, "a");
+    if (!alert_log) {
+        perror(dest);
+        return -1;
+    }
+    return 0;
+}
+
+// Valor actual de una métrica para un host.
+float metric_value(const host_info_t *h, metric_id_t m) {
+    switch (m) {
+    case M_CPU_USAGE:  return h->cpu_usage;
+    case M_CPU_USER:   return h->cpu_user;
+    case M_CPU_SYS:    return h->cpu_sys;
+    case M_CPU_IDLE:   return h->cpu_idle;
+    case M_CPU_IOWAIT: return h->cpu_iowait;
+    case M_CPU_STEAL:  return h->cpu_steal;
+    case M_CPU_CORE_MAX:
+        return h->ncores > 0 ? h->core_pct[h->core_max_idx] : h->cpu_usage;
+    case M_MEM_USED:   return h->mem_used;
+    case M_MEM_FREE:   return h->mem_free;
+    case M_SWAP_TOTAL: return h->swap_t;
+    case M_SWAP_FREE:  return h->swap_f;
+    case M_SWAP_FREE_PCT:
+        // Sin swap no hay nada que alertar: lo tratamos como 100% libre.
+        return h->swap_t > 0 ? 100.0f * h->swap_f / h->swap_t : 100.0f;
+    default:           return 0;
+    }
+}
+
+// Aplica el operador de la regla.
+int rule_matches(const alert_rule_t *r, float v) {
+    switch (r->op) {
+    case OP_GT: return v >  r->threshold;
+    case OP_GE: return v >= r->threshold;
+    case OP_LT: return v <  r->threshold;
+    case OP_LE: return v <= r->threshold;
+    case OP_EQ: return v == r->threshold;
+    case OP_NE: return v != r->threshold;
+    }
+    return 0;
+}
+
+// Evalúa las reglas de las métricas recién actualizadas de 'h'.
+// La llama el worker dueño de 'h'. Las transiciones FIRING/RESOLVED se
+// devuelven en 'ev' (capacidad MAX_RULES) para emitirlas después.
+// Devuelve el número de eventos generados.
+int alerts_on_sample(host_info_t *h, const metric_id_t *metrics, int n_metrics,
+                     alert_event_t *ev) {
+    if (n_rules == 0) return 0;
+
+    int n_ev = 0;
+    double now = now_mono();
+    alert_slot_t *slots = &alert_slots[(size_t)(h - hosts) * n_rules];
+
+    for (int k = 0; k < n_metrics; k++) {
+        metric_id_t m = metrics[k];
+        if (rule_count[m] == 0) continue;
+        float v = metric_value(h, m);
+
+        for (int j = rule_first[m]; j < rule_first[m] + rule_count[m]; j++) {
+            int ri = rule_by_metric[j];
+            const alert_rule_t *r = &rules[ri];
+            alert_slot_t *s = &slots[ri];
+            int fire = 0, resolve = 0;
+
+            if (rule_matches(r, v)) {
+                if (s->state == ALERT_INACTIVE) {
+                    s->state = ALERT_PENDING;
+                    s->since = now;
+                }
+                if (s->state == ALERT_PENDING && now - s->since >= r->for_sec)
+                    fire = 1;
+            } else {
+                resolve = (s->state == ALERT_FIRING);
+                s->state = ALERT_INACTIVE;
+            }
+
+            if (fire) {
+                s->state = ALERT_FIRING;
+                alerts_firing++;
+            }
+            if (resolve)
+                alerts_firing--;
+            if (fire || resolve) {
+                alert_event_t *e = &ev[n_ev++];
+                e->rule = ri;
+                e->host = h->id;
+                e->value = v;
+                e->firing = fire;
+            }
+        }
+    }
+    return n_ev;
+}
+
+// Escribe los eventos en el destino configurado.
+void alerts_emit(const alert_event_t *ev, int n) {
+    if (n == 0) return;
+
+    // Marca de tiempo legible (hora local) común a todos los eventos.
+    char ts[32];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    pthread_mutex_lock(&alert_out_lock);
+    for (int i = 0; i < n; i++) {
+        const alert_rule_t *r = &rules[ev[i].rule];
+        char line[NAME_MAX_LEN + 256];
+        int len = snprintf(line, sizeof(line),
+            "%s %s host=%s rule=%s metric=%s value=%.2f cond=\"%s %.2f for %.0fs\"\n",
+            ts, ev[i].firing ? "FIRING" : "RESOLVED", name_of(ev[i].host), r->name,
+            metric_names[r->metric], ev[i].value,
+            op_names[r->op], r->threshold, r->for_sec);
+        if (len <= 0) continue;
+        if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+
+        if (alert_sock >= 0) {
+            // Si nadie escucha en el socket el evento se pierde (no bloqueamos).
+            sendto(alert_sock, line, len, MSG_DONTWAIT,
+                   (struct sockaddr *)&alert_addr, sizeof(alert_addr));
+        } else if (alert_log) {
+            fwrite(line, 1, len, alert_log);
+        }
+    }
+    if (alert_log) fflush(alert_log);
+    pthread_mutex_unlock(&alert_out_lock);
+}
+
+/**************** SIGNAL HANDLER ****************/
+// Función que se ejecuta cuando llega una señal SIGINT (por ejemplo, Ctrl+C).
+void handle_sigint(int sig) {
+    (void)sig;        // Evita el warning por parámetro sin usar
+    keep_running = 0; // Cambia la variable global para indicar que debemos terminar
+}
+
+/*********** EXPORTACIÓN EN MEMORIA COMPARTIDA ***********/
+// Con -X la tabla de hosts se copia, entrada por entrada, en un segmento
+// POSIX con el formato de collector_shm.h, para que otros procesos de la
+// máquina lean los valores al día sin hablar con el collector. El worker
+// dueño de hosts[i] es el único que escribe la entrada exportada i: la
+// copia al terminar cada escritura de hosts[i] (host_write_end), con el
+// seqlock propio de la entrada, así que los lectores nunca frenan a nadie.
+
+const char *export_name = NULL;          // -X
+cshm_header_t *export_hdr = NULL;
+cshm_entry_t *export_tab = NULL;
+
+// Bytes del segmento.
+size_t export_mem(void) {
+    return export_name ? sizeof(cshm_header_t) + (size_t)table_size * sizeof(cshm_entry_t) : 0;
+}
+
+// Crea (o vacía) el segmento y escribe la cabecera. Devuelve 0 o -1.
+int export_open(void) {
+    int fd = shm_open(export_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) return -1;
+    size_t size = export_mem();
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    export_hdr = p;
+    export_tab = (cshm_entry_t *)((char *)p + sizeof(cshm_header_t));
+    export_hdr->version = CSHM_VERSION;
+    export_hdr->header_size = sizeof(cshm_header_t);
+    export_hdr->entry_size = sizeof(cshm_entry_t);
+    export_hdr->capacity = table_size;
+    export_hdr->pid = getpid();
+    export_hdr->started_ms = export_hdr->heartbeat_ms = now_wall_ms();
+    __atomic_store_n(&export_hdr->magic, CSHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Copia 'h' en su entrada exportada (el worker dueño, dentro de la
+// escritura de 'h'). El nombre sólo se copia cuando la entrada cambia de
+// host: al liberarse pasa siempre por id 0.
+void export_host(const host_info_t *h) {
+    cshm_entry_t *e = &export_tab[h - hosts];
+    uint32_t seq = e->seq;
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (e->host_id != h->id) {
+        e->host_id = h->id;
+        strcpy(e->name, name_of(h->id));
+    }
+    e->flags = (h->id ? CSHM_USED : 0) | (h->stale ? CSHM_STALE : 0) |
+               (h->has_cpu ? CSHM_HAS_CPU : 0) | (h->has_mem ? CSHM_HAS_MEM : 0) |
+               (h->has_procs ? CSHM_HAS_PROCS : 0);
+    e->updated_ms = now_wall_ms();
+    e->cpu_ts_ms = h->cpu_ts;
+    e->mem_ts_ms = h->mem_ts;
+    e->cpu_usage = h->cpu_usage;
+    e->cpu_user = h->cpu_user;
+    e->cpu_sys = h->cpu_sys;
+    e->cpu_idle = h->cpu_idle;
+    e->cpu_iowait = h->cpu_iowait;
+    e->cpu_steal = h->cpu_steal;
+    e->mem_used_mb = h->mem_used;
+    e->mem_free_mb = h->mem_free;
+    e->swap_total_mb = h->swap_t;
+    e->swap_free_mb = h->swap_f;
+    e->ncores = h->ncores;
+    e->core_max_idx = h->core_max_idx;
+    e->core_max_pct = h->ncores > 0 ? h->core_pct[h->core_max_idx] : 0;
+    e->nprocs = h->nprocs;
+    const proc_entry_t *tc = h->n_top_cpu > 0 ? &h->top_cpu[0] : NULL;
+    const proc_entry_t *tr = h->n_top_rss > 0 ? &h->top_rss[0] : NULL;
+    e->top_cpu_pid = tc ? tc->pid : 0;
+    e->top_cpu_pct = tc ? tc->cpu : 0;
+    strcpy(e->top_cpu_comm, tc ? tc->comm : "");
+    e->top_rss_pid = tr ? tr->pid : 0;
+    e->top_rss_mb = tr ? tr->rss_mb : 0;
+    strcpy(e->top_rss_comm, tr ? tr->comm : "");
+
+    __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/********* FIND OR CREATE HOST ENTRY *********/
+// Cada worker busca y crea hosts sólo en su parte de la tabla (un tramo
+// contiguo, ver part_lo), a través de su índice de nombres. El worker de un
+// host sale del hash de su nombre (host_worker), así que un nombre siempre
+// cae en la misma parte.
+
+// Seqlock de una entrada: el worker dueño deja 'seq' impar mientras la
+// modifica; un lector copia la entrada y repite si 'seq' cambió o era impar.
+// Los workers nunca esperan a los lectores.
+static inline void host_write_begin(host_info_t *h) {
+    atomic_store_explicit(&h->seq, atomic_load_explicit(&h->seq, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void host_write_end(host_info_t *h) {
+    if (export_tab)
+        export_host(h);
+    atomic_store_explicit(&h->seq, atomic_load_explicit(&h->seq, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+// Entrada del host 'ip' (con hash 'hv') en la parte del worker actual, o
+// NULL. En *slot deja la posición del índice en que está o en que iría.
+static host_info_t *host_probe(const char *ip, uint64_t hv, uint32_t *slot) {
+    name_index_t *x = my_names;
+    uint32_t i = (uint32_t)hv & x->mask;
+    for (; x->slots[i]; i = (i + 1) & x->mask) {
+        name_id_t id = hosts[x->slots[i] - 1].id;
+        if (name_hash[id] == hv && strcmp(name_str[id], ip) == 0)
+            break;
+    }
+    *slot = i;
+    return x->slots[i] ? &hosts[x->slots[i] - 1] : NULL;
+}
+
+// Busca la entrada de un host en la parte del worker actual, o NULL.
+host_info_t *find_host(const char *ip) {
+    uint32_t slot;
+    return host_probe(ip, ring_hash(ip), &slot);
+}
+
+// Busca una entrada de host por IP, y si no existe, crea una nueva
+// en el primer espacio libre de la parte del worker actual.
+host_info_t *get_host(const char *ip) {
+    size_t len = strlen(ip);
+    if (len > NAME_MAX_LEN) return NULL;    // Nombre demasiado largo
+    // Primero buscamos si la IP ya existe en la tabla
+    uint64_t hv = ring_hash(ip);
+    uint32_t slot;
+    host_info_t *h = host_probe(ip, hv, &slot);
+    if (h) return h;
+    // Si no estaba, buscamos una entrada vacía (id == 0) y un id para el
+    // nombre, salvo que ya haya -H hosts en la tabla
+    int lo = part_lo(worker_id), hi = part_lo(worker_id + 1);
+    if (atomic_fetch_add(&hosts_used, 1) >= max_hosts)
+        hi = lo;
+    for (int i = lo; i < hi; i++) {
+        if (hosts[i].id != 0) continue;
+        name_id_t id = names_alloc();
+        if (!id) break;                     // Todos los ids en cuarentena
+        memcpy(name_str[id], ip, len + 1);
+        name_hash[id] = hv;
+        // IMPORTANTE: el resto de campos están en 0, ya sea por ser nueva
+        // o porque host_reclaim limpió la entrada al liberarla
+        host_write_begin(&hosts[i]);
+        hosts[i].id = id;
+        host_write_end(&hosts[i]);
+        my_names->slots[slot] = i + 1;
+        return &hosts[i];
+    }
+    // Si llegamos aquí, no había espacio (tabla o parte de la tabla llena)
+    atomic_fetch_sub(&hosts_used, 1);
+    stat_add(ST_HOST_REFUSED, 1);
+    return NULL;
+}
+
+// Saca 'h' del índice de su worker (al liberar la entrada). Las posiciones
+// siguientes se corren hacia atrás para no dejar huecos en las búsquedas.
+void host_unindex(host_info_t *h) {
+    name_index_t *x = my_names;
+    uint32_t e = (uint32_t)(h - hosts) + 1;
+    uint32_t i = (uint32_t)name_hash[h->id] & x->mask;
+    while (x->slots[i] != e)
+        i = (i + 1) & x->mask;
+    for (uint32_t j = (i + 1) & x->mask; x->slots[j]; j = (j + 1) & x->mask) {
+        uint32_t home = (uint32_t)name_hash[hosts[x->slots[j] - 1].id] & x->mask;
+        // Sólo se corre si su posición natural no queda entre i y j
+        if (((j - home) & x->mask) >= ((j - i) & x->mask)) {
+            x->slots[i] = x->slots[j];
+            i = j;
+        }
+    }
+    x->slots[i] = 0;
+}
+
+// Worker dueño del host 'name' (sus primeros 'n' caracteres, como mucho
+// NAME_MAX_LEN).
+int host_worker(const char *name, size_t n) {
+    char key[NAME_MAX_LEN + 1];
+    if (n > NAME_MAX_LEN) n = NAME_MAX_LEN;
+    memcpy(key, name, n);
+    key[n] = '\0';
+    return (int)(ring_hash(key) % n_workers);
+}
+
+// Copia coherente de hosts[i] en 'out' (sin copiarla si está libre).
+// Devuelve 0 si copió una entrada en uso o -1 si está libre.
+int host_read(int i, host_info_t *out) {
+    const host_info_t *h = &hosts[i];
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&h->seq, memory_order_acquire);
+        if (seq & 1) {           // El worker está escribiendo
+            sched_yield();
+            continue;
+        }
+        int skip = h->id == 0;
+        if (!skip)
+            memcpy(out, (const void *)h, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&h->seq, memory_order_relaxed) == seq)
+            return skip ? -1 : 0;
+    }
+}
+
+/*********** SNAPSHOTS ***********/
+// Los lectores de la tabla (dashboard, HOSTS, HISTORY, TOP) no la recorren
+// entrada a entrada: cada SNAP_MS el hilo de instantáneas copia las
+// entradas en uso (con host_read, sin frenar a los workers) en un buffer y
+// lo publica cambiando snap_cur. Una instantánea publicada no se modifica
+// más, así que cualquier número de lectores la recorre entera y todos ven
+// la misma tabla, sin entradas a medias.
+//
+// Los SNAP_BUFS buffers se reservan al arrancar y se reutilizan por épocas:
+// un lector anota en una ranura la época en que entra (snap_get) y la borra
+// al salir (snap_put). Un buffer retirado en la época e vuelve a usarse
+// cuando ninguna ranura tiene una época <= e. Si no hay ninguno libre (un
+// lector lento retiene los viejos) se salta la publicación y se cuenta en
+// snap_skipped: la memoria no crece.
+
+#define SNAP_MS      250   // Periodo de publicación
+#define SNAP_BUFS    3     // La publicada, la que se copia y una de margen
+#define SNAP_READERS 64    // Lectores simultáneos (los demás esperan)
+
+typedef struct {
+    uint64_t retired;      // Época en que dejó de ser la publicada (0: no retirada)
+    double taken;          // now_mono() al copiarla
+    int n;                 // Entradas copiadas
+    host_info_t h[];       // En el orden de la tabla
+} snapshot_t;
+
+snapshot_t *snap_bufs[SNAP_BUFS];
+snapshot_t *_Atomic snap_cur;
+_Atomic uint64_t snap_epoch = 1;
+
+static struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t epoch;   // 0: ranura libre
+} snap_readers[SNAP_READERS];
+
+// Bytes de los buffers de instantáneas.
+size_t snap_mem(void) {
+    return SNAP_BUFS * (sizeof(snapshot_t) + (size_t)table_size * sizeof(host_info_t));
+}
+
+// Toma la instantánea publicada y una ranura de lector, que hay que
+// devolver con snap_put(slot) en cuanto se termine de leer.
+const snapshot_t *snap_get(int *slot) {
+    uint64_t e = atomic_load(&snap_epoch);
+    for (int i = 0;; i = (i + 1) % SNAP_READERS) {
+        uint64_t free_slot = 0;
+        if (atomic_compare_exchange_strong(&snap_readers[i].epoch, &free_slot, e)) {
+            *slot = i;
+            return atomic_load(&snap_cur);
+        }
+        if (i == SNAP_READERS - 1) sched_yield();   // Todas ocupadas
+    }
+}
+
+void snap_put(int slot) {
+    atomic_store(&snap_readers[slot].epoch, 0);
+}
+
+// Entrada del host 'ip' en una instantánea, o NULL.
+const host_info_t *snap_find(const snapshot_t *s, const char *ip) {
+    uint64_t hv = ring_hash(ip);
+    for (int i = 0; i < s->n; i++)
+        if (name_hash[s->h[i].id] == hv && strcmp(name_of(s->h[i].id), ip) == 0)
+            return &s->h[i];
+    return NULL;
+}
+
+// Época para la cuarentena de algo que se acaba de quitar de la tabla. Es
+// una lectura-modificación (suma 0) para que la publicación siguiente, que
+// también modifica snap_epoch, vea ya quitado lo que se quitó antes.
+uint64_t snap_retire_epoch(void) {
+    return atomic_fetch_add(&snap_epoch, 0);
+}
+
+// 1 si nadie puede ver ya algo quitado de la tabla en la época 'e': se
+// publicó una instantánea copiada después (la época avanzó dos veces) y
+// ningún lector sigue en una época anterior a esa.
+int snap_quiescent(uint64_t e) {
+    if (atomic_load(&snap_epoch) < e + 2) return 0;
+    for (int r = 0; r < SNAP_READERS; r++) {
+        uint64_t x = atomic_load(&snap_readers[r].epoch);
+        if (x != 0 && x <= e + 1) return 0;
+    }
+    return 1;
+}
+
+// Buffer que ningún lector puede estar usando, o NULL.
+static snapshot_t *snap_free_buf(void) {
+    snapshot_t *cur = atomic_load(&snap_cur);
+    for (int b = 0; b < SNAP_BUFS; b++) {
+        snapshot_t *s = snap_bufs[b];
+        if (s == cur) continue;
+        int busy = 0;
+        for (int r = 0; r < SNAP_READERS && !busy; r++) {
+            uint64_t e = atomic_load(&snap_readers[r].epoch);
+            busy = e != 0 && e <= s->retired;
+        }
+        if (!busy) return s;
+    }
+    return NULL;
+}
+
+// Copia la tabla en un buffer libre y la publica (sólo el hilo de
+// instantáneas, o main antes de arrancar los demás).
+void snap_publish(void) {
+    snapshot_t *s = snap_free_buf();
+    if (!s) {
+        stat_add(ST_SNAP_SKIPPED, 1);
+        return;
+    }
+    uint64_t t0 = now_ns();
+    s->n = 0;
+    s->retired = 0;
+    for (int i = 0; i < table_size; i++)
+        if (host_read(i, &s->h[s->n]) == 0)
+            s->n++;
+    s->taken = now_mono();
+    snapshot_t *old = atomic_exchange(&snap_cur, s);
+    if (old)
+        old->retired = atomic_fetch_add(&snap_epoch, 1);
+    stat_add(ST_SNAP_PUBLISHED, 1);
+    stat_record(H_SNAPSHOT, now_ns() - t0);
+}
+
+// Reserva los buffers y publica la primera instantánea (vacía), de modo que
+// snap_get nunca devuelve NULL. Devuelve 0 o -1.
+int snap_init(void) {
+    for (int b = 0; b < SNAP_BUFS; b++) {
+        snap_bufs[b] = malloc(snap_mem() / SNAP_BUFS);
+        if (!snap_bufs[b]) return -1;
+        snap_bufs[b]->retired = 0;
+    }
+    snap_publish();
+    return 0;
+}
+
+/*********** HOST EXPIRY ***********/
+// Cada host tiene un temporizador en la rueda de su worker (host_wheel). La
+// ingesta sólo actualiza 'last_seen' (no toca la rueda); cuando el
+// temporizador vence comprueba la edad real del host y, según el caso, lo
+// vuelve a programar, lo marca como STALE o libera su entrada. Así el coste por muestra es O(1) y constante.
+
+void host_timer_cb(tw_timer_t *t, void *arg);
+
+// Segundos sin datos a partir de los cuales un host se considera STALE.
+double stale_after(void) {
+    return expected_interval * stale_intervals;
+}
+
+// Igual, pero para un host concreto: si su agente suprime envíos y sólo
+// manda heartbeats, se cuentan intervalos de heartbeat en vez de de envío.
+double host_stale_after(const host_info_t *h) {
+    double interval = h->hb_interval > expected_interval ? h->hb_interval
+                                                         : expected_interval;
+    return interval * stale_intervals;
+}
+
+// Segundos sin datos antes de liberar la entrada (nunca antes de STALE).
+double host_ttl_for(const host_info_t *h) {
+    double st = host_stale_after(h);
+    return host_ttl > st ? host_ttl : st;
+}
+
+// Programa el temporizador de 'h' para dentro de 'sec' segundos desde last_seen.
+void host_arm(host_info_t *h, double sec) {
+    tw_schedule(host_wheel, &h->timer, tw_ticks(h->last_seen + sec));
+}
+
+// Libera la entrada de un host caducado para que la pueda usar otro agente.
+// Debe llamarse dentro de la escritura (seqlock) de 'h'. Devuelve el id del
+// nombre, que se pasa a names_release al terminar la escritura.
+name_id_t host_reclaim(host_info_t *h) {
+    name_id_t id = h->id;
+    tw_cancel(&h->timer);
+    host_unindex(h);
+    // Las alertas que estuvieran disparadas dejan de contar.
+    if (n_rules > 0) {
+        alert_slot_t *slots = &alert_slots[(size_t)(h - hosts) * n_rules];
+        for (int r = 0; r < n_rules; r++)
+            if (slots[r].state == ALERT_FIRING)
+                alerts_firing--;
+        memset(slots, 0, n_rules * sizeof(alert_slot_t));
+    }
+    uint32_t seq = atomic_load_explicit(&h->seq, memory_order_relaxed);
+    memset((void *)h, 0, sizeof(*h));   // id == 0 => entrada libre
+    atomic_store_explicit(&h->seq, seq, memory_order_relaxed);
+    atomic_fetch_sub(&hosts_used, 1);
+    return id;
+}
+
+// Callback del temporizador de un host (en el worker dueño de 'h').
+void host_timer_cb(tw_timer_t *t, void *arg) {
+    (void)t;
+    host_info_t *h = arg;
+    double age = now_mono() - h->last_seen;
+    name_id_t freed = 0;
+
+    host_write_begin(h);
+
+    if (age >= host_ttl_for(h) && !h->pinned) {
+        freed = host_reclaim(h);         // Demasiado tiempo sin datos
+    } else if (age >= host_ttl_for(h)) {
+        h->stale = 1;                    // Fijado por una conexión abierta:
+        host_arm(h, age + host_stale_after(h)); // se vuelve a mirar más tarde
+    } else if (age >= host_stale_after(h)) {
+        h->stale = 1;                    // Dejamos de mostrar sus valores
+        host_arm(h, host_ttl_for(h));
+    } else {
+        host_arm(h, host_stale_after(h)); // Llegaron datos: seguimos esperando
+    }
+    host_write_end(h);
+    if (freed)
+        names_release(freed);
+}
+
+// Registra que ha llegado un mensaje de 'h'. Debe llamarse dentro de la
+// escritura (seqlock) de 'h'.
+void host_touch(host_info_t *h) {
+    h->last_seen = now_mono();
+    h->stale = 0;
+    if (!tw_pending(&h->timer)) {
+        // Primera muestra de este host: armamos su temporizador.
+        h->timer.cb = host_timer_cb;
+        h->timer.arg = h;
+        host_arm(h, host_stale_after(h));
+    }
+}
+
+/************* PARSE HELPERS *************/
+// Devuelve el siguiente campo separado por ';' (terminado en '\0') y avanza
+// '*p', o NULL si la línea se acabó. A diferencia de strtok_r no se salta
+// los campos vacíos: tras un HELLO el nombre del host va vacío ("CPU;;...").
+char *next_field(char **p) {
+    char *s = *p;
+    if (!s) return NULL;
+    char *semi = strchr(s, ';');
+    if (semi) {
+        *semi = '\0';
+        *p = semi + 1;
+    } else {
+        *p = NULL;
+    }
+    return s;
+}
+
+// Lee el siguiente campo como float.
+// Devuelve 0 si existe o -1 si la línea se acabó antes (mensaje incompleto).
+int next_float(char **p, float *out) {
+    char *tok = next_field(p);
+    if (!tok || *tok == '\0') return -1;
+    *out = atof(tok);
+    return 0;
+}
+
+// Entrada de host de una línea: la del nombre si lo trae o, si va vacío, la
+// que la conexión enlazó con HELLO ('bound', que el worker busca una sola
+// vez por tanda).
+host_info_t *line_host(const char *name, host_info_t *bound) {
+    return name[0] ? get_host(name) : bound;
+}
+
+// Decodifica el vector de uso por núcleo (dos dígitos hex por núcleo).
+// Devuelve 0 si es válido o -1 si hay caracteres no hexadecimales.
+int decode_core_vector(const char *vec, unsigned char *out, int n) {
+    for (int i = 0; i < n; i++) {
+        int v = 0;
+        for (int k = 0; k < 2; k++) {
+            char ch = vec[2 * i + k];
+            int d = (ch >= '0' && ch <= '9') ? ch - '0'
+                  : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+                  : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+            if (d < 0) return -1;
+            v = v * 16 + d;
+        }
+        out[i] = v > 100 ? 100 : v;
+    }
+    return 0;
+}
+
+/************* PARSE CPU MESSAGE *************/
+// Función que parsea un mensaje de tipo CPU y actualiza la tabla de hosts.
+// Formato esperado: "CPU;ip;usage;user;sys;idle[;iowait;steal;nCores;vector]"
+// 'ip' puede ir vacío si la conexión se identificó con HELLO ('bound').
+// 'ts_ms' es el instante de la muestra. Si es anterior a los datos que ya
+// tenemos sólo se guarda en el historial.
+// Devuelve 0 si actualizó el host, 1 si sólo fue al historial o -1 si el
+// mensaje estaba mal formado.
+int parse_cpu(char *msg, int64_t ts_ms, host_info_t *bound) {
+    char *save = msg;    // Posición en la línea (next_field la avanza)
+    // Primer campo: "CPU" (no lo usamos directamente)
+    next_field(&save);
+    // Segundo campo: IP (vacía = la de la conexión)
+    char *ip = next_field(&save);
+    if (!ip || (!ip[0] && !bound)) return -1; // Mensaje mal formado
+
+    // Tercer a sexto token: usage, user, sys, idle (porcentajes)
+    float usage, user, sys, idle;
+    if (next_float(&save, &usage) || next_float(&save, &user) ||
+        next_float(&save, &sys) || next_float(&save, &idle))
+        return -1;       // Faltan campos: mensaje mal formado
+
+    // Campos opcionales (agentes antiguos no los envían): iowait, steal,
+    // número de núcleos y vector de uso por núcleo.
+    float iowait = 0, steal = 0, ncores_f = 0;
+    unsigned char cores[MAX_CORES];
+    int ncores = 0;
+    if (next_float(&save, &iowait) == 0 && next_float(&save, &steal) == 0 &&
+        next_float(&save, &ncores_f) == 0) {
+        char *vec = next_field(&save);
+        ncores = (int)ncores_f;
+        if (ncores < 0 || ncores > MAX_CORES || !vec ||
+            (int)strlen(vec) < 2 * ncores)
+            return -1;   // Vector incoherente con el número de núcleos
+        if (decode_core_vector(vec, cores, ncores) != 0)
+            return -1;
+    }
+
+    // Eventos de alerta generados por esta muestra
+    alert_event_t ev[MAX_RULES];
+    int n_ev = 0;
+    int rc = 0;
+
+    // Sólo este worker escribe en la entrada; el seqlock avisa a los lectores
+    host_info_t *h = line_host(ip, bound); // Obtenemos (o creamos) la entrada de ese host
+    if (!h) return -1;                     // Tabla llena
+    host_write_begin(h);
+    history_add(&h->cpu_hist, ts_ms, usage);
+    if (ts_ms < h->cpu_ts) {
+        rc = 1;           // Muestra atrasada: no pisa los datos actuales
+    } else {
+        // Actualizamos los campos de CPU
+        h->cpu_ts    = ts_ms;
+        h->cpu_usage = usage;
+        h->cpu_user  = user;
+        h->cpu_sys   = sys;
+        h->cpu_idle  = idle;
+        h->cpu_iowait = iowait;
+        h->cpu_steal  = steal;
+        h->ncores    = ncores;
+        h->core_max_idx = 0;
+        for (int i = 0; i < ncores; i++) {
+            h->core_pct[i] = cores[i];
+            if (cores[i] > cores[h->core_max_idx])
+                h->core_max_idx = i;
+        }
+        h->has_cpu   = 1; // Marcamos que ya tenemos datos de CPU válidos
+        if (relay_host) { // Para la media que se reenvía al collector padre
+            float v[6] = { usage, user, sys, idle, iowait, steal };
+            for (int i = 0; i < 6; i++) h->relay_cpu[i] += v[i];
+            h->relay_n_cpu++;
+        }
+        host_touch(h);    // Actualizamos last_seen (y su temporizador)
+        // Evaluamos sólo las reglas de las métricas de CPU
+        n_ev = alerts_on_sample(h, cpu_metrics,
+                                sizeof(cpu_metrics) / sizeof(cpu_metrics[0]), ev);
+    }
+    host_write_end(h);
+    alerts_emit(ev, n_ev);       // La E/S de alertas va fuera de la escritura
+    return rc;
+}
+
+/************* PARSE MEM MESSAGE *************/
+// Función que parsea un mensaje de tipo MEM y actualiza la tabla de hosts.
+// Formato esperado: "MEM;ip;used;free;swapT;swapF"
+// Igual que parse_cpu: devuelve 0, 1 (sólo historial) o -1 (mal formado).
+int parse_mem(char *msg, int64_t ts_ms, host_info_t *bound) {
+    char *save = msg;   // Posición en la línea
+    // Primer campo: "MEM"
+    next_field(&save);
+    // Segundo campo: IP (vacía = la de la conexión)
+    char *ip = next_field(&save);
+    if (!ip || (!ip[0] && !bound)) return -1;   // Mensaje inválido
+
+    // Siguientes tokens: used, free, swapTotal, swapFree
+    float used, free, swt, swf;
+    if (next_float(&save, &used) || next_float(&save, &free) ||
+        next_float(&save, &swt) || next_float(&save, &swf))
+        return -1;         // Faltan campos: mensaje mal formado
+
+    // Eventos de alerta generados por esta muestra
+    alert_event_t ev[MAX_RULES];
+    int n_ev = 0;
+    int rc = 0;
+
+    // Escritura de la entrada (sólo la hace este worker)
+    host_info_t *h = line_host(ip, bound); // Buscamos/creamos entrada de host
+    if (!h) return -1;                     // Tabla llena
+    host_write_begin(h);
+    history_add(&h->mem_hist, ts_ms, used);
+    if (ts_ms < h->mem_ts) {
+        rc = 1;          // Muestra atrasada: no pisa los datos actuales
+    } else {
+        // Actualizamos los campos de memoria
+        h->mem_ts   = ts_ms;
+        h->mem_used = used;
+        h->mem_free = free;
+        h->swap_t   = swt;
+        h->swap_f   = swf;
+        h->has_mem  = 1; // Marcamos que ya tenemos datos de memoria válidos
+        if (relay_host) { // Para la media que se reenvía al collector padre
+            float v[4] = { used, free, swt, swf };
+            for (int i = 0; i < 4; i++) h->relay_mem[i] += v[i];
+            h->relay_n_mem++;
+        }
+        host_touch(h);   // Actualizamos last_seen (y su temporizador)
+        // Evaluamos sólo las reglas de las métricas de memoria
+        n_ev = alerts_on_sample(h, mem_metrics,
+                                sizeof(mem_metrics) / sizeof(mem_metrics[0]), ev);
+    }
+    host_write_end(h);
+    alerts_emit(ev, n_ev);       // La E/S de alertas va fuera de la escritura
+    return rc;
+}
+
+/************* PARSE PROC MESSAGE *************/
+// Decodifica una lista "pid:comm:cpu:rss,..." en 'out'. Devuelve cuántas
+// entradas leyó o -1 si está mal formada.
+int decode_proc_list(char *list, proc_entry_t *out, int max) {
+    int n = 0;
+    char *save;
+    for (char *item = strtok_r(list, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        if (n == max) return -1;
+        char *c1 = strchr(item, ':');
+        char *c2 = c1 ? strchr(c1 + 1, ':') : NULL;
+        char *c3 = c2 ? strchr(c2 + 1, ':') : NULL;
+        if (!c3) return -1;
+        *c1 = *c2 = *c3 = '\0';
+
+        proc_entry_t *e = &out[n++];
+        e->pid = atoi(item);
+        strncpy(e->comm, c1 + 1, sizeof(e->comm) - 1);
+        e->comm[sizeof(e->comm) - 1] = '\0';
+        e->cpu = atof(c2 + 1);
+        e->rss_mb = atof(c3 + 1);
+        // Fuera de rango (o NaN / infinito): la línea no es de un agente
+        if (!(e->cpu >= 0 && e->cpu <= PROC_CPU_MAX) ||
+            !(e->rss_mb >= 0 && e->rss_mb <= PROC_RSS_MAX))
+            return -1;
+    }
+    return n;
+}
+
+// Formato: "PROC;ip;nprocs;topCpu;topRss". Las listas no tienen historial:
+// una línea atrasada se descarta. Devuelve 0, 1 (atrasada) o -1.
+int parse_procs(char *msg, int64_t ts_ms, host_info_t *bound) {
+    char *f[5];
+    int nf = 0;
+    for (char *p = msg; nf < 5 && p; )
+        f[nf++] = next_field(&p);
+    if (nf != 5 || (!f[1][0] && !bound)) return -1;
+
+    proc_entry_t top_cpu[PROC_TOP_MAX], top_rss[PROC_TOP_MAX];
+    int nprocs = atoi(f[2]);
+    int n_cpu = decode_proc_list(f[3], top_cpu, PROC_TOP_MAX);
+    int n_rss = decode_proc_list(f[4], top_rss, PROC_TOP_MAX);
+    if (n_cpu < 0 || n_rss < 0) return -1;
+
+    int rc = 0;
+    host_info_t *h = line_host(f[1], bound);
+    if (!h) return -1;
+    host_write_begin(h);
+    if (ts_ms < h->procs_ts) {
+        rc = 1;
+    } else {
+        h->procs_ts = ts_ms;
+        h->nprocs = nprocs;
+        h->n_top_cpu = n_cpu;
+        h->n_top_rss = n_rss;
+        memcpy(h->top_cpu, top_cpu, n_cpu * sizeof(proc_entry_t));
+        memcpy(h->top_rss, top_rss, n_rss * sizeof(proc_entry_t));
+        h->has_procs = 1;
+        h->relay_n_procs++;
+        host_touch(h);
+    }
+    host_write_end(h);
+    return rc;
+}
+
+/************* PARSE HEARTBEAT *************/
+// Formato: "HB;ip;intervalo_ms". El agente no envió CPU/MEM porque no
+// cambiaron más que su banda muerta: los últimos valores siguen vigentes.
+// Se añaden al historial con la marca del heartbeat (el intervalo queda como
+// "sin cambios" y no como hueco) y se reevalúan las reglas, para que una
+// alerta con "for" pueda dispararse aunque el valor no se vuelva a enviar.
+// El intervalo se acota a HB_INTERVAL_MAX_MS, para que un host no pueda
+// evitar quedar STALE anunciando un intervalo enorme.
+// Devuelve 0, 1 (heartbeat atrasado: sólo actualiza el intervalo) o -1.
+#define HB_INTERVAL_MAX_MS 3600000.0f   // Una hora
+
+int parse_hb(char *msg, int64_t ts_ms, host_info_t *bound) {
+    char *save = msg;
+    next_field(&save);                       // "HB"
+    char *ip = next_field(&save);
+    if (!ip || (!ip[0] && !bound)) return -1;
+    float interval_ms;
+    if (next_float(&save, &interval_ms) || !isfinite(interval_ms) || interval_ms <= 0)
+        return -1;
+    if (interval_ms > HB_INTERVAL_MAX_MS)
+        interval_ms = HB_INTERVAL_MAX_MS;
+
+    alert_event_t ev[MAX_RULES];
+    int n_ev = 0;
+    int rc = 0;
+
+    host_info_t *h = line_host(ip, bound);
+    if (!h) return -1;
+    host_write_begin(h);
+    h->hb_interval = interval_ms / 1000.0;
+    // Los datos vigentes se confirman en el instante del heartbeat.
+    int late = h->has_cpu || h->has_mem;
+    if (h->has_cpu && ts_ms >= h->cpu_ts) {
+        late = 0;
+        if (ts_ms > h->cpu_ts) {
+            history_add(&h->cpu_hist, ts_ms, h->cpu_usage);
+            h->cpu_ts = ts_ms;
+            n_ev += alerts_on_sample(h, cpu_metrics,
+                                     sizeof(cpu_metrics) / sizeof(cpu_metrics[0]),
+                                     ev + n_ev);
+        }
+    }
+    if (h->has_mem && ts_ms >= h->mem_ts) {
+        late = 0;
+        if (ts_ms > h->mem_ts) {
+            history_add(&h->mem_hist, ts_ms, h->mem_used);
+            h->mem_ts = ts_ms;
+            n_ev += alerts_on_sample(h, mem_metrics,
+                                     sizeof(mem_metrics) / sizeof(mem_metrics[0]),
+                                     ev + n_ev);
+        }
+    }
+    if (late)
+        rc = 1;          // Heartbeat reenviado desde el spool
+    else {
+        h->relay_n_hb++;
+        host_touch(h);   // Sigue vivo (y su umbral STALE ya usa hb_interval)
+    }
+    host_write_end(h);
+    alerts_emit(ev, n_ev);
+    return rc;
+}
+
+/*********** AFINIDAD Y NUMA ***********/
+// Con -P el worker w se fija a la w-ésima CPU de la lista (dando la vuelta
+// si hay menos CPUs que workers). Con -E el resto de los hilos (E/S,
+// dashboard, temporizador) se limita a esas CPUs y cada conexión se fija a
+// la CPU que procesó sus paquetes en el kernel (SO_INCOMING_CPU) si está en
+// la lista: recv lee datos que siguen en la caché de esa CPU.
+//
+// La memoria se reparte por primera escritura, la política por defecto de
+// Linux: la tabla de hosts y los estados de alertas se reservan sin tocar
+// (node_alloc) y cada worker, ya fijado a su CPU, escribe primero su parte
+// y su propia estructura (cola y rueda), que quedan así en su nodo.
+//
+// Cada tanda lleva el nodo del hilo que la armó; el worker que la procesa
+// en otro nodo la cuenta en xnode_batches y xnode_bytes. Es el tráfico de
+// memoria entre nodos que la ingesta genera y lo que -P y -E reducen.
+
+int worker_cpus[CPU_SETSIZE];   // -P, en orden
+int n_worker_cpus = 0;
+cpu_set_t io_cpus;              // -E
+int io_pinned = 0;
+int cpu_node[CPU_SETSIZE];      // Nodo NUMA de cada CPU (0 si no se sabe)
+int n_nodes = 1;
+
+// Lee una lista de CPUs como las de /sys y taskset ("0-3,8,10-11") en
+// 'out'. Devuelve cuántas hay o -1 si está mal formada.
+int parse_cpus(const char *s, int *out) {
+    int n = 0;
+    while (*s && *s != '\n') {
+        char *end;
+        long a = strtol(s, &end, 10), b = a;
+        if (end == s || a < 0 || a >= CPU_SETSIZE) return -1;
+        if (*end == '-') {
+            s = end + 1;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a || b >= CPU_SETSIZE) return -1;
+        }
+        for (long c = a; c <= b && n < CPU_SETSIZE; c++)
+            out[n++] = (int)c;
+        s = end;
+        if (*s == ',') s++;
+        else if (*s && *s != '\n') return -1;
+    }
+    return n;
+}
+
+// Llena cpu_node con /sys/devices/system/node/node<N>/cpulist (los nodos
+// pueden no ser consecutivos).
+void numa_scan(void) {
+    int found = 0;
+    for (int node = 0; node < 1024; node++) {
+        char path[64], line[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int cpus[CPU_SETSIZE];
+        int n = fgets(line, sizeof(line), f) ? parse_cpus(line, cpus) : -1;
+        fclose(f);
+        for (int i = 0; i < n; i++)
+            cpu_node[cpus[i]] = node;
+        found++;
+    }
+    if (found > 1) n_nodes = found;
+}
+
+// Nodo de la CPU en que corre el hilo actual (sched_getcpu no entra al kernel).
+static inline int cur_node(void) {
+    int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_node[cpu] : 0;
+}
+
+// Fija el hilo actual a una CPU.
+void pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Con -E, pasa el hilo de una conexión a la CPU que recibe sus paquetes.
+void steer_conn(int fd) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (io_pinned && getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 &&
+        cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &io_cpus)) {
+        pin_cpu(cpu);
+        stat_add(ST_CONN_STEERED, 1);
+    }
+#else
+    (void)fd;
+#endif
+}
+
+// Valida -P y -E contra las CPUs en que puede correr el proceso y limita el
+// hilo principal (y los que cree después) a las de -E. Devuelve 0 o -1.
+int affinity_setup(const char *wlist, const char *iolist) {
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int cpus[CPU_SETSIZE];
+    if (wlist) {
+        n_worker_cpus = parse_cpus(wlist, worker_cpus);
+        for (int i = 0; i < n_worker_cpus; i++)
+            if (!CPU_ISSET(worker_cpus[i], &allowed)) n_worker_cpus = -1;
+        if (n_worker_cpus <= 0) {
+            fprintf(stderr, "-P %s: CPUs no disponibles o lista mal formada\n", wlist);
+            return -1;
+        }
+    }
+    if (iolist) {
+        int n = parse_cpus(iolist, cpus);
+        CPU_ZERO(&io_cpus);
+        for (int i = 0; i < n; i++) {
+            if (!CPU_ISSET(cpus[i], &allowed)) n = -1;
+            else CPU_SET(cpus[i], &io_cpus);
+        }
+        if (n <= 0) {
+            fprintf(stderr, "-E %s: CPUs no disponibles o lista mal formada\n", iolist);
+            return -1;
+        }
+        io_pinned = 1;
+        pthread_setaffinity_np(pthread_self(), sizeof(io_cpus), &io_cpus);
+    }
+    numa_scan();
+    return 0;
+}
+
+/*********** WORKERS ***********/
+// La ingesta va en dos etapas. Los hilos de E/S (uno por conexión, el de
+// UDP y los anillos compartidos) sólo separan las líneas y las reparten en
+// tandas según el host que nombran; -W workers las parsean y aplican. Cada
+// worker es dueño de los hosts con host_worker(nombre) == w y de sus
+// entradas en la tabla, así que escribe sin mutex y con la entrada en su
+// caché. Las líneas sin nombre (tras HELLO) van al worker del host de la
+// conexión, de modo que las de un mismo host nunca se desordenan.
+//
+// Cada worker tiene una cola MPSC sin locks (intrusiva, de Vyukov): los
+// productores encolan con un solo exchange y el worker desencola sin
+// atómicas de lectura-escritura. Un semáforo cuenta las tandas pendientes
+// y duerme al worker cuando no hay ninguna (sem_post sólo entra al kernel
+// si hay alguien esperando). Si un worker acumula más de WORKER_QUEUE_MAX
+// bytes sin procesar, quien encola espera: el atraso vuelve a los sockets
+// y el control de ingesta lo ve y frena a los agentes. El hilo UDP no
+// espera (el kernel descartaría igual): la tanda se descarta y se cuenta.
+//
+// Cada hilo de E/S arma sus tandas en un buffer fijo por worker y al
+// encolarlas las copia a un nodo del tamaño justo, de modo que la memoria
+// en cola es la de las líneas y no la de los buffers.
+
+#define BATCH_BYTES      4096        // Líneas por tanda (terminadas en '\n')
+#define WORKER_QUEUE_MAX (8u << 20)  // Bytes en cola antes de frenar a la E/S
+
+typedef struct qnode {
+    struct qnode *_Atomic next;
+} qnode_t;
+
+// Tanda de líneas para un worker (el buffer en que se arma tiene
+// BATCH_BYTES de data; la copia encolada, 'len'). data empieza con el
+// nombre del host de la conexión (sin '\0'), para las líneas sin nombre.
+typedef struct {
+    qnode_t node;                 // Enlace en la cola (primer campo)
+    uint64_t t_push;              // Instante en que se encoló (ns)
+    size_t bound_len;             // Bytes del host de la conexión al principio de data
+    size_t len;                   // Bytes usados de data (con el host)
+    int lines;                    // Líneas en data
+    int numa;                     // Nodo NUMA del hilo que la encoló
+    char data[];
+} batch_t;
+
+// Tope de bytes en la cola de cada worker (WORKER_QUEUE_MAX o menos con -B).
+size_t worker_queue_max = WORKER_QUEUE_MAX;
+
+typedef struct {
+    _Alignas(CACHE_LINE) qnode_t *_Atomic head;  // Último encolado (productores)
+    _Atomic uint64_t in_bytes;                   // Bytes encolados, con cabeceras (productores)
+    _Alignas(CACHE_LINE) qnode_t *tail;          // Próximo a sacar (sólo el worker)
+    _Atomic uint64_t out_bytes;                  // Bytes procesados (sólo el worker)
+    qnode_t stub;                                // Nodo vacío de la cola
+    sem_t items;                                 // Tandas pendientes
+    twheel_t wheel;                              // Caducidad de sus hosts
+    int id;
+    _Atomic int cpu;                             // CPU en que procesó la última tanda
+} worker_t;
+
+// Cada worker reserva e inicializa su estructura en su propio hilo, ya en
+// su CPU (ver AFINIDAD Y NUMA).
+worker_t *workers[WORKERS_MAX];
+sem_t workers_ready;
+
+// Encola un nodo (cualquier hilo).
+static void mpsc_push(worker_t *w, qnode_t *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    qnode_t *prev = atomic_exchange_explicit(&w->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+// Saca la tanda más antigua (sólo el worker). Devuelve NULL si la cola está
+// vacía o si un productor está a mitad de encolar (hay que reintentar).
+static batch_t *mpsc_pop(worker_t *w) {
+    qnode_t *tail = w->tail;
+    qnode_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &w->stub) {
+        if (!next) return NULL;
+        w->tail = tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+    if (next) {
+        w->tail = next;
+        return (batch_t *)tail;
+    }
+    // 'tail' es el último nodo: volvemos a poner el stub detrás para poder
+    // sacarlo sin dejar la cola sin nodos.
+    if (tail != atomic_load_explicit(&w->head, memory_order_acquire))
+        return NULL;
+    mpsc_push(w, &w->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (!next) return NULL;
+    w->tail = next;
+    return (batch_t *)tail;
+}
+
+// Tandas y bytes en la cola de un worker (aproximados: se leen sin parar a nadie).
+int worker_depth(worker_t *w) {
+    int n = 0;
+    sem_getvalue(&w->items, &n);
+    return n;
+}
+
+uint64_t worker_queued(worker_t *w) {
+    return atomic_load_explicit(&w->in_bytes, memory_order_relaxed) -
+           atomic_load_explicit(&w->out_bytes, memory_order_relaxed);
+}
+
+// Encola una copia de lo armado en 'stage' para el worker 'w' y vacía
+// 'stage' (hilos de E/S). Con la cola llena espera si 'wait' o, si no,
+// descarta las líneas.
+void batch_push(int w, batch_t *stage, int wait) {
+    worker_t *wk = workers[w];
+    size_t size = sizeof(batch_t) + stage->len;
+    struct timespec pause = { 0, 1000000L };
+    int room = 1;
+    while (worker_queued(wk) + size > worker_queue_max && keep_running) {
+        if (!wait) {
+            room = 0;
+            break;
+        }
+        nanosleep(&pause, NULL);          // Worker desbordado: frenamos la E/S
+    }
+    batch_t *b = room ? malloc(size) : NULL;
+    if (b) {
+        memcpy(b, stage, size);
+        b->t_push = now_ns();
+        b->numa = cur_node();
+        atomic_fetch_add_explicit(&wk->in_bytes, size, memory_order_relaxed);
+        mpsc_push(wk, &b->node);
+        sem_post(&wk->items);
+    } else {
+        stat_add(room ? ST_MSG_BAD : ST_UDP_SHED, stage->lines);
+    }
+    stage->len = 0;
+    stage->lines = 0;
+}
+
+// Memoria de los buffers de tandas de un hilo de E/S (uno por worker).
+size_t batch_stage_mem(void) {
+    return (size_t)n_workers * (sizeof(batch_t) + BATCH_BYTES);
+}
+
+// Añade una línea (sin '\n') a la tanda que se arma para el worker 'w' en
+// 'pend' (un buffer por worker y por hilo de E/S); si no cabe, encola la
+// tanda y empieza otra. 'bound' es el host de la conexión si 'w' es su
+// worker. 'wait' como en batch_push.
+void batch_line(batch_t **pend, int w, const char *bound, const char *line, size_t n,
+                int wait) {
+    batch_t *b = pend[w];
+    if (!b) {
+        b = pend[w] = malloc(sizeof(batch_t) + BATCH_BYTES);
+        if (!b) {
+            stat_add(ST_MSG_BAD, 1);
+            return;
+        }
+        b->len = 0;
+        b->lines = 0;
+    }
+    if (b->len + n + 1 > BATCH_BYTES)
+        batch_push(w, b, wait);
+    if (b->len == 0) {
+        b->bound_len = strlen(bound);
+        memcpy(b->data, bound, b->bound_len);
+        b->len = b->bound_len;
+    }
+    memcpy(b->data + b->len, line, n);
+    b->data[b->len + n] = '\n';
+    b->len += n + 1;
+    b->lines++;
+}
+
+// Encola las tandas en curso. Los hilos de E/S la llaman antes de volver a
+// esperar datos, para que nada quede retenido.
+void batch_flush(batch_t **pend, int wait) {
+    for (int w = 0; w < n_workers; w++)
+        if (pend[w] && pend[w]->len > 0)
+            batch_push(w, pend[w], wait);
+}
+
+// Libera los buffers de tandas de un hilo de E/S (tras batch_flush).
+void batch_free(batch_t **pend) {
+    for (int w = 0; w < n_workers; w++) {
+        free(pend[w]);
+        pend[w] = NULL;
+    }
+}
+
+// Formato: "HELLO;nombre[;clave=valor...]" (ya validado por el hilo de E/S).
+// Fija la entrada del host mientras la conexión siga abierta y guarda los
+// metadatos. Devuelve 0 o -1 si la tabla está llena.
+int apply_hello(char *msg) {
+    char *save = msg;
+    next_field(&save);                       // "HELLO"
+    char *name = next_field(&save);
+    host_info_t *h = name && name[0] ? get_host(name) : NULL;
+    if (!h) return -1;
+    host_write_begin(h);
+    h->pinned++;
+    // El resto de la línea son los metadatos (clave=valor;...)
+    strncpy(h->meta, save ? save : "", sizeof(h->meta) - 1);
+    h->meta[sizeof(h->meta) - 1] = '\0';
+    host_touch(h);
+    host_write_end(h);
+    return 0;
+}
+
+// "UNPIN;nombre": la conexión enlazada a ese host se cerró o cambió de host.
+// No la envía ningún agente: la genera el hilo de E/S, que no la reparte
+// si llega de la red.
+void apply_unpin(const char *name) {
+    host_info_t *h = find_host(name);
+    if (!h || h->pinned <= 0) return;        // HELLO falló con la tabla llena
+    host_write_begin(h);
+    h->pinned--;
+    host_write_end(h);
+}
+
+// Parsea y aplica una línea de datos (terminada en '\0') en el worker.
+void apply_line(char *line, host_info_t *bound) {
+    uint64_t t0 = now_ns();
+    int rc = -1;
+
+    // Prefijo opcional "@<epoch_ms>;" con el instante de la muestra.
+    int64_t ts_ms = 0;
+    if (line[0] == '@') {
+        char *end;
+        ts_ms = strtoll(line + 1, &end, 10);
+        if (*end != ';' || ts_ms <= 0) {
+            stat_add(ST_MSG_BAD, 1);
+            return;
+        }
+        line = end + 1;
+        stat_add(ST_MSG_REPLAY, 1);
+    } else {
+        ts_ms = now_wall_ms();
+    }
+
+    // Si la línea empieza por "CPU;", la tratamos como mensaje de CPU.
+    if (strncmp(line, "CPU;", 4) == 0) {
+        if ((rc = parse_cpu(line, ts_ms, bound)) >= 0) stat_add(ST_MSG_CPU, 1);
+    }
+    // Si empieza por "MEM;", la tratamos como mensaje de memoria.
+    else if (strncmp(line, "MEM;", 4) == 0) {
+        if ((rc = parse_mem(line, ts_ms, bound)) >= 0) stat_add(ST_MSG_MEM, 1);
+    }
+    // Listas top-N de procesos.
+    else if (strncmp(line, "PROC;", 5) == 0) {
+        if ((rc = parse_procs(line, ts_ms, bound)) >= 0) stat_add(ST_MSG_PROC, 1);
+    }
+    // Heartbeat de un agente que suprime envíos sin cambios.
+    else if (strncmp(line, "HB;", 3) == 0) {
+        if ((rc = parse_hb(line, ts_ms, bound)) >= 0) stat_add(ST_MSG_HB, 1);
+    }
+    // Identificación de la conexión.
+    else if (strncmp(line, "HELLO;", 6) == 0) {
+        if ((rc = apply_hello(line)) >= 0) stat_add(ST_MSG_HELLO, 1);
+    }
+    else if (strncmp(line, "UNPIN;", 6) == 0) {
+        apply_unpin(line + 6);
+        return;
+    }
+
+    if (rc < 0)
+        stat_add(ST_MSG_BAD, 1);
+    else if (rc == 1)
+        stat_add(ST_MSG_LATE, 1);
+    stat_record(H_PARSE, now_ns() - t0);
+}
+
+// Procesa todas las líneas de una tanda.
+void apply_batch(batch_t *b) {
+    // El host enlazado se busca una vez por tanda, no por línea.
+    host_info_t *bound = NULL;
+    if (b->bound_len > 0) {
+        char name[NAME_MAX_LEN + 1];
+        memcpy(name, b->data, b->bound_len);
+        name[b->bound_len] = '\0';
+        bound = get_host(name);
+    }
+    char *start = b->data + b->bound_len, *end = b->data + b->len;
+    while (start < end) {
+        char *nl = memchr(start, '\n', end - start);
+        *nl = '\0';
+        apply_line(start, bound);
+        start = nl + 1;
+    }
+}
+
+// Convierte el hilo actual en el worker 'id': lo fija a su CPU (-P), crea
+// su estructura, limpia su parte de la tabla y prepara su rueda e índice de
+// nombres. Devuelve el worker o NULL si no hubo memoria.
+worker_t *worker_attach(int id) {
+    worker_id = id;
+    if (n_worker_cpus > 0)
+        pin_cpu(worker_cpus[worker_id % n_worker_cpus]);
+
+    // Primeras escrituras desde su CPU: su estructura, su parte de la tabla
+    // y sus estados de alertas quedan en su nodo.
+    worker_t *w = node_alloc(sizeof(worker_t));
+    if (!w) return NULL;
+    memset(w, 0, sizeof(*w));
+    int lo = part_lo(worker_id), hi = part_lo(worker_id + 1);
+    memset(&hosts[lo], 0, (size_t)(hi - lo) * sizeof(host_info_t));
+    if (alert_slots)
+        memset(&alert_slots[(size_t)lo * n_rules], 0,
+               (size_t)(hi - lo) * n_rules * sizeof(alert_slot_t));
+    w->id = worker_id;
+    w->stub.next = NULL;
+    w->head = w->tail = &w->stub;
+    sem_init(&w->items, 0, 0);
+    tw_init(&w->wheel, tw_ticks(now_mono()));
+    w->cpu = sched_getcpu();
+    host_wheel = &w->wheel;
+    return names_worker_init() == 0 ? w : NULL;
+}
+
+void *worker_thread(void *arg) {
+    worker_t *w = worker_attach((int)(intptr_t)arg);
+    if (!w) {
+        perror("mmap");
+        exit(1);
+    }
+    workers[worker_id] = w;
+    sem_post(&workers_ready);
+
+    while (keep_running) {
+        // La rueda de caducidad avanza aquí: sus callbacks tocan los hosts.
+        tw_advance(&w->wheel, tw_ticks(now_mono()));
+
+        // Sin tandas esperamos como mucho un tick de la rueda.
+        if (sem_trywait(&w->items) != 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += TW_TICK_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            if (sem_timedwait(&w->items, &ts) != 0) continue;
+        }
+        batch_t *b;
+        while (!(b = mpsc_pop(w)))
+            sched_yield();                   // El productor está terminando de encolar
+        stat_record(H_QUEUE_WAIT, now_ns() - b->t_push);
+        int cpu = sched_getcpu();
+        atomic_store_explicit(&w->cpu, cpu, memory_order_relaxed);
+        if (cpu >= 0 && cpu < CPU_SETSIZE && cpu_node[cpu] != b->numa) {
+            stat_add(ST_XNODE_BATCHES, 1);
+            stat_add(ST_XNODE_BYTES, sizeof(batch_t) + b->len);
+        }
+        apply_batch(b);
+        atomic_fetch_add_explicit(&w->out_bytes, sizeof(batch_t) + b->len,
+                                  memory_order_relaxed);
+        free(b);
+    }
+    return NULL;
+}
+
+// Arranca los workers y espera a que cada uno tenga lista su cola.
+void workers_start(void) {
+    sem_init(&workers_ready, 0, 0);
+    for (int i = 0; i < n_workers; i++) {
+        pthread_t th;
+        pthread_create(&th, NULL, worker_thread, (void *)(intptr_t)i);
+        pthread_detach(th);
+    }
+    for (int i = 0; i < n_workers; i++)
+        sem_wait(&workers_ready);
+}
+
+/*********** CONNECTIONS ***********/
+// Cada conexión tiene un plazo de inactividad gestionado por conn_wheel
+// (compartida por todas las conexiones y avanzada por timer_thread, sin un
+// temporizador del sistema por conexión). El plazo sólo se renueva al recibir
+// una línea completa, de modo que un cliente que envía bytes sueltos sin '\n'
+// (slowloris) no consigue mantener la conexión abierta. Además una línea no
+// puede superar MAX_LINE bytes.
+
+// Motivos por los que se cierra una conexión.
+typedef enum {
+    CLOSE_PEER = 0,     // El cliente cerró la conexión
+    CLOSE_ERROR,        // Error en recv
+    CLOSE_IDLE,         // Superó el plazo de inactividad
+    CLOSE_LONG_LINE,    // Línea de más de MAX_LINE bytes sin '\n'
+    CLOSE_SHUTDOWN,     // El collector se está cerrando
+    CLOSE_REDIRECT,     // El host es de otro nodo del cluster (REDIRECT)
+    CLOSE_COUNT
+} close_reason_t;
+
+static const char *close_names[CLOSE_COUNT] = {
+    "cliente", "error", "inactiva", "linea_larga", "apagado", "redirigida"
+};
+
+// Anillo SPSC en memoria compartida con un agente local (ver INGESTA POR
+// MEMORIA COMPARTIDA). El agente escribe líneas completas y avanza 'tail';
+// el collector las consume y avanza 'head'. Los contadores crecen sin
+// límite y se usan módulo el tamaño (potencia de 2). 'waiting' = 1 indica
+// que el collector va a dormir y hay que despertarlo por el eventfd. El
+// agente mantiene la misma estructura en agent.c.
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t head;
+    _Alignas(CACHE_LINE) _Atomic uint64_t tail;
+    _Alignas(CACHE_LINE) _Atomic uint32_t waiting;
+    uint32_t size;                // Bytes de data[] (el collector no lo usa)
+    _Alignas(CACHE_LINE) char data[];
+} shm_ring_t;
+
+typedef struct conn {
+    int fd;                       // Socket del cliente
+    _Atomic uint64_t last_tick;   // Tick de la última línea completa
+    _Atomic int reason;           // Motivo de cierre fijado por el temporizador (-1 = ninguno)
+    tw_timer_t timer;             // Temporizador de inactividad en conn_wheel
+    char bound[NAME_MAX_LEN + 1]; // Host enlazado con HELLO ("" si ninguno; conn_lock)
+    int bound_w;                  // Worker de ese host
+    batch_t *pend[WORKERS_MAX];   // Tandas en curso para cada worker
+    pthread_mutex_t wlock;        // Serializa las escrituras (respuestas y CTL)
+    struct conn *next, *prev;     // Registro de conexiones abiertas (conn_lock)
+    long period_ms;               // Periodo anunciado en HELLO (conn_lock, 0 = no es agente)
+    int ctl_level;                // Último nivel de degradación enviado (conn_lock)
+    int is_unix;                  // Llegó por el socket Unix (-L): admite SHM
+    int pass_fd[2];               // memfd y eventfd recibidos con SCM_RIGHTS (-1 = no)
+    shm_ring_t *ring;             // Anillo del agente (NULL = sólo socket)
+    uint64_t ring_size;           // Tamaño validado al enlazarlo (no se relee)
+    size_t ring_map_len;
+    int shm_efd;                  // eventfd con el que el agente nos despierta
+    size_t len;                   // Bytes pendientes (línea incompleta) en buf
+    char buf[MAX_LINE];           // Buffer de recepción
+} conn_t;
+
+// Rueda de temporizadores de las conexiones y su mutex.
+twheel_t conn_wheel;
+pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Segundos sin recibir una línea completa antes de cerrar (-t).
+double idle_timeout = 30.0;
+
+// Admisión: conexiones abiertas a la vez (-c, o lo que quepa en -B). Cada
+// hilo de conexión tiene una pila de CONN_STACK en vez de la de 8 MB por
+// defecto (sus buffers grandes van en el heap o son _Thread_local).
+#define DEFAULT_CONNS 256
+#define CONN_STACK    (256u << 10)
+int max_conns = DEFAULT_CONNS;
+
+// Memoria que se reserva del presupuesto por cada conexión.
+size_t conn_cost(void) {
+    return sizeof(conn_t) + CONN_STACK + batch_stage_mem();
+}
+
+// Conexiones activas y cierres por motivo (protegidos por conn_lock).
+int active_conns = 0;
+unsigned long close_counts[CLOSE_COUNT];
+
+// Lista de conexiones abiertas (protegida por conn_lock).
+conn_t *conn_list = NULL;
+
+// Atraso de ingesta medido y nivel de degradación pedido a los agentes
+// (los actualiza ingest_control; se leen desde STATS y el panel).
+_Atomic long ingest_lag_ms = 0;
+_Atomic int ctl_level = 0;
+
+// Añade/quita una conexión del registro. Deben llamarse con conn_lock tomado.
+void conn_register(conn_t *c) {
+    c->prev = NULL;
+    c->next = conn_list;
+    if (conn_list) conn_list->prev = c;
+    conn_list = c;
+}
+
+void conn_unregister(conn_t *c) {
+    if (c->prev) c->prev->next = c->next;
+    else conn_list = c->next;
+    if (c->next) c->next->prev = c->prev;
+}
+
+// Callback del temporizador de inactividad (con conn_lock tomado).
+void conn_timer_cb(tw_timer_t *t, void *arg) {
+    conn_t *c = arg;
+    uint64_t deadline = atomic_load_explicit(&c->last_tick, memory_order_relaxed)
+                        + tw_ticks(idle_timeout);
+    if (deadline > conn_wheel.now) {
+        // Hubo actividad desde que se programó: movemos el plazo.
+        tw_schedule(&conn_wheel, t, deadline);
+        return;
+    }
+    // Plazo vencido: shutdown despierta al hilo bloqueado en recv.
+    atomic_store(&c->reason, CLOSE_IDLE);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// Caracteres de un float con "%.1f" o "%.2f" en el peor caso (FLT_MAX tiene
+// 39 cifras, más signo y decimales): los valores de los agentes no se acotan.
+#define FLOAT_TXT_MAX 48
+
+// Añade texto con formato a 'buf' (de 'size' bytes) desde 'len' y devuelve
+// la nueva longitud. Lo que no cabe se corta: la longitud queda en size - 1
+// como mucho y nunca se escribe fuera del buffer.
+size_t buf_printf(char *buf, size_t size, size_t len, const char *fmt, ...) {
+    if (len + 1 >= size) return len;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return len;
+    return len + n < size ? len + n : size - 1;
+}
+
+// Envía todo el buffer por el socket. Devuelve 0 si todo enviado, -1 en error.
+// MSG_NOSIGNAL evita que un cliente desconectado nos mate con SIGPIPE.
+int send_all(int fd, const char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t sent = send(fd, buf + total, len - total, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += (size_t)sent;
+    }
+    return 0;
+}
+
+// Escribe en la conexión sin mezclarse con otros hilos que también le
+// escriben (el hilo del cliente responde comandos; el temporizador manda CTL).
+int conn_send(conn_t *c, const char *buf, size_t len) {
+    pthread_mutex_lock(&c->wlock);
+    int rc = send_all(c->fd, buf, len);
+    pthread_mutex_unlock(&c->wlock);
+    return rc;
+}
+
+// Responde al comando STATS con las métricas internas en formato texto,
+// una por línea, terminando con "END":
+//   counter <nombre> <valor>
+//   gauge <nombre> <valor>
+//   hist <nombre> count=<n> p50=<ns> p90=<ns> p99=<ns> max=<ns>
+void send_stats(conn_t *c) {
+    static _Thread_local stat_totals_t t;   // ~12 KB: fuera de la pila
+    stats_collect(&t);
+
+    pthread_mutex_lock(&conn_lock);
+    int conns = active_conns;
+    pthread_mutex_unlock(&conn_lock);
+
+    char out[4096];
+    size_t len = 0;
+    for (int k = 0; k < ST_COUNT; k++)
+        len = buf_printf(out, sizeof(out), len, "counter %s %llu\n",
+                         stat_names[k], (unsigned long long)t.counters[k]);
+    len = buf_printf(out, sizeof(out), len, "gauge active_conns %d\n", conns);
+    len = buf_printf(out, sizeof(out), len, "gauge ingest_lag_ms %ld\n",
+                     atomic_load(&ingest_lag_ms));
+    len = buf_printf(out, sizeof(out), len, "gauge ctl_level %d\n",
+                     atomic_load(&ctl_level));
+    len = buf_printf(out, sizeof(out), len,
+                     "gauge max_conns %d\ngauge mem_reserved %zu\ngauge mem_budget %zu\n",
+                     max_conns, atomic_load(&mem_reserved), mem_budget);
+    for (int w = 0; w < n_workers; w++)
+        len = buf_printf(out, sizeof(out), len,
+                         "gauge queue_depth_w%d %d\ngauge queue_bytes_w%d %llu\n",
+                         w, worker_depth(workers[w]),
+                         w, (unsigned long long)worker_queued(workers[w]));
+    for (int w = 0; w < n_workers; w++)
+        len = buf_printf(out, sizeof(out), len, "gauge cpu_w%d %d\n",
+                         w, atomic_load(&workers[w]->cpu));
+    len = buf_printf(out, sizeof(out), len, "gauge numa_nodes %d\n", n_nodes);
+    int slot;
+    const snapshot_t *s = snap_get(&slot);
+    len = buf_printf(out, sizeof(out), len, "gauge snap_age_ms %.0f\ngauge snap_hosts %d\n",
+                     (now_mono() - s->taken) * 1000, s->n);
+    snap_put(slot);
+    for (int h = 0; h < H_COUNT; h++)
+        len = buf_printf(out, sizeof(out), len,
+                         "hist %s count=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+                         hist_names[h],
+                         (unsigned long long)hist_count(t.hist[h]),
+                         (unsigned long long)hist_percentile(t.hist[h], 50),
+                         (unsigned long long)hist_percentile(t.hist[h], 90),
+                         (unsigned long long)hist_percentile(t.hist[h], 99),
+                         (unsigned long long)hist_percentile(t.hist[h], 100));
+    // Si algún día no cupiera todo, la respuesta se corta pero termina en END
+    if (len > sizeof(out) - 5)
+        len = sizeof(out) - 5;
+    len = buf_printf(out, sizeof(out), len, "END\n");
+    conn_send(c, out, len);
+}
+
+// Responde al comando "HISTORY <host>" con el historial del host:
+//   cpu <epoch_ms> <cpu_usage>
+//   mem <epoch_ms> <mem_used>
+// terminando con "END".
+void send_history(conn_t *c, const char *ip) {
+    int slot;
+    const snapshot_t *s = snap_get(&slot);
+    const host_info_t *h = snap_find(s, ip);
+
+    // Cada línea: tipo, marca de tiempo (hasta 20 caracteres) y valor
+    char out[2 * HISTORY_LEN * (32 + FLOAT_TXT_MAX) + 16];
+    size_t len = 0;
+    if (h) {
+        const history_t *cpu = &h->cpu_hist, *mem = &h->mem_hist;
+        for (int i = 0; i < cpu->n; i++)
+            len = buf_printf(out, sizeof(out), len, "cpu %lld %.2f\n",
+                             (long long)history_get(cpu, i)->ts_ms,
+                             history_get(cpu, i)->value);
+        for (int i = 0; i < mem->n; i++)
+            len = buf_printf(out, sizeof(out), len, "mem %lld %.2f\n",
+                             (long long)history_get(mem, i)->ts_ms,
+                             history_get(mem, i)->value);
+    }
+    snap_put(slot);
+    len = buf_printf(out, sizeof(out), len, "END\n");
+    conn_send(c, out, len);
+}
+
+// Responde al comando "TOP <host>" con las listas de procesos del host:
+//   procs <n>
+//   cpu <pid> <comando> <cpu_pct> <rss_mb>
+//   rss <pid> <comando> <cpu_pct> <rss_mb>
+// terminando con "END".
+void send_top(conn_t *c, const char *ip) {
+    int slot;
+    const snapshot_t *s = snap_get(&slot);
+    const host_info_t *h = snap_find(s, ip);
+
+    // "procs", dos listas de líneas acotadas por decode_proc_list y "END"
+    char out[(2 * PROC_TOP_MAX + 2) * PROC_LINE_MAX];
+    size_t len = 0;
+    if (h && h->has_procs) {
+        int n_cpu = h->n_top_cpu, n_rss = h->n_top_rss;
+        const proc_entry_t *top_cpu = h->top_cpu, *top_rss = h->top_rss;
+        len = buf_printf(out, sizeof(out), len, "procs %d\n", h->nprocs);
+        for (int i = 0; i < n_cpu; i++)
+            len = buf_printf(out, sizeof(out), len, "cpu %d %s %.1f %.1f\n",
+                             top_cpu[i].pid, top_cpu[i].comm,
+                             top_cpu[i].cpu, top_cpu[i].rss_mb);
+        for (int i = 0; i < n_rss; i++)
+            len = buf_printf(out, sizeof(out), len, "rss %d %s %.1f %.1f\n",
+                             top_rss[i].pid, top_rss[i].comm,
+                             top_rss[i].cpu, top_rss[i].rss_mb);
+    }
+    snap_put(slot);
+    len = buf_printf(out, sizeof(out), len, "END\n");
+    conn_send(c, out, len);
+}
+
+/*********** CLUSTER ***********/
+// Con -C varios collectors se reparten los hosts con un anillo de hash
+// consistente: cada nodo ocupa CLUSTER_VNODES puntos del anillo (el hash de
+// "host:puerto#i") y un host pertenece al nodo del primer punto a partir
+// del hash de su nombre. Al añadir o quitar un nodo sólo cambian de dueño
+// los hosts de los tramos que ese nodo gana o pierde (~1/N del total).
+// Todos los nodos arrancan con la misma lista -C; -M indica cuál es este.
+//
+// Un agente que se presenta (HELLO) en un nodo que no es el suyo recibe
+// "REDIRECT;host:puerto" y se cierra la conexión. Las consultas se
+// resuelven en cualquier nodo: HOSTS junta las tablas de todos (scatter/
+// gather en paralelo) y HISTORY/TOP se reenvían al dueño del host. Lo que
+// un nodo pide a otro va con el prefijo "LOCAL " para que se conteste sin
+// volver a reenviar.
+
+#define CLUSTER_MAX        16
+#define CLUSTER_VNODES     256
+#define CLUSTER_TIMEOUT_MS 1000
+#define CLUSTER_RESP_MAX   32768   // Tope de la respuesta de un nodo
+
+typedef struct {
+    uint64_t hash;
+    int node;
+} ring_point_t;
+
+char cluster_nodes[CLUSTER_MAX][64];  // "host:puerto" de cada nodo
+int n_cluster = 0;                    // 0 = sin cluster
+int cluster_self = -1;                // Índice de este nodo
+ring_point_t ring[CLUSTER_MAX * CLUSTER_VNODES];
+int ring_len = 0;
+
+int ring_cmp(const void *a, const void *b) {
+    uint64_t x = ((const ring_point_t *)a)->hash, y = ((const ring_point_t *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// Carga la lista "host:puerto,host:puerto,..." y arma el anillo.
+// 'self' debe ser uno de los nodos. Devuelve 0 o -1.
+int cluster_init(char *list, const char *self) {
+    char *save;
+    for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n_cluster == CLUSTER_MAX || strlen(tok) >= sizeof(cluster_nodes[0]) ||
+            !strrchr(tok, ':')) {
+            fprintf(stderr, "Nodo de cluster inválido: %s\n", tok);
+            return -1;
+        }
+        strcpy(cluster_nodes[n_cluster], tok);
+        if (strcmp(tok, self) == 0) cluster_self = n_cluster;
+        n_cluster++;
+    }
+    if (cluster_self < 0) {
+        fprintf(stderr, "-M %s no está en la lista de -C\n", self);
+        return -1;
+    }
+    for (int n = 0; n < n_cluster; n++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            char key[sizeof(cluster_nodes[0]) + 12];   // "host:puerto#vnodo"
+            snprintf(key, sizeof(key), "%.*s#%d", (int)sizeof(cluster_nodes[0]) - 1,
+                     cluster_nodes[n], v);
+            ring[ring_len].hash = ring_hash(key);
+            ring[ring_len].node = n;
+            ring_len++;
+        }
+    }
+    qsort(ring, ring_len, sizeof(ring[0]), ring_cmp);
+    return 0;
+}
+
+// Nodo dueño de un host, o -1 si no hay cluster.
+int cluster_owner(const char *name) {
+    if (n_cluster == 0) return -1;
+    uint64_t h = ring_hash(name);
+    int lo = 0, hi = ring_len;          // Primer punto con hash >= h
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return ring[lo == ring_len ? 0 : lo].node;
+}
+
+// Abre un connect no bloqueante al nodo 'n'. Devuelve el fd o -1.
+int cluster_dial(int n) {
+    char host[64];
+    strcpy(host, cluster_nodes[n]);
+    char *colon = strrchr(host, ':');
+    *colon = '\0';
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Envía "LOCAL <cmd>" a los nodos indicados, todos a la vez, y junta sus
+// respuestas (sin el "END" final) en 'out'. Un nodo que no contesta en
+// CLUSTER_TIMEOUT_MS deja una línea "# <nodo> sin respuesta".
+// Devuelve los bytes escritos en 'out'.
+size_t cluster_query(const int *nodes, int n, const char *cmd, char *out, size_t size) {
+    struct pollfd pfd[CLUSTER_MAX];
+    char *resp[CLUSTER_MAX];
+    size_t rlen[CLUSTER_MAX];
+    int done[CLUSTER_MAX];
+    char req[MAX_LINE + 8];
+    int req_len = snprintf(req, sizeof(req), "LOCAL %s\n", cmd);
+
+    for (int i = 0; i < n; i++) {
+        pfd[i].fd = cluster_dial(nodes[i]);
+        pfd[i].events = POLLOUT;          // Primero esperamos al connect
+        resp[i] = mem_alloc(CLUSTER_RESP_MAX);
+        rlen[i] = 0;
+        done[i] = pfd[i].fd < 0 || !resp[i];
+    }
+
+    double deadline = now_mono() + CLUSTER_TIMEOUT_MS / 1000.0;
+    for (;;) {
+        int pending = 0;
+        for (int i = 0; i < n; i++) pending += !done[i];
+        double left = deadline - now_mono();
+        if (pending == 0 || left <= 0) break;
+
+        struct pollfd wait[CLUSTER_MAX];
+        int idx[CLUSTER_MAX], nw = 0;
+        for (int i = 0; i < n; i++)
+            if (!done[i]) { wait[nw] = pfd[i]; idx[nw++] = i; }
+        if (poll(wait, nw, (int)(left * 1000) + 1) <= 0) continue;
+
+        for (int k = 0; k < nw; k++) {
+            int i = idx[k];
+            if (!wait[k].revents) continue;
+            if (pfd[i].events == POLLOUT) {
+                // Conectó (o falló): mandamos la consulta, que es corta.
+                if (send(pfd[i].fd, req, req_len, MSG_NOSIGNAL) != req_len) done[i] = 1;
+                else pfd[i].events = POLLIN;
+                continue;
+            }
+            ssize_t r = recv(pfd[i].fd, resp[i] + rlen[i], CLUSTER_RESP_MAX - 1 - rlen[i], 0);
+            if (r <= 0) { done[i] = 1; continue; }
+            rlen[i] += r;
+            resp[i][rlen[i]] = '\0';
+            // La respuesta termina con una línea "END"
+            if ((rlen[i] >= 4 && strcmp(resp[i] + rlen[i] - 4, "END\n") == 0 &&
+                 (rlen[i] == 4 || resp[i][rlen[i] - 5] == '\n')) ||
+                rlen[i] == CLUSTER_RESP_MAX - 1)
+                done[i] = 2;
+        }
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        if (done[i] == 2 && resp[i]) {
+            size_t body = rlen[i] >= 4 ? rlen[i] - 4 : 0;   // Sin "END\n"
+            if (len + body < size) {
+                memcpy(out + len, resp[i], body);
+                len += body;
+            }
+        } else if (len + 80 < size) {
+            len += snprintf(out + len, size - len, "# %s sin respuesta\n",
+                            cluster_nodes[nodes[i]]);
+        }
+        if (pfd[i].fd >= 0) close(pfd[i].fd);
+        mem_free(resp[i], CLUSTER_RESP_MAX);
+    }
+    stat_add(ST_PROXIED, 1);
+    return len;
+}
+
+// Reenvía una consulta sobre 'name' a su nodo dueño si no es este.
+// Devuelve 1 si la respondió (con su "END") o 0 si hay que contestarla aquí.
+int cluster_forward(conn_t *c, const char *cmd, const char *name) {
+    int owner = cluster_owner(name);
+    if (owner < 0 || owner == cluster_self) return 0;
+    char *out = mem_alloc(CLUSTER_RESP_MAX + 8);
+    if (!out) {
+        conn_send(c, "# sin memoria\nEND\n", 18);
+        return 1;
+    }
+    size_t len = cluster_query(&owner, 1, cmd, out, CLUSTER_RESP_MAX);
+    len += snprintf(out + len, 8, "END\n");
+    conn_send(c, out, len);
+    mem_free(out, CLUSTER_RESP_MAX + 8);
+    return 1;
+}
+
+// Responde a "HOSTS" con una línea por host:
+//   host <nombre> <nodo> <ok|stale> <cpu_usage|-> <mem_used|-> <metadatos|->
+// terminando con "END". En un cluster (y si no es una consulta LOCAL de
+// otro nodo) se añaden las de los demás nodos.
+// Tope de una línea de HOSTS: nombre, nodo, estado, dos valores y metadatos.
+#define HOSTS_LINE_MAX (16 + NAME_MAX_LEN + sizeof(cluster_nodes[0]) + 2 * FLOAT_TXT_MAX + \
+                        sizeof(((host_info_t *)0)->meta))
+
+void send_hosts(conn_t *c, int local) {
+    size_t size = (size_t)table_size * HOSTS_LINE_MAX + (size_t)CLUSTER_MAX * CLUSTER_RESP_MAX + 8;
+    char *out = mem_alloc(size);
+    if (!out) {
+        conn_send(c, "# sin memoria\nEND\n", 18);
+        return;
+    }
+    const char *self = n_cluster ? cluster_nodes[cluster_self] : "-";
+    size_t len = 0;
+
+    int slot;
+    const snapshot_t *s = snap_get(&slot);
+    for (int i = 0; i < s->n; i++) {
+        const host_info_t *h = &s->h[i];
+        len = buf_printf(out, size, len, "host %s %s %s ", name_of(h->id), self,
+                         h->stale ? "stale" : "ok");
+        len = h->has_cpu ? buf_printf(out, size, len, "%.1f ", h->cpu_usage)
+                         : buf_printf(out, size, len, "- ");
+        len = h->has_mem ? buf_printf(out, size, len, "%.1f ", h->mem_used)
+                         : buf_printf(out, size, len, "- ");
+        len = buf_printf(out, size, len, "%s\n", h->meta[0] ? h->meta : "-");
+    }
+    snap_put(slot);
+
+    // Los 8 últimos bytes quedan para el "END"
+    if (n_cluster > 1 && !local && len + 8 < size) {
+        int others[CLUSTER_MAX], n = 0;
+        for (int i = 0; i < n_cluster; i++)
+            if (i != cluster_self) others[n++] = i;
+        len += cluster_query(others, n, "HOSTS", out + len, size - len - 8);
+    }
+    len = buf_printf(out, size, len, "END\n");
+    conn_send(c, out, len);
+    mem_free(out, size);
+}
+
+// Formato: "HELLO;nombre[;clave=valor...]". El agente se identifica una vez
+// por conexión: la conexión queda enlazada al host y las líneas siguientes
+// pueden llevar el nombre vacío ("CPU;;..."); van al worker de ese host,
+// que las escribe en su entrada sin buscarla. Mientras la conexión siga
+// abierta la entrada está fijada (no se libera por TTL): el worker la fija
+// al aplicar el HELLO y la suelta con el UNPIN que se le manda al cerrar.
+// Devuelve 0 o -1 si falta el nombre.
+int handle_hello(conn_t *c, batch_t **pend, char *msg) {
+    char *name = msg + 6;                    // Tras "HELLO;"
+    size_t n = strcspn(name, ";");
+    if (n == 0 || n > NAME_MAX_LEN) return -1;
+    char sep = name[n];
+    name[n] = '\0';                          // Sólo mientras miramos el nombre
+
+    // En un cluster el host puede ser de otro nodo: se lo indicamos al
+    // agente y cerramos (las líneas que ya mandó se descartan).
+    int owner = cluster_owner(name);
+    if (owner >= 0 && owner != cluster_self) {
+        char line[96];
+        int len = snprintf(line, sizeof(line), "REDIRECT;%s\n", cluster_nodes[owner]);
+        conn_send(c, line, len);
+        atomic_store(&c->reason, CLOSE_REDIRECT);
+        shutdown(c->fd, SHUT_RD);
+        stat_add(ST_REDIRECTS, 1);
+        return 0;
+    }
+
+    // Un segundo HELLO cambia de host: se suelta el anterior y se encola lo
+    // pendiente, que aún va con el host anterior.
+    if (c->bound[0]) {
+        char unpin[NAME_MAX_LEN + 8];
+        int len = snprintf(unpin, sizeof(unpin), "UNPIN;%s", c->bound);
+        batch_line(pend, c->bound_w, c->bound, unpin, len, 1);
+    }
+    batch_flush(pend, 1);
+
+    // El periodo anunciado es la base de los CTL de control de ritmo.
+    const char *p = sep ? strstr(name + n + 1, "period_ms=") : NULL;
+    pthread_mutex_lock(&conn_lock);
+    strncpy(c->bound, name, sizeof(c->bound) - 1);
+    c->bound[sizeof(c->bound) - 1] = '\0';
+    c->bound_w = host_worker(name, n);
+    c->period_ms = p ? strtol(p + 10, NULL, 10) : 0;
+    c->ctl_level = -1;                       // Recibe el nivel vigente, aunque sea 0
+    pthread_mutex_unlock(&conn_lock);
 
-// Includes estándar de C
-#include <stdio.h>      // printf, fprintf, etc.
-#include <stdlib.h>     // malloc, free, atof, exit...
-#include <string.h>     // memset, strcmp, strncpy, strtok...
-#include <unistd.h>     // close, sleep, read, write...
-#include <errno.h>      // errno y mensajes de error
-#include <signal.h>     // manejo de señales (sigaction, SIGINT)
-#include <pthread.h>    // hilos POSIX (pthread_t, pthread_create, mutex...)
-#include <ctype.h>      // funciones sobre caracteres (aquí casi no se usan)
+    name[n] = sep;
+    batch_line(pend, c->bound_w, c->bound, msg, strlen(msg), 1);
+    return 0;
+}
 
-// Includes para sockets
-#include <sys/types.h>  // tipos como socklen_t
-#include <sys/socket.h> // socket, bind, listen, accept, recv...
-#include <netdb.h>      // getaddrinfo, struct addrinfo
-#include <arpa/inet.h>  // funciones para direcciones IP (inet_ntoa, etc.)
+/*********** INGESTA POR MEMORIA COMPARTIDA ***********/
+// Un agente conectado por el socket Unix puede pasar con SCM_RIGHTS un
+// memfd (el anillo) y un eventfd, y anunciarlos con "SHM;<tamaño>". Desde
+// ahí escribe sus líneas en el anillo sin llamadas al sistema; sólo cuando
+// el collector está dormido (waiting) lo despierta con el eventfd. El
+// socket sigue abierto para HELLO, CTL, el cierre y lo que no quepa.
+// El memfd debe venir sellado contra encogerse (F_SEAL_SHRINK): si el
+// agente lo truncara después, el collector recibiría SIGBUS al leerlo.
 
-// Máximo número de hosts (IPs) que vamos a almacenar simultáneamente
-#define MAX_HOSTS 64
+#define SHM_RING_MIN 4096
+#define SHM_RING_MAX (64u << 20)
 
-// Tamaño máximo de línea de texto que esperamos recibir por el socket
-#define MAX_LINE 512
+// Enlaza el anillo anunciado por "SHM;<tamaño>" con los descriptores
+// recibidos. Devuelve 0 o -1.
+int shm_attach(conn_t *c, const char *arg) {
+    uint64_t size = strtoull(arg, NULL, 10);
+    int memfd = c->pass_fd[0], efd = c->pass_fd[1];
+    if (c->ring || memfd < 0 || efd < 0 || size < SHM_RING_MIN ||
+        size > SHM_RING_MAX || (size & (size - 1)))
+        return -1;
 
-// Variable global que indica si el programa debe seguir corriendo.
-// Se marca como volatile y de tipo sig_atomic_t para que sea segura
-// al modificarla desde un manejador de señal.
-volatile sig_atomic_t keep_running = 1;
+    struct stat st;
+    size_t map_len = sizeof(shm_ring_t) + size;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (fstat(memfd, &st) != 0 || (size_t)st.st_size < map_len ||
+        seals < 0 || !(seals & F_SEAL_SHRINK))
+        return -1;
+    void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED) return -1;
 
-// Estructura que almacena la información de un host (una IP).
-typedef struct {
-    char ip[32];                 // IP en formato texto (ej: "192.168.0.10")
-    float cpu_usage;             // Porcentaje de uso total de CPU
-    float cpu_user;              // Porcentaje de tiempo de CPU en modo usuario
-    float cpu_sys;               // Porcentaje de tiempo de CPU en modo sistema
-    float cpu_idle;              // Porcentaje de tiempo de CPU inactiva
-    float mem_used;              // Memoria usada (en MB)
-    float mem_free;              // Memoria libre (en MB)
-    float swap_t;                // Swap total (en MB)
-    float swap_f;                // Swap libre (en MB)
-    int has_cpu;                 // Bandera: 1 si ya hay datos de CPU válidos
-    int has_mem;                 // Bandera: 1 si ya hay datos de memoria válidos
-} host_info_t;
+    close(memfd);                // El mapeo se mantiene sin el fd
+    c->pass_fd[0] = c->pass_fd[1] = -1;
+    c->ring = p;
+    c->ring_size = size;
+    c->ring_map_len = map_len;
+    c->shm_efd = efd;
+    return 0;
+}
+
+// Worker al que va una línea de datos ("[@ts;]TIPO;nombre;..."), o -1 si
+// no trae nombre ni hay host enlazado con HELLO.
+int line_worker(conn_t *c, const char *line) {
+    if (line[0] == '@') {
+        line = strchr(line, ';');
+        if (!line) return -1;
+        line++;
+    }
+    const char *name = strchr(line, ';');
+    if (!name) return -1;
+    name++;
+    size_t n = strcspn(name, ";");
+    if (n > NAME_MAX_LEN) return -1;         // Nombre demasiado largo
+    if (n > 0) return host_worker(name, n);
+    return c && c->bound[0] ? c->bound_w : -1;
+}
 
-// Tabla global que guarda la información de hasta MAX_HOSTS máquinas.
-host_info_t hosts[MAX_HOSTS];
+// Despacha una línea completa (terminada en '\0') según su tipo. Las líneas
+// de datos se añaden a las tandas de 'pend' para su worker; los comandos se
+// contestan aquí mismo (con los datos que los workers ya aplicaron).
+// 'c' es NULL si la línea llegó por UDP (no hay a quién responder).
+void handle_line(conn_t *c, batch_t **pend, char *line) {
+    // Consulta reenviada por otro nodo del cluster: se contesta aquí.
+    int local = 0;
+    if (c && strncmp(line, "LOCAL ", 6) == 0) {
+        local = 1;
+        line += 6;
+    }
 
-// Mutex global para proteger el acceso concurrente a la tabla 'hosts'.
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    // Tipo de la línea (tras el prefijo opcional "@<epoch_ms>;").
+    const char *type = line;
+    if (type[0] == '@' && (type = strchr(type, ';')) != NULL)
+        type++;
 
-/**************** SIGNAL HANDLER ****************/
-// Función que se ejecuta cuando llega una señal SIGINT (por ejemplo, Ctrl+C).
-void handle_sigint(int sig) {
-    (void)sig;        // Evita el warning por parámetro sin usar
-    keep_running = 0; // Cambia la variable global para indicar que debemos terminar
+    if (type && (strncmp(type, "CPU;", 4) == 0 || strncmp(type, "MEM;", 4) == 0 ||
+                 strncmp(type, "PROC;", 5) == 0 || strncmp(type, "HB;", 3) == 0)) {
+        int w = line_worker(c, line);
+        if (w < 0) {
+            stat_add(ST_MSG_BAD, 1);
+            return;
+        }
+        batch_line(pend, w, c && w == c->bound_w ? c->bound : "", line, strlen(line),
+                   c != NULL);        // Por UDP no se espera: se descarta
+    }
+    // Identificación de la conexión (sólo TCP: UDP no tiene sesión).
+    else if (c && strncmp(line, "HELLO;", 6) == 0) {
+        if (handle_hello(c, pend, line) < 0) stat_add(ST_MSG_BAD, 1);
+    }
+    // Anillo en memoria compartida de un agente local.
+    else if (c && c->is_unix && strncmp(line, "SHM;", 4) == 0) {
+        if (shm_attach(c, line + 4) < 0) stat_add(ST_MSG_BAD, 1);
+    }
+    // Comandos de consulta: métricas internas e historial de un host.
+    else if (c && strcmp(line, "STATS") == 0) {
+        send_stats(c);
+        stat_add(ST_MSG_CMD, 1);
+    }
+    else if (c && strncmp(line, "HISTORY ", 8) == 0) {
+        if (local || !cluster_forward(c, line, line + 8))
+            send_history(c, line + 8);
+        stat_add(ST_MSG_CMD, 1);
+    }
+    else if (c && strncmp(line, "TOP ", 4) == 0) {
+        if (local || !cluster_forward(c, line, line + 4))
+            send_top(c, line + 4);
+        stat_add(ST_MSG_CMD, 1);
+    }
+    else if (c && strcmp(line, "HOSTS") == 0) {
+        send_hosts(c, local);
+        stat_add(ST_MSG_CMD, 1);
+    }
+    else {
+        stat_add(ST_MSG_BAD, 1);
+    }
 }
 
-/********* FIND OR CREATE HOST ENTRY *********/
-// Busca una entrada de host por IP, y si no existe, crea una nueva
-// en el primer espacio libre de la tabla.
-host_info_t *get_host(const char *ip) {
-    // Primer bucle: buscamos si la IP ya existe en la tabla
-    for (int i = 0; i < MAX_HOSTS; i++) {
-        // Si la IP de esa posición coincide con la IP buscada
-        if (strcmp(hosts[i].ip, ip) == 0)
-            return &hosts[i]; // Devolvemos un puntero a esa entrada
-    }
-    // Segundo bucle: si no estaba, buscamos una entrada vacía (ip == "")
-    for (int i = 0; i < MAX_HOSTS; i++) {
-        // Si el primer carácter es '\0', significa que está libre
-        if (hosts[i].ip[0] == '\0') {
-            // Copiamos la IP en la estructura (con límite de tamaño)
-            strncpy(hosts[i].ip, ip, sizeof(hosts[i].ip));
-            // IMPORTANTE: al ser global, el resto de campos estaban en 0 por defecto
-            return &hosts[i]; // Devolvemos la nueva entrada
-        }
-    }
-    // Si llegamos aquí, no había espacio (tabla llena)
-    return NULL;
+/*********** THREAD: HANDLE CLIENT ***********/
+// Procesa las líneas publicadas en el anillo de 'c'. Cada línea se copia
+// a un buffer propio antes de parsearla: el agente puede seguir
+// escribiendo en la memoria compartida. Devuelve cuántas líneas leyó o -1
+// si el anillo es incoherente (más datos que tamaño, línea sin '\n').
+int shm_drain(conn_t *c) {
+    shm_ring_t *r = c->ring;
+    uint64_t size = c->ring_size, mask = size - 1;
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (tail - head > size) return -1;
+
+    uint64_t start = head, t0 = now_ns();
+    int lines = 0;
+    char line[MAX_LINE];
+    while (head != tail) {
+        // La línea puede dar la vuelta al final del anillo: dos tramos.
+        uint64_t avail = tail - head;
+        size_t n = 0;
+        int found = 0;
+        while (n < avail && n < MAX_LINE) {
+            size_t off = (head + n) & mask;
+            size_t chunk = size - off;
+            if (chunk > avail - n) chunk = avail - n;
+            if (chunk > MAX_LINE - n) chunk = MAX_LINE - n;
+            char *nl = memchr(r->data + off, '\n', chunk);
+            size_t take = nl ? (size_t)(nl - (r->data + off)) : chunk;
+            memcpy(line + n, r->data + off, take);
+            n += take;
+            if (nl) { found = 1; break; }
+        }
+        if (!found || n == MAX_LINE) return -1;   // El agente sólo publica líneas enteras
+        line[n] = '\0';
+        handle_line(c, c->pend, line);
+        head += n + 1;
+        // Liberamos espacio de a tandas, sin esperar a vaciar el anillo
+        if (++lines % 64 == 0)
+            atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    atomic_store_explicit(&r->head, head, memory_order_release);
+    batch_flush(c->pend, 1);
+    stat_add(ST_BYTES_RX, head - start);
+    stat_add(ST_SHM_LINES, lines);
+    if (lines > 0) stat_record(H_IO, now_ns() - t0);
+    return lines;
 }
 
-/************* PARSE CPU MESSAGE *************/
-// Función que parsea un mensaje de tipo CPU y actualiza la tabla de hosts.
-// Formato esperado: "CPU;ip;usage;user;sys;idle"
-void parse_cpu(char *msg) {
-    // Primer token: "CPU" (no lo usamos directamente)
-    char *tok = strtok(msg, ";");
-    // Segundo token: IP
-    tok = strtok(NULL, ";");
-    if (!tok) return;    // Si no hay token, el mensaje está mal formado
-    char *ip = tok;      // Guardamos el puntero a la cadena IP
-
-    // Tercer token: uso total de CPU
-    tok = strtok(NULL, ";");
-    if (!tok) return;
-    float usage = atof(tok); // Convertimos a float (porcentaje)
-
-    // Cuarto, quinto y sexto token: user, sys, idle
-    float user = atof(strtok(NULL, ";")); // Porcentaje CPU modo usuario
-    float sys  = atof(strtok(NULL, ";")); // Porcentaje CPU modo sistema
-    float idle = atof(strtok(NULL, ";")); // Porcentaje CPU inactiva
-
-    // Proteger la tabla global con el mutex mientras actualizamos datos
-    pthread_mutex_lock(&lock);
-    host_info_t *h = get_host(ip); // Obtenemos (o creamos) la entrada de ese host
-    if (h) {
-        // Actualizamos los campos de CPU
-        h->cpu_usage = usage;
-        h->cpu_user  = user;
-        h->cpu_sys   = sys;
-        h->cpu_idle  = idle;
-        h->has_cpu   = 1; // Marcamos que ya tenemos datos de CPU válidos
+// Espera (con anillo) a que haya algo en el anillo o en el socket y procesa
+// el anillo. Devuelve 1 si además hay que leer del socket, 0 si no, o -1 si
+// el anillo es incoherente.
+int shm_poll(conn_t *c) {
+    shm_ring_t *r = c->ring;
+    // Antes de dormir avisamos (waiting) y volvemos a mirar 'tail': o el
+    // agente ve el aviso y escribe en el eventfd, o vemos su línea.
+    int empty = atomic_load(&r->tail) == atomic_load(&r->head);
+    if (empty) {
+        atomic_store(&r->waiting, 1);
+        empty = atomic_load(&r->tail) == atomic_load(&r->head);
+    }
+    struct pollfd pfd[2] = { { c->fd, POLLIN, 0 }, { c->shm_efd, POLLIN, 0 } };
+    if (poll(pfd, 2, empty ? -1 : 0) < 0 && errno != EINTR)
+        return -1;
+    atomic_store(&r->waiting, 0);
+    if (pfd[1].revents & POLLIN) {
+        uint64_t v;
+        if (read(c->shm_efd, &v, sizeof(v)) == sizeof(v))
+            stat_add(ST_SHM_WAKEUPS, 1);
     }
-    pthread_mutex_unlock(&lock); // Liberamos el mutex
+
+    int n = shm_drain(c);
+    if (n < 0) return -1;
+    if (n > 0)
+        atomic_store_explicit(&c->last_tick, tw_ticks(now_mono()), memory_order_relaxed);
+    return pfd[0].revents != 0;
 }
 
-/************* PARSE MEM MESSAGE *************/
-// Función que parsea un mensaje de tipo MEM y actualiza la tabla de hosts.
-// Formato esperado: "MEM;ip;used;free;swapT;swapF"
-void parse_mem(char *msg) {
-    // Primer token: "MEM"
-    char *tok = strtok(msg, ";");
-    // Segundo token: IP
-    tok = strtok(NULL, ";");
-    if (!tok) return;   // Si no existe, mensaje inválido
-    char *ip = tok;     // Guardamos IP
+// recv del socket de la conexión. Por el socket Unix se usa recvmsg para
+// recoger los descriptores que mande el agente (memfd y eventfd del anillo).
+ssize_t conn_recv(conn_t *c, char *buf, size_t size) {
+    if (!c->is_unix)
+        return recv(c->fd, buf, size, 0);
 
-    // Siguientes tokens: used, free, swapTotal, swapFree
-    float used = atof(strtok(NULL, ";")); // Memoria usada
-    float free = atof(strtok(NULL, ";")); // Memoria libre
-    float swt  = atof(strtok(NULL, ";")); // Swap total
-    float swf  = atof(strtok(NULL, ";")); // Swap libre
-
-    // Sección crítica para actualizar la tabla global
-    pthread_mutex_lock(&lock);
-    host_info_t *h = get_host(ip); // Buscamos/creamos entrada de host
-    if (h) {
-        // Actualizamos los campos de memoria
-        h->mem_used = used;
-        h->mem_free = free;
-        h->swap_t   = swt;
-        h->swap_f   = swf;
-        h->has_mem  = 1; // Marcamos que ya tenemos datos de memoria válidos
+    union {
+        struct cmsghdr h;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { buf, size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int nfd = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *)CMSG_DATA(cm);
+        for (int i = 0; i < nfd; i++) {
+            // Sólo se acepta un par; lo demás se cierra
+            if (i < 2 && c->pass_fd[i] < 0 && !c->ring) c->pass_fd[i] = fds[i];
+            else close(fds[i]);
+        }
     }
-    pthread_mutex_unlock(&lock); // Liberamos el mutex
+    return n;
 }
 
-/*********** THREAD: HANDLE CLIENT ***********/
 // Función que se ejecuta en un hilo por cada cliente conectado.
 // Se encarga de recibir datos por el socket y procesar líneas CPU/MEM.
 void *client_thread(void *arg) {
-    // arg es un puntero a int que contiene el descriptor de socket del cliente.
-    int fd = *(int *)arg;
-    // Liberamos la memoria que se reservó en main para este descriptor.
-    free(arg);
-
-    // Buffer temporal para almacenar los datos que llegan por el socket.
-    char buf[MAX_LINE];
+    // arg es la conexión que reservó main para este cliente.
+    conn_t *c = arg;
+    int reason = CLOSE_SHUTDOWN;
+    steer_conn(c->fd);
 
     // Bucle principal del hilo mientras el servidor siga activo.
     while (keep_running) {
-        // recv lee datos del socket 'fd' y los guarda en 'buf'.
+        // Con anillo compartido esperamos a él o al socket.
+        if (c->ring) {
+            int rc = shm_poll(c);
+            if (rc < 0) {
+                reason = CLOSE_ERROR;
+                break;
+            }
+            if (rc == 0) continue;
+        }
+
+        // recv añade los datos nuevos detrás de la línea incompleta anterior.
         // Devuelve el número de bytes leídos, o <= 0 si hay error o se cierra.
-        ssize_t n = recv(fd, buf, sizeof(buf)-1, 0);
-        if (n <= 0)
-            break; // Si n <= 0, rompemos el bucle (cliente cerró o error)
+        ssize_t n = conn_recv(c, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+        if (n <= 0) {
+            reason = (n == 0) ? CLOSE_PEER : CLOSE_ERROR;
+            break; // Cliente cerró, error, o el temporizador hizo shutdown
+        }
+        c->len += n;
+        stat_add(ST_BYTES_RX, n);
 
-        // Añadimos terminador de cadena para poder tratar 'buf' como string.
-        buf[n] = '\0';
+        // Repartimos todas las líneas completas que haya en el buffer.
+        // Cada línea se termina con '\0' en su sitio (la tanda la copia).
+        uint64_t t0 = now_ns();
+        char *start = c->buf;
+        char *end = c->buf + c->len;
+        char *nl;
+        int got_line = 0;
+        // (Tras un REDIRECT no se procesa nada más de esta conexión.)
+        while (atomic_load(&c->reason) < 0 &&
+               (nl = memchr(start, '\n', end - start)) != NULL) {
+            *nl = '\0';
+            handle_line(c, c->pend, start);
+            start = nl + 1;
+            got_line = 1;
+        }
+        batch_flush(c->pend, 1); // Nada se queda esperando al próximo recv
+        stat_record(H_IO, now_ns() - t0);
 
-        // Un mismo recv puede traer varias líneas separadas por '\n'.
-        // Usamos strtok para procesar cada línea individualmente.
-        char *line = strtok(buf, "\n");
-        while (line) {
-            // Hacemos una copia de la línea porque dentro de parse_cpu/parse_mem
-            // también se usa strtok, que modifica la cadena.
-            char copy[MAX_LINE];
-            strncpy(copy, line, sizeof(copy));
-            // Nos aseguramos de que copy quede terminada en '\0'
-            copy[sizeof(copy) - 1] = '\0';
+        // Sólo una línea completa cuenta como actividad.
+        if (got_line)
+            atomic_store_explicit(&c->last_tick, tw_ticks(now_mono()),
+                                  memory_order_relaxed);
 
-            // Si la línea empieza por "CPU;", la tratamos como mensaje de CPU.
-            if (strncmp(copy, "CPU;", 4) == 0)
-                parse_cpu(copy);
-            // Si empieza por "MEM;", la tratamos como mensaje de memoria.
-            else if (strncmp(copy, "MEM;", 4) == 0)
-                parse_mem(copy);
+        // Movemos al principio el trozo de línea que quedó incompleto.
+        c->len = end - start;
+        memmove(c->buf, start, c->len);
 
-            // Pasamos a la siguiente línea dentro del mismo buffer.
-            line = strtok(NULL, "\n");
+        // Si el buffer está lleno y no hay '\n', la línea es demasiado larga.
+        if (c->len == sizeof(c->buf) - 1) {
+            reason = CLOSE_LONG_LINE;
+            break;
         }
     }
 
-    // Al salir del bucle, cerramos el socket del cliente.
-    close(fd);
+    // La entrada del host enlazado ya se puede liberar por TTL (se lo
+    // decimos a su worker detrás de las últimas líneas de la conexión).
+    if (c->bound[0]) {
+        char unpin[NAME_MAX_LEN + 8];
+        int len = snprintf(unpin, sizeof(unpin), "UNPIN;%s", c->bound);
+        batch_line(c->pend, c->bound_w, c->bound, unpin, len, 1);
+    }
+    batch_flush(c->pend, 1);
+    batch_free(c->pend);
+
+    // Quitamos el temporizador y registramos el motivo del cierre. Si fue
+    // el temporizador quien cerró, su motivo tiene prioridad.
+    pthread_mutex_lock(&conn_lock);
+    tw_cancel(&c->timer);
+    int timer_reason = atomic_load(&c->reason);
+    if (timer_reason >= 0)
+        reason = timer_reason;
+    close_counts[reason]++;
+    active_conns--;
+    conn_unregister(c);
+    pthread_mutex_unlock(&conn_lock);
+
+    // Al salir del bucle, cerramos el socket del cliente (y el anillo).
+    if (c->ring) {
+        munmap(c->ring, c->ring_map_len);
+        close(c->shm_efd);
+    }
+    for (int i = 0; i < 2; i++)
+        if (c->pass_fd[i] >= 0) close(c->pass_fd[i]);
+    close(c->fd);
+    pthread_mutex_destroy(&c->wlock);
+    free(c);
+    mem_release(conn_cost());
     // Terminamos el hilo.
     return NULL;
 }
 
+// Pone en marcha una conexión recién aceptada: admisión, plazo de
+// inactividad, registro y su hilo. La conexión ya tiene fd (y is_unix).
+// Si supera el límite de conexiones o no cabe en el presupuesto de memoria
+// se cierra enseguida (el agente reintenta con su espera creciente).
+void conn_start(conn_t *conn) {
+    stat_add(ST_ACCEPTS, 1);
+
+    // Armamos el plazo de inactividad antes de arrancar el hilo.
+    conn->reason = -1;
+    conn->pass_fd[0] = conn->pass_fd[1] = -1;
+    conn->last_tick = tw_ticks(now_mono());
+    conn->timer.cb = conn_timer_cb;
+    conn->timer.arg = conn;
+    pthread_mutex_init(&conn->wlock, NULL);
+    pthread_mutex_lock(&conn_lock);
+    int admit = active_conns < max_conns && mem_reserve(conn_cost()) == 0;
+    if (admit) {
+        tw_schedule(&conn_wheel, &conn->timer, conn->last_tick + tw_ticks(idle_timeout));
+        conn_register(conn);
+        active_conns++;
+    }
+    pthread_mutex_unlock(&conn_lock);
+
+    // Creamos un hilo nuevo, con pila pequeña, para manejar a este cliente.
+    pthread_t th;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONN_STACK);
+    // Detached para que el hilo se limpie solo al terminar, sin join.
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int started = admit && pthread_create(&th, &attr, client_thread, conn) == 0;
+    pthread_attr_destroy(&attr);
+    if (started) return;
+
+    if (admit) {
+        // No se pudo crear el hilo: deshacemos el registro.
+        pthread_mutex_lock(&conn_lock);
+        tw_cancel(&conn->timer);
+        conn_unregister(conn);
+        active_conns--;
+        pthread_mutex_unlock(&conn_lock);
+        mem_release(conn_cost());
+    }
+    stat_add(ST_CONN_REFUSED, 1);
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->wlock);
+    free(conn);
+}
+
+/*********** THREAD: UNIX ***********/
+// Agentes en la misma máquina (-L <ruta>): un socket Unix de tipo stream
+// se comporta igual que una conexión TCP (HELLO, CTL, comandos) sin pasar
+// por la pila de red, y además permite el anillo en memoria compartida.
+
+// Crea el socket Unix en 'path' (borrando uno anterior). Devuelve el fd o -1.
+int open_unix(const char *path) {
+    struct sockaddr_un sa;
+    if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) return -1;
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(lfd, 64) != 0) {
+        close(lfd);
+        return -1;
+    }
+    return lfd;
+}
+
+void *unix_thread(void *arg) {
+    int lfd = *(int *)arg;
+    while (keep_running) {
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if (!conn) { sleep(1); continue; }
+        conn->fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn->fd < 0) { free(conn); continue; }
+        conn->is_unix = 1;
+        conn_start(conn);
+    }
+    return NULL;
+}
+
+/*********** THREAD: UDP ***********/
+// Ingesta sin estado de conexión. Cada datagrama lleva una o más líneas
+// completas (la última puede no llevar '\n'). recvmmsg recoge hasta
+// UDP_BATCH datagramas en una sola llamada al sistema: con MSG_WAITFORONE
+// espera al primero y se lleva además los que ya estén en cola, así que con
+// poca carga no añade latencia y con mucha amortiza la llamada.
+
+#define UDP_BATCH     64
+#define UDP_DGRAM_MAX 2048   // Mayor que MAX_LINE: una línea cabe siempre
+
+void *udp_thread(void *arg) {
+    int ufd = *(int *)arg;
+    // Buffers fijos del hilo (~130 KB): fuera de la pila
+    static struct mmsghdr msgs[UDP_BATCH];
+    static struct iovec iov[UDP_BATCH];
+    static char bufs[UDP_BATCH][UDP_DGRAM_MAX];
+    batch_t *pend[WORKERS_MAX] = { NULL };   // Tandas en curso por worker
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = UDP_DGRAM_MAX - 1;   // Hueco para el '\0' final
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (keep_running) {
+        // SO_RCVTIMEO hace que vuelva cada segundo para mirar keep_running.
+        int n = recvmmsg(ufd, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("recvmmsg");
+                break;
+            }
+            continue;
+        }
+        stat_add(ST_UDP_BATCHES, 1);
+        stat_add(ST_UDP_DGRAMS, n);
+        uint64_t t0 = now_ns();
+
+        for (int i = 0; i < n; i++) {
+            size_t len = msgs[i].msg_len;
+            stat_add(ST_BYTES_RX, len);
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                stat_add(ST_MSG_BAD, 1);   // No cabía: se descarta entero
+                continue;
+            }
+            char *start = bufs[i];
+            char *end = start + len;
+            *end = '\0';
+            while (start < end) {
+                char *nl = memchr(start, '\n', end - start);
+                if (nl) *nl = '\0';
+                if (*start) handle_line(NULL, pend, start);
+                start = nl ? nl + 1 : end;
+            }
+        }
+        batch_flush(pend, 0);
+        stat_record(H_IO, now_ns() - t0);
+    }
+    return NULL;
+}
+
+// Abre el socket UDP en el mismo puerto que el de escucha TCP.
+// Devuelve el descriptor o -1.
+int open_udp(const char *port) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0)
+        return -1;
+
+    int ufd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (ufd >= 0) {
+        // Cola de recepción amplia para absorber ráfagas de muchos agentes.
+        int rcvbuf = 4 * 1024 * 1024;
+        setsockopt(ufd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        struct timeval tv = { 1, 0 };
+        setsockopt(ufd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (bind(ufd, res->ai_addr, res->ai_addrlen) != 0) {
+            close(ufd);
+            ufd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return ufd;
+}
+
+/*********** THREAD: RELAY ***********/
+// Con -U el collector hace además de agente de un collector padre: cada
+// intervalo de envío (-I) recorre la tabla y, por cada host que recibió
+// algo desde la vuelta anterior, escribe una sola línea por tipo:
+//   CPU y MEM  la media de las muestras recibidas (vector por núcleo: el último)
+//   PROC       las últimas listas
+//   HB         si sólo llegaron heartbeats (con su intervalo)
+// Todas llevan "@<ts>;" con el instante de la muestra más reciente y el
+// nombre del host, y salen en un solo envío por una conexión TCP
+// persistente. El padre las trata como las de cualquier agente, así que se
+// pueden encadenar relays. Si el padre no está, la tanda se descarta (la
+// siguiente lleva los valores al día) y se reconecta en la vuelta siguiente.
+
+// Tope de lo que escribe relay_host_lines para un host: floats de hasta 40
+// caracteres, el vector de núcleos, dos listas de PROC_TOP_MAX procesos y
+// el nombre en cada una de sus cuatro líneas.
+#define RELAY_HOST_MAX (2 * MAX_CORES + 4096 + 4 * NAME_MAX_LEN)
+
+// Acumulados de un host en la vuelta anterior del relay.
+typedef struct {
+    name_id_t id;
+    uint32_t n_cpu, n_mem, n_procs, n_hb;
+    double cpu[6], mem[4];
+} relay_prev_t;
+
+// Escribe en buf (al menos RELAY_HOST_MAX bytes) las líneas de lo que llegó
+// a 'h' (una copia de la tabla) desde la vuelta anterior, 'p', y guarda
+// en 'p' los acumulados actuales. Devuelve los bytes escritos y suma a
+// *lines las líneas.
+size_t relay_host_lines(const host_info_t *h, relay_prev_t *p, char *buf, int *lines) {
+    // Entrada nueva o reutilizada por otro host: se empieza de cero.
+    if (p->id != h->id || h->relay_n_cpu < p->n_cpu ||
+        h->relay_n_mem < p->n_mem || h->relay_n_procs < p->n_procs ||
+        h->relay_n_hb < p->n_hb) {
+        memset(p, 0, sizeof(*p));
+        p->id = h->id;
+    }
+    uint32_t n_cpu = h->relay_n_cpu - p->n_cpu, n_mem = h->relay_n_mem - p->n_mem;
+
+    size_t len = 0;
+    if (n_cpu > 0) {
+        double a[6];
+        for (int i = 0; i < 6; i++) a[i] = (h->relay_cpu[i] - p->cpu[i]) / n_cpu;
+        len += sprintf(buf + len, "@%lld;CPU;%s;%.2f;%.2f;%.2f;%.2f;%.2f;%.2f;%d;",
+                       (long long)h->cpu_ts, name_of(h->id), a[0], a[1], a[2],
+                       a[3], a[4], a[5], h->ncores);
+        for (int i = 0; i < h->ncores; i++)
+            len += sprintf(buf + len, "%02x", h->core_pct[i]);
+        buf[len++] = '\n';
+        (*lines)++;
+    }
+    if (n_mem > 0) {
+        double a[4];
+        for (int i = 0; i < 4; i++) a[i] = (h->relay_mem[i] - p->mem[i]) / n_mem;
+        len += sprintf(buf + len, "@%lld;MEM;%s;%.2f;%.2f;%.2f;%.2f\n",
+                       (long long)h->mem_ts, name_of(h->id), a[0], a[1], a[2], a[3]);
+        (*lines)++;
+    }
+    if (h->relay_n_procs != p->n_procs) {
+        len += sprintf(buf + len, "@%lld;PROC;%s;%d;",
+                       (long long)h->procs_ts, name_of(h->id), h->nprocs);
+        for (int l = 0; l < 2; l++) {
+            const proc_entry_t *top = l == 0 ? h->top_cpu : h->top_rss;
+            int n = l == 0 ? h->n_top_cpu : h->n_top_rss;
+            for (int i = 0; i < n; i++)
+                len += sprintf(buf + len, "%s%d:%s:%.1f:%.1f", i ? "," : "",
+                               top[i].pid, top[i].comm, top[i].cpu, top[i].rss_mb);
+            buf[len++] = l == 0 ? ';' : '\n';
+        }
+        (*lines)++;
+    }
+    if (h->relay_n_hb != p->n_hb && n_cpu == 0 && n_mem == 0) {
+        // Intervalo de heartbeat del agente, pero nunca menor que el
+        // nuestro: el padre recibe a lo sumo una tanda por intervalo.
+        int64_t ts = h->cpu_ts > h->mem_ts ? h->cpu_ts : h->mem_ts;
+        int hb = (int)(h->hb_interval * 1000), every = (int)(expected_interval * 1000);
+        len += sprintf(buf + len, "@%lld;HB;%s;%d\n",
+                       (long long)ts, name_of(h->id), hb > every ? hb : every);
+        (*lines)++;
+    }
+    p->n_cpu = h->relay_n_cpu;
+    p->n_mem = h->relay_n_mem;
+    p->n_procs = h->relay_n_procs;
+    p->n_hb = h->relay_n_hb;
+    memcpy(p->cpu, h->relay_cpu, sizeof(p->cpu));
+    memcpy(p->mem, h->relay_mem, sizeof(p->mem));
+    return len;
+}
+
+// Abre la conexión con el collector padre. Devuelve el fd o -1.
+int relay_connect(void) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(relay_host, relay_port, &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *a = res; a; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) continue;
+        // En Linux SO_SNDTIMEO también acota el connect
+        struct timeval tv = { (time_t)expected_interval, 0 };
+        if (tv.tv_sec < 1) tv.tv_sec = 1;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+_Atomic int relay_up = 0;   // 1 si la conexión con el padre está abierta
+
+// Memoria del hilo relay (tanda y acumulados anteriores de cada host).
+size_t relay_mem(void) {
+    return relay_host ? (size_t)table_size * (RELAY_HOST_MAX + sizeof(relay_prev_t)) : 0;
+}
+
+void *relay_thread(void *arg) {
+    (void)arg;
+    char *buf = malloc((size_t)table_size * RELAY_HOST_MAX);
+    relay_prev_t *prev = calloc(table_size, sizeof(relay_prev_t));
+    static host_info_t snap;
+    if (!buf || !prev) {
+        perror("relay");
+        free(buf);
+        free(prev);
+        return NULL;
+    }
+    int fd = -1;
+    double next = now_mono() + expected_interval;
+
+    while (keep_running) {
+        double wait = next - now_mono();
+        if (wait > 0) {
+            struct timespec ts = { (time_t)wait, (long)((wait - (time_t)wait) * 1e9) };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        next += expected_interval;
+
+        // Se recorre la tabla en vivo (prev va por entrada), dentro de una
+        // ranura de lector para que los ids leídos no se reutilicen.
+        size_t len = 0;
+        int lines = 0;
+        int slot;
+        snap_get(&slot);
+        for (int i = 0; i < table_size; i++)
+            if (host_read(i, &snap) == 0)
+                len += relay_host_lines(&snap, &prev[i], buf + len, &lines);
+        snap_put(slot);
+        if (len == 0) continue;
+
+        if (fd < 0 && (fd = relay_connect()) >= 0) {
+            fprintf(stderr, "Relay: conectado a %s:%s\n", relay_host, relay_port);
+            atomic_store(&relay_up, 1);
+        }
+        if (fd >= 0 && send_all(fd, buf, len) == 0) {
+            stat_add(ST_RELAY_LINES, lines);
+            stat_add(ST_RELAY_BATCHES, 1);
+        } else {
+            stat_add(ST_RELAY_FAILS, 1);
+            if (fd >= 0) {
+                fprintf(stderr, "Relay: se perdió la conexión con %s:%s\n",
+                        relay_host, relay_port);
+                close(fd);
+                fd = -1;
+                atomic_store(&relay_up, 0);
+            }
+        }
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    free(prev);
+    return NULL;
+}
+
+/*********** CONTROL DE INGESTA ***********/
+// Si el collector no da abasto, los bytes se acumulan en las colas de los
+// workers y en los buffers de recepción de los sockets. Una vez por segundo
+// sumamos esas colas (worker_queued y FIONREAD) y las dividimos por el
+// ritmo al que realmente consumimos bytes: eso es el atraso en
+// milisegundos. Según el atraso elegimos un nivel de degradación
+// y se lo comunicamos a cada agente identificado con una línea
+//   CTL;interval=<ms>;batch=<n>;pause=<fuente,...>
+// El nivel sube en cuanto se cruza un umbral y baja de a uno tras
+// CTL_CALM_S segundos seguidos con el atraso por debajo de CTL_CALM_MS.
+
+#define CTL_CALM_MS 100
+#define CTL_CALM_S  5
+#define CTL_LAG_MAX 60000   // Tope del atraso cuando no entra nada
+
+typedef struct {
+    long lag_ms;            // Atraso a partir del cual se aplica
+    int interval_mult;      // Multiplicador del periodo anunciado en HELLO
+    int batch;              // Ticks que el agente junta en un solo envío
+    const char *pause;      // Fuentes no críticas que el agente deja de muestrear
+} ctl_level_t;
+
+static const ctl_level_t ctl_levels[] = {
+    {    0, 1, 1, ""      },
+    {  500, 1, 4, "procs" },
+    { 2000, 2, 4, "procs" },
+    { 5000, 4, 8, "procs" },
+};
+#define CTL_LEVELS ((int)(sizeof(ctl_levels) / sizeof(ctl_levels[0])))
+
+// Envía el nivel vigente a los agentes que aún no lo tienen. Se llama con
+// conn_lock tomado: no puede bloquear, así que si otro hilo está
+// escribiendo en la conexión o el socket está lleno, se reintenta en la
+// siguiente vuelta.
+static void ctl_broadcast(int level) {
+    const ctl_level_t *l = &ctl_levels[level];
+    for (conn_t *c = conn_list; c; c = c->next) {
+        if (!c->bound[0] || c->ctl_level == level) continue;
+        char line[128];
+        int len = snprintf(line, sizeof(line), "CTL");
+        if (c->period_ms > 0)
+            len += snprintf(line + len, sizeof(line) - len, ";interval=%ld",
+                            c->period_ms * l->interval_mult);
+        len += snprintf(line + len, sizeof(line) - len, ";batch=%d;pause=%s\n",
+                        l->batch, l->pause);
+        if (pthread_mutex_trylock(&c->wlock) != 0) continue;
+        ssize_t n = send(c->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        pthread_mutex_unlock(&c->wlock);
+        if (n == len) {
+            c->ctl_level = level;
+            stat_add(ST_CTL_SENT, 1);
+        }
+    }
+}
+
+// Mide el atraso y ajusta el nivel. Llamada una vez por segundo.
+void ingest_control(void) {
+    static stat_totals_t t;
+    static uint64_t prev_bytes;
+    static double prev_t;
+    static int calm;
+
+    stats_collect(&t);
+    double now = now_mono();
+    double dt = now - prev_t;
+    double rate = prev_t > 0 && dt > 0 ? (t.counters[ST_BYTES_RX] - prev_bytes) / dt : 0;
+    prev_bytes = t.counters[ST_BYTES_RX];
+    prev_t = now;
+
+    // Lo que espera en las colas de los workers también es atraso.
+    long backlog = 0;
+    for (int w = 0; w < n_workers; w++)
+        backlog += (long)worker_queued(workers[w]);
+
+    pthread_mutex_lock(&conn_lock);
+    for (conn_t *c = conn_list; c; c = c->next) {
+        int n;
+        if (ioctl(c->fd, FIONREAD, &n) == 0) backlog += n;
+    }
+
+    long lag = 0;
+    if (backlog > 0)
+        lag = rate > 0 ? (long)(backlog * 1000.0 / rate) : CTL_LAG_MAX;
+    if (lag > CTL_LAG_MAX) lag = CTL_LAG_MAX;
+
+    int level = atomic_load(&ctl_level);
+    int want = 0;
+    for (int i = CTL_LEVELS - 1; i > 0; i--)
+        if (lag >= ctl_levels[i].lag_ms) { want = i; break; }
+    if (want > level) {
+        level = want;
+        calm = 0;
+    } else if (lag < CTL_CALM_MS && level > 0) {
+        if (++calm >= CTL_CALM_S) {
+            level--;
+            calm = 0;
+        }
+    } else {
+        calm = 0;
+    }
+    atomic_store(&ingest_lag_ms, lag);
+    atomic_store(&ctl_level, level);
+    ctl_broadcast(level);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+/*********** THREAD: TIMER ***********/
+// Hilo que hace avanzar la rueda de las conexiones cada TW_TICK_MS (las de
+// los hosts las avanza cada worker).
+void *timer_thread(void *arg) {
+    (void)arg;
+    struct timespec tick = { 0, TW_TICK_MS * 1000000L };
+    double next_ctl = now_mono() + 1;
+
+    while (keep_running) {
+        nanosleep(&tick, NULL);
+        uint64_t now = tw_ticks(now_mono());
+        pthread_mutex_lock(&conn_lock);
+        tw_advance(&conn_wheel, now);
+        pthread_mutex_unlock(&conn_lock);
+        if (now_mono() >= next_ctl) {
+            ingest_control();
+            next_ctl += 1;
+        }
+    }
+    return NULL;
+}
+
+/*********** THREAD: SNAPSHOT ***********/
+// Publica una instantánea de la tabla cada SNAP_MS (ver SNAPSHOTS).
+void *snapshot_thread(void *arg) {
+    (void)arg;
+    struct timespec period = { 0, SNAP_MS * 1000000L };
+    while (keep_running) {
+        nanosleep(&period, NULL);
+        snap_publish();
+        if (export_hdr)
+            __atomic_store_n(&export_hdr->heartbeat_ms, now_wall_ms(), __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
 /******** THREAD: VISUALIZER ********/
+// Dibuja en 'out' la tabla de hosts de la instantánea 's' (la parte del
+// dashboard que crece con los hosts; la mide también collector_bench.c).
+void render_table(FILE *out, const snapshot_t *s) {
+    // Imprimimos encabezado de la tabla.
+    fprintf(out, "IP           CPU    usr   sys   idle    wa    st    MemUsed  MemFree  Núcleo máx\n");
+    fprintf(out, "------------------------------------------------------------------------------------\n");
+
+    // Recorremos la instantánea (los workers no esperan).
+    for (int i = 0; i < s->n; i++) {
+        const host_info_t *h = &s->h[i];
+        // Imprimimos la IP alineada a la izquierda en un ancho de 12 caracteres.
+        fprintf(out, "%-12s ", name_of(h->id));
+
+        // Si el host dejó de reportar no mostramos valores congelados.
+        if (h->stale) {
+            fprintf(out, " -- STALE (sin datos hace %.0fs) --\n",
+                    now_mono() - h->last_seen);
+            continue;
+        }
+
+        // Si tenemos datos de CPU, los mostramos.
+        if (h->has_cpu)
+            fprintf(out, "%5.1f %5.1f %5.1f %6.1f %5.1f %5.1f   ",
+                    h->cpu_usage, h->cpu_user, h->cpu_sys, h->cpu_idle,
+                    h->cpu_iowait, h->cpu_steal);
+        else
+            // Si no hay datos de CPU, mostramos "--" para indicar ausencia.
+            fprintf(out, " --    --    --    --     --    --     ");
+
+        // Si tenemos datos de memoria, los mostramos.
+        if (h->has_mem)
+            fprintf(out, "%7.1f %7.1f", h->mem_used, h->mem_free);
+        else
+            // Si no hay datos de memoria, mostramos "--".
+            fprintf(out, "   --       --");
+
+        // Núcleo más cargado; '*' si está saturado mientras la media es
+        // baja (un proceso anclado a un núcleo).
+        if (h->has_cpu && h->ncores > 0) {
+            int hot = h->core_pct[h->core_max_idx];
+            fprintf(out, "  cpu%-3d %3d%%%s", h->core_max_idx, hot,
+                    (hot >= 90 && h->cpu_usage < 50) ? " *" : "");
+        }
+
+        // Fin de la línea para ese host.
+        fprintf(out, "\n");
+
+        // Proceso que más CPU y que más memoria usan (línea PROC).
+        if (h->has_procs && h->n_top_cpu > 0 && h->n_top_rss > 0)
+            fprintf(out, "             top cpu: %s(%d) %.0f%%   top mem: %s(%d) %.0f MB\n",
+                    h->top_cpu[0].comm, h->top_cpu[0].pid, h->top_cpu[0].cpu,
+                    h->top_rss[0].comm, h->top_rss[0].pid, h->top_rss[0].rss_mb);
+    }
+    fprintf(out, "(tabla de hace %.0f ms)\n", (now_mono() - s->taken) * 1000);
+}
+
 // Hilo que se encarga de imprimir periódicamente el estado de todos los hosts.
 void *visualizer_thread(void *arg) {
     (void)arg; // No usamos el argumento, se castea para evitar warning.
 
+    // Totales del refresco anterior, para calcular tasas por segundo.
+    static stat_totals_t prev, cur;
+    double prev_t = now_mono();
+
     // Mientras el servidor siga activo.
     while (keep_running) {
         // Dormimos 2 segundos entre cada refresco de pantalla.
         sleep(2);
-        
+        uint64_t t0 = now_ns();   // Medimos lo que tarda en dibujarse
+
         // Secuencia de escape ANSI para limpiar la pantalla y mover el cursor
         // a la esquina superior izquierda (simula un "pantallazo" tipo top).
         printf("\033[2J\033[H");
-        // Imprimimos encabezado de la tabla.
-        printf("IP           CPU    usr   sys   idle   MemUsed  MemFree\n");
-        printf("----------------------------------------------------------\n");
-
-        // Bloqueamos el mutex mientras recorremos la tabla de hosts.
-        pthread_mutex_lock(&lock);
-        for (int i = 0; i < MAX_HOSTS; i++) {
-            // Si la IP está vacía, significa que esta entrada no se usa.
-            if (hosts[i].ip[0] == '\0') continue;
-
-            host_info_t *h = &hosts[i];
-            // Imprimimos la IP alineada a la izquierda en un ancho de 12 caracteres.
-            printf("%-12s ", h->ip);
-
-            // Si tenemos datos de CPU, los mostramos.
-            if (h->has_cpu)
-                printf("%5.1f %5.1f %5.1f %6.1f   ",
-                       h->cpu_usage, h->cpu_user, h->cpu_sys, h->cpu_idle);
-            else
-                // Si no hay datos de CPU, mostramos "--" para indicar ausencia.
-                printf(" --    --    --    --     ");
+        int slot;
+        render_table(stdout, snap_get(&slot));
+        snap_put(slot);
 
-            // Si tenemos datos de memoria, los mostramos.
-            if (h->has_mem)
-                printf("%7.1f %7.1f", h->mem_used, h->mem_free);
-            else
-                // Si no hay datos de memoria, mostramos "--".
-                printf("   --       --");
+        // Pie: reglas cargadas y alertas disparadas en este momento.
+        if (n_rules > 0)
+            printf("\nReglas: %d   Alertas activas: %d\n", n_rules,
+                   atomic_load(&alerts_firing));
 
-            // Fin de la línea para ese host.
-            printf("\n");
-        }
-        // Liberamos el mutex después de leer toda la tabla.
-        pthread_mutex_unlock(&lock);
+        // Conexiones activas y conexiones cerradas por cada motivo.
+        pthread_mutex_lock(&conn_lock);
+        printf("\nConexiones: %d/%d   Cierres:", active_conns, max_conns);
+        for (int r = 0; r < CLOSE_COUNT; r++)
+            printf(" %s=%lu", close_names[r], close_counts[r]);
+        printf("\n");
+        pthread_mutex_unlock(&conn_lock);
+        printf("Atraso de ingesta: %ld ms   nivel: %d\n",
+               atomic_load(&ingest_lag_ms), atomic_load(&ctl_level));
+        if (relay_host)
+            printf("Relay -> %s:%s %s\n", relay_host, relay_port,
+                   atomic_load(&relay_up) ? "conectado" : "sin conexión");
+
+        // Métricas internas: tasas desde el refresco anterior y percentiles.
+        stats_collect(&cur);
+        double now = now_mono();
+        double dt = now - prev_t;
+        printf("Memoria reservada: %.1f MB", atomic_load(&mem_reserved) / 1048576.0);
+        if (mem_budget)
+            printf(" de %.1f MB", mem_budget / 1048576.0);
+        printf("   rechazos: conexiones=%llu hosts=%llu memoria=%llu udp=%llu\n",
+               (unsigned long long)cur.counters[ST_CONN_REFUSED],
+               (unsigned long long)cur.counters[ST_HOST_REFUSED],
+               (unsigned long long)cur.counters[ST_MEM_REFUSED],
+               (unsigned long long)cur.counters[ST_UDP_SHED]);
+#define RATE(c) ((cur.counters[c] - prev.counters[c]) / dt)
+        printf("msg/s cpu=%.0f mem=%.0f hb=%.0f bad=%.0f   rx=%.1f KB/s   udp/s=%.0f   accept/s=%.1f\n",
+               RATE(ST_MSG_CPU), RATE(ST_MSG_MEM), RATE(ST_MSG_HB), RATE(ST_MSG_BAD),
+               RATE(ST_BYTES_RX) / 1024, RATE(ST_UDP_DGRAMS), RATE(ST_ACCEPTS));
+#undef RATE
+        printf("io p99=%lluns   cola p50=%lluus p99=%lluus   parse p50=%lluns p99=%lluns   render p99=%lluus\n",
+               (unsigned long long)hist_percentile(cur.hist[H_IO], 99),
+               (unsigned long long)hist_percentile(cur.hist[H_QUEUE_WAIT], 50) / 1000,
+               (unsigned long long)hist_percentile(cur.hist[H_QUEUE_WAIT], 99) / 1000,
+               (unsigned long long)hist_percentile(cur.hist[H_PARSE], 50),
+               (unsigned long long)hist_percentile(cur.hist[H_PARSE], 99),
+               (unsigned long long)hist_percentile(cur.hist[H_RENDER], 99) / 1000);
+        printf("Workers: %d   en cola (tandas):", n_workers);
+        for (int w = 0; w < n_workers; w++)
+            printf(" %d", worker_depth(workers[w]));
+        printf("   cpu:");
+        for (int w = 0; w < n_workers; w++)
+            printf(" %d", atomic_load(&workers[w]->cpu));
+        printf("   nodos: %d   tandas entre nodos/s: %.0f\n", n_nodes,
+               (cur.counters[ST_XNODE_BATCHES] - prev.counters[ST_XNODE_BATCHES]) / dt);
+        fflush(stdout);
+        prev = cur;
+        prev_t = now;
+        stat_record(H_RENDER, now_ns() - t0);
     }
 
     // Cuando keep_running sea 0, salimos del bucle y terminamos el hilo.
@@ -268,13 +3897,154 @@ void *visualizer_thread(void *arg) {
 }
 
 /************ MAIN ************/
+// Margen del presupuesto para las respuestas de las consultas cuando el
+// límite de conexiones se calcula con -B (un HOSTS en un cluster de 16
+// nodos pide unos 16 x 32 KB).
+#define MEM_CMD_RESERVE (4u << 20)
+
+// Reserva del presupuesto la memoria fija y, con -B, ajusta el tope de las
+// colas (a lo sumo un cuarto del presupuesto) y, si no se dio -c, el límite
+// de conexiones. Muestra el reparto. Devuelve 0 o -1 si no cabe.
+int mem_plan(int conns_given) {
+    if (mem_budget && worker_queue_max > mem_budget / 4 / n_workers)
+        worker_queue_max = mem_budget / 4 / n_workers;
+    size_t table = (size_t)table_size * sizeof(host_info_t) +
+                   (size_t)table_size * n_rules * sizeof(alert_slot_t) + snap_mem() +
+                   names_mem() + export_mem();
+    size_t io = (size_t)UDP_BATCH * UDP_DGRAM_MAX + batch_stage_mem() + relay_mem();
+    size_t queues = (size_t)n_workers * worker_queue_max;
+    size_t fixed = table + io + queues;
+
+    if (worker_queue_max < 16 * BATCH_BYTES || mem_reserve(fixed) != 0) {
+        fprintf(stderr, "Presupuesto de %zu MB insuficiente: sólo lo fijo necesita %.1f MB\n",
+                mem_budget >> 20, (fixed + (size_t)n_workers * 16 * BATCH_BYTES) / 1048576.0);
+        return -1;
+    }
+    if (mem_budget && !conns_given) {
+        size_t left = mem_budget - fixed;
+        left = left > MEM_CMD_RESERVE ? left - MEM_CMD_RESERVE : 0;
+        max_conns = left / conn_cost() > 65536 ? 65536 : (int)(left / conn_cost());
+    }
+    if (mem_budget && fixed + (size_t)max_conns * conn_cost() > mem_budget) {
+        fprintf(stderr, "-c %d no cabe en -B %zu: como mucho %zu conexiones\n",
+                max_conns, mem_budget >> 20, (mem_budget - fixed) / conn_cost());
+        return -1;
+    }
+    if (max_conns < 1) {
+        fprintf(stderr, "-B %zu no deja memoria para ninguna conexión\n", mem_budget >> 20);
+        return -1;
+    }
+    fprintf(stderr, "Memoria: tabla %.1f MB (%d hosts, %d por worker), E/S %.1f MB, colas %.1f MB, "
+            "%d conexiones x %zu KB = %.1f MB\n",
+            table / 1048576.0, max_hosts, part_size, io / 1048576.0, queues / 1048576.0,
+            max_conns, conn_cost() >> 10,
+            (fixed + (double)max_conns * conn_cost()) / 1048576.0);
+    return 0;
+}
+
+// Muestra la forma de uso del programa.
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [-a reglas] [-A destino_alertas] [-I intervalo_s]\n"
+            "          [-S intervalos_stale] [-T ttl_s] [-t inactividad_s]\n"
+            "          [-U host_padre:puerto] [-C nodo,nodo,... -M este_nodo]\n"
+            "          [-L socket_unix] [-W workers] [-c conexiones] [-H hosts]\n"
+            "          [-B presupuesto_MB] [-P cpus_workers] [-E cpus_E/S]\n"
+            "          [-X /nombre_shm] <puerto>\n",
+            prog);
+}
+
 // Función principal del programa: configura el servidor y acepta conexiones.
+// collector_bench.c incluye este archivo con COLLECTOR_NO_MAIN para medir
+// las funciones internas sin arrancar el servidor.
+#ifndef COLLECTOR_NO_MAIN
 int main(int argc, char *argv[]) {
-    // Comprobamos que se haya pasado exactamente un argumento (el puerto).
-    if (argc != 2) {
-        fprintf(stderr, "Uso: %s <puerto>\n", argv[0]);
+    // Opciones: -a <reglas> y -A <destino de alertas>.
+    const char *rules_path = NULL;
+    const char *alert_dest = "alerts.log";
+    int c;
+    char *upstream = NULL, *cluster_list = NULL;
+    const char *cluster_me = NULL, *unix_path = NULL;
+    int conns_given = 0;
+    const char *worker_list = NULL, *io_list = NULL;
+    while ((c = getopt(argc, argv, "a:A:I:S:T:t:U:C:M:L:W:c:H:B:P:E:X:")) != -1) {
+        switch (c) {
+        case 'a': rules_path = optarg; break;
+        case 'A': alert_dest = optarg; break;
+        case 'I': expected_interval = atof(optarg); break;
+        case 'S': stale_intervals = atoi(optarg); break;
+        case 'T': host_ttl = atof(optarg); break;
+        case 't': idle_timeout = atof(optarg); break;
+        case 'U': upstream = optarg; break;
+        case 'C': cluster_list = optarg; break;
+        case 'M': cluster_me = optarg; break;
+        case 'L': unix_path = optarg; break;
+        case 'W': n_workers = atoi(optarg); break;
+        case 'c': max_conns = atoi(optarg); conns_given = 1; break;
+        case 'H': max_hosts = atoi(optarg); break;
+        case 'B': mem_budget = (size_t)atol(optarg) << 20; break;
+        case 'P': worker_list = optarg; break;
+        case 'E': io_list = optarg; break;
+        case 'X': export_name = optarg; break;
+        default:  usage(argv[0]); return 1;
+        }
+    }
+
+    // Después de las opciones debe quedar exactamente un argumento (el puerto).
+    if (argc - optind != 1 || expected_interval <= 0 || stale_intervals <= 0 ||
+        host_ttl < stale_after() || idle_timeout <= 0 ||
+        n_workers < 1 || n_workers > WORKERS_MAX || max_conns < 1 ||
+        max_hosts < n_workers || max_hosts > (1 << 20)) {
+        usage(argv[0]);
         return 1; // Salimos con código de error.
     }
+    table_plan();
+
+    // -P y -E, antes de crear ningún hilo (los hilos heredan la máscara de -E).
+    if (affinity_setup(worker_list, io_list) != 0)
+        return 1;
+
+    // "-U host:puerto": el puerto va tras el último ':'.
+    if (upstream) {
+        char *colon = strrchr(upstream, ':');
+        if (!colon || colon == upstream || !colon[1]) {
+            usage(argv[0]);
+            return 1;
+        }
+        *colon = '\0';
+        relay_host = upstream;
+        relay_port = colon + 1;
+    }
+
+    // Cluster: -C y -M van juntos.
+    if (cluster_list || cluster_me) {
+        if (!cluster_list || !cluster_me) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (cluster_init(cluster_list, cluster_me) != 0)
+            return 1;
+    }
+
+    // Cargamos y compilamos las reglas de alerta (si se indicaron).
+    if (rules_path) {
+        if (load_rules(rules_path) != 0 || open_alert_output(alert_dest) != 0)
+            return 1;
+        fprintf(stderr, "%d reglas cargadas de %s\n", n_rules, rules_path);
+    }
+
+    // Todo lo fijo se reserva ahora; lo demás queda acotado por -c y -B.
+    if (mem_plan(conns_given) != 0)
+        return 1;
+    hosts = node_alloc((size_t)table_size * sizeof(host_info_t));
+    if (!hosts || names_init() != 0 || snap_init() != 0) {
+        perror("mmap");
+        return 1;
+    }
+    if (export_name && export_open() != 0) {
+        perror(export_name);
+        return 1;
+    }
 
     // Configuración del manejo de la señal SIGINT (Ctrl+C).
     struct sigaction sa;
@@ -284,7 +4054,7 @@ int main(int argc, char *argv[]) {
     sigaction(SIGINT, &sa, NULL);  // Registramos el manejador.
 
     // Guardamos el puerto pasado por la línea de comandos.
-    const char *port = argv[1];
+    const char *port = argv[optind];
 
     int sfd;                // Descriptor de socket del servidor (socket de escucha).
     struct addrinfo hints;  // Estructura para indicar preferencias a getaddrinfo.
@@ -316,35 +4086,78 @@ int main(int argc, char *argv[]) {
     // Ya no necesitamos la estructura de direcciones, la liberamos.
     freeaddrinfo(res);
 
+    // Workers que parsean y aplican las líneas (con sus ruedas de caducidad).
+    // Van primero: el visualizador lee sus colas.
+    workers_start();
+
+    // Instantáneas de la tabla para el visualizador y las consultas.
+    pthread_t snp;
+    pthread_create(&snp, NULL, snapshot_thread, NULL);
+
     // Creamos el hilo visualizador que mostrará la tabla cada 2 segundos.
     pthread_t viz;
     pthread_create(&viz, NULL, visualizer_thread, NULL);
 
+    // Rueda de las conexiones y el hilo que la avanza.
+    tw_init(&conn_wheel, tw_ticks(now_mono()));
+    pthread_t tmr;
+    pthread_create(&tmr, NULL, timer_thread, NULL);
+
+    // Ingesta UDP en el mismo puerto (si no se puede, seguimos sólo con TCP).
+    static int ufd;
+    ufd = open_udp(port);
+    if (ufd >= 0) {
+        pthread_t udp;
+        pthread_create(&udp, NULL, udp_thread, &ufd);
+    } else {
+        perror("UDP");
+    }
+
+    // Agentes locales por socket Unix (-L).
+    if (unix_path) {
+        static int lfd;
+        lfd = open_unix(unix_path);
+        if (lfd < 0) {
+            perror(unix_path);
+            return 1;
+        }
+        pthread_t ux;
+        pthread_create(&ux, NULL, unix_thread, &lfd);
+        printf("Collector escuchando en %s (Unix)\n", unix_path);
+    }
+
+    // Reenvío al collector padre (-U).
+    if (relay_host) {
+        pthread_t rel;
+        pthread_create(&rel, NULL, relay_thread, NULL);
+    }
+
     // Mensaje informativo para el usuario.
-    printf("Collector escuchando en puerto %s\n", port);
+    printf("Collector escuchando en puerto %s (TCP y UDP)\n", port);
 
     // Bucle principal del servidor: aceptar nuevas conexiones mientras siga activo.
     while (keep_running) {
         struct sockaddr_in cli;     // Estructura para información del cliente.
         socklen_t clilen = sizeof(cli); // Tamaño de la estructura cli.
 
-        // Reservamos memoria dinámica para guardar el descriptor del cliente.
-        // Esto se pasa al hilo y luego el hilo lo libera.
-        int *cfd = malloc(sizeof(int));
+        // Reservamos la conexión (socket, buffer y temporizador).
+        // Se pasa al hilo y luego el hilo la libera.
+        conn_t *conn = calloc(1, sizeof(conn_t));
+        if (!conn) { sleep(1); continue; }
         // accept bloquea hasta que llegue una nueva conexión.
-        *cfd = accept(sfd, (struct sockaddr *)&cli, &clilen);
+        conn->fd = accept(sfd, (struct sockaddr *)&cli, &clilen);
         // Si hubo error en accept, liberamos y seguimos con la siguiente iteración.
-        if (*cfd < 0) { free(cfd); continue; }
+        if (conn->fd < 0) { free(conn); continue; }
 
-        // Creamos un hilo nuevo para manejar a este cliente.
-        pthread_t th;
-        pthread_create(&th, NULL, client_thread, cfd);
-        // Detach para que el hilo se limpie solo al terminar, sin necesidad de join.
-        pthread_detach(th);
+        conn_start(conn);
     }
 
     // Cuando keep_running sea 0, salimos del bucle, cerramos el socket de escucha.
     close(sfd);
+    // Los lectores de -X ya no verán más cambios: quitamos el segmento.
+    if (export_name)
+        shm_unlink(export_name);
     // Terminamos el programa correctamente.
     return 0;
 }
+#endif
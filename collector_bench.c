@@ -0,0 +1,911 @@
+/*
+ * collector_bench.c
+ *
+ * Microbenchmarks de los caminos calientes del collector: parse_cpu,
+ * parse_mem, get_host, el dibujo de la tabla del dashboard (render_table) y
+ * la escritura de la tabla con varios workers a la vez.
+ *
+ * gcc -std=c11 -Wall -Wextra -O2 -pthread -o collector_bench collector_bench.c
+ *
+ * ./collector_bench [-n ops] [-r repeticiones] [-s semilla] [-f filtro] > antes.tsv
+ * ./collector_bench -c antes.tsv despues.tsv
+ * ./collector_bench -k 3     (reparto de un cluster de 3 nodos, ver CLUSTER)
+ *
+ * Incluye collector.c (sin su main), así que mide exactamente el código del
+ * collector que está al lado. Las entradas salen de un generador con semilla
+ * (-s): con la misma semilla dos corridas miden las mismas líneas y los
+ * mismos nombres. Cada caso corre en un proceso hijo, con la tabla recién
+ * creada, y se repite -r veces; se informa la mediana.
+ *
+ * Salida (TSV, una fila por caso):
+ *  bench      caso medido (parse_cpu, parse_mem, get_host, render, contend)
+ *  hosts      hosts en la tabla
+ *  variant    parámetro propio del caso (núcleos por línea, largo del nombre)
+ *  bad_pct    porcentaje de líneas mal formadas
+ *  threads    workers escribiendo a la vez (contend)
+ *  readers    hilos publicando instantáneas a la vez (contend)
+ *  bytes      bytes medios de la entrada (línea o nombre; render: salida)
+ *  ops        operaciones medidas por repetición
+ *  ns_op      nanosegundos por operación
+ *  cycles_op  ciclos (TSC) por operación; 0 si la CPU no tiene TSC
+ *  allocs_op  llamadas a malloc/calloc/realloc por operación
+ *  mops_s     millones de operaciones por segundo (contend: de todos los
+ *             workers juntos, con reloj de pared desde que empieza el
+ *             primero hasta que termina el último)
+ *
+ * -c compara dos salidas: junta las filas por las seis primeras columnas y
+ * muestra ns_op, cycles_op y allocs_op de ambas con la diferencia en %.
+ */
+
+#define COLLECTOR_NO_MAIN
+#include "collector.c"
+
+#include <stddef.h>     // offsetof
+#include <sys/wait.h>   // waitpid (un proceso por caso)
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc
+#endif
+
+/*********** RELOJES Y CONTADORES ***********/
+
+// Contador de ciclos de la CPU (TSC), o 0 si no hay.
+static inline uint64_t bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Llamadas a malloc, calloc y realloc del hilo actual. Se cuentan
+// reemplazando esas funciones por unas que suman y llaman a las de glibc.
+static _Thread_local uint64_t bench_allocs;
+
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+
+void *malloc(size_t n) {
+    bench_allocs++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    bench_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    bench_allocs++;
+    return __libc_realloc(p, n);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+// Lo medido en un tramo: se suma tramo a tramo.
+typedef struct {
+    uint64_t ns, cycles, allocs, ops;
+} bench_meter_t;
+
+typedef struct {
+    uint64_t ns, cycles, allocs;
+} bench_mark_t;
+
+static inline bench_mark_t bench_start(void) {
+    bench_mark_t m = { now_ns(), bench_cycles(), bench_allocs };
+    return m;
+}
+
+static inline void bench_stop(bench_meter_t *t, bench_mark_t m, uint64_t ops) {
+    uint64_t c = bench_cycles();
+    t->ns += now_ns() - m.ns;
+    t->cycles += c - m.cycles;
+    t->allocs += bench_allocs - m.allocs;
+    t->ops += ops;
+}
+
+/*********** ENTRADAS ***********/
+// Generador splitmix64: rápido, con semilla y el mismo en cualquier máquina.
+
+static uint64_t bench_seed = 1;    // -s
+
+typedef struct {
+    uint64_t s;
+} rng_t;
+
+static inline uint64_t rng_next(rng_t *r) {
+    uint64_t z = (r->s += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Entero en [0, n).
+static inline uint32_t rng_below(rng_t *r, uint32_t n) {
+    return (uint32_t)(((rng_next(r) >> 32) * n) >> 32);
+}
+
+// Porcentaje con dos decimales en [0, 100).
+static inline float rng_pct(rng_t *r) {
+    return rng_below(r, 10000) / 100.0f;
+}
+
+// 'n' nombres distintos de 'len' caracteres (al menos 8): letras al azar y
+// un número al final, de modo que los nombres no se distinguen en el prefijo.
+static char **gen_names(rng_t *r, int n, int len) {
+    char **names = malloc(n * sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        names[i] = malloc(len + 1);
+        int pad = len - 8;
+        for (int k = 0; k < pad; k++)
+            names[i][k] = 'a' + rng_below(r, 26);
+        snprintf(names[i] + pad, 9, "-%07d", i % 10000000);
+    }
+    return names;
+}
+
+// Líneas generadas: todas seguidas (terminadas en '\0') en 'buf'.
+typedef struct {
+    char *buf;
+    size_t len;
+    int n;
+    size_t *off;      // Inicio de cada línea en buf
+} lines_t;
+
+static void lines_add(lines_t *l, const char *s, size_t cap) {
+    size_t n = strlen(s) + 1;
+    if (l->len + n > cap) return;
+    memcpy(l->buf + l->len, s, n);
+    l->off[l->n++] = l->len;
+    l->len += n;
+}
+
+// Estropea una línea bien formada de alguna de las formas que el parser
+// tiene que rechazar: cortada tras el uso, un campo vacío, o (si trae
+// vector de núcleos) un carácter que no es hexadecimal.
+static void corrupt(rng_t *r, char *s) {
+    char *f[12];
+    int nf = 0;
+    for (char *p = s; *p && nf < 12; p++)
+        if (*p == ';') f[nf++] = p;
+    switch (rng_below(r, 3)) {
+    case 0:                             // Faltan campos
+        if (nf >= 3) *f[2] = '\0';
+        break;
+    case 1:                             // Campo vacío
+        if (nf >= 4) memmove(f[2] + 1, f[3], strlen(f[3]) + 1);
+        break;
+    default:                            // Vector inválido (o campo vacío)
+        if (nf >= 9) f[8][1] = 'z';
+        else if (nf >= 4) memmove(f[2] + 1, f[3], strlen(f[3]) + 1);
+        break;
+    }
+}
+
+// 'n' líneas CPU (cores > 0: con iowait, steal y vector de núcleos) o MEM
+// (cores < 0) para hosts al azar de 'names', con 'bad_pct' % estropeadas.
+static lines_t gen_lines(rng_t *r, char **names, int n_names, int n, int cores, int bad_pct) {
+    size_t cap = (size_t)n * (strlen(names[0]) + 2 * (cores > 0 ? cores : 0) + 128);
+    lines_t l = { malloc(cap), 0, 0, malloc(n * sizeof(size_t)) };
+    char s[NAME_MAX_LEN + 2 * MAX_CORES + 128];
+    for (int i = 0; i < n; i++) {
+        const char *name = names[rng_below(r, n_names)];
+        if (cores < 0) {
+            snprintf(s, sizeof(s), "MEM;%s;%.1f;%.1f;%.1f;%.1f", name,
+                     rng_pct(r) * 160, rng_pct(r) * 160, 4096.0, rng_pct(r) * 40);
+        } else {
+            float usr = rng_pct(r) / 2, sys = rng_pct(r) / 4;
+            int k = snprintf(s, sizeof(s), "CPU;%s;%.2f;%.2f;%.2f;%.2f", name,
+                             usr + sys, usr, sys, 100 - usr - sys);
+            if (cores > 0) {
+                k += snprintf(s + k, sizeof(s) - k, ";%.2f;%.2f;%d;",
+                              rng_pct(r) / 10, rng_pct(r) / 20, cores);
+                for (int c = 0; c < cores; c++)
+                    k += snprintf(s + k, sizeof(s) - k, "%02x", rng_below(r, 101));
+            }
+        }
+        if ((int)rng_below(r, 100) < bad_pct)
+            corrupt(r, s);
+        lines_add(&l, s, cap);
+    }
+    return l;
+}
+
+/*********** CASOS ***********/
+
+typedef enum { B_PARSE_CPU, B_PARSE_MEM, B_GET_HOST, B_RENDER, B_CONTEND } bench_kind_t;
+
+static const char *bench_names[] = {
+    "parse_cpu", "parse_mem", "get_host", "render", "contend"
+};
+
+typedef struct {
+    bench_kind_t kind;
+    int hosts;
+    int variant;      // Núcleos por línea (parse_cpu, contend) o largo del nombre (get_host)
+    int bad_pct;
+    int threads;
+    int readers;
+} bench_case_t;
+
+// Resultado de una repetición.
+typedef struct {
+    double ns_op, cycles_op, allocs_op, mops_s;
+} bench_result_t;
+
+static int bench_ops = 200000;    // -n
+static int bench_reps = 5;        // -r
+
+#define BENCH_ROUND 4096          // Bytes de líneas por tramo (como una tanda)
+#define NAME_LEN    12            // Largo de los nombres salvo en get_host
+
+typedef int (*parse_fn_t)(char *msg, int64_t ts_ms, host_info_t *bound);
+
+// Crea la tabla para 'n' hosts repartidos entre 'workers' workers (con
+// varios, con margen: el reparto por hash no es exacto).
+static void table_setup(int n, int workers) {
+    n_workers = workers;
+    max_hosts = workers == 1 ? n : n + n / 2;
+    table_plan();
+    hosts = node_alloc((size_t)table_size * sizeof(host_info_t));
+    if (!hosts || names_init() != 0 || snap_init() != 0) {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+// Convierte el hilo actual en el worker 'w'.
+static void bench_attach(int w) {
+    if (!worker_attach(w)) {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+// Resultado a partir de lo medido.
+static bench_result_t result_of(const bench_meter_t *t) {
+    bench_result_t r;
+    r.ns_op = (double)t->ns / t->ops;
+    r.cycles_op = (double)t->cycles / t->ops;
+    r.allocs_op = (double)t->allocs / t->ops;
+    r.mops_s = 1e3 / r.ns_op;
+    return r;
+}
+
+// Parsea las líneas de 'l' por tramos de BENCH_ROUND bytes: cada tramo se
+// copia a un buffer (fuera de la medida), como una tanda recién llegada, y
+// se mide sólo el parseo. Las marcas de tiempo siempre avanzan, así que
+// ninguna muestra cuenta como atrasada.
+static void run_lines(const lines_t *l, parse_fn_t parse, bench_meter_t *t) {
+    static _Thread_local int64_t ts;
+    char buf[2 * BENCH_ROUND];
+    if (!ts) ts = now_wall_ms();
+    for (int i = 0; i < l->n;) {
+        size_t start = l->off[i];
+        int j = i;
+        while (j < l->n && l->off[j] - start < BENCH_ROUND)
+            j++;
+        size_t end = j < l->n ? l->off[j] : l->len;
+        memcpy(buf, l->buf + start, end - start);
+        bench_mark_t m = bench_start();
+        for (int k = i; k < j; k++)
+            parse(buf + (l->off[k] - start), ts++, NULL);
+        bench_stop(t, m, j - i);
+        i = j;
+    }
+}
+
+// Crea las entradas de todos los nombres (en el worker actual).
+static void add_hosts(char **names, int n) {
+    for (int i = 0; i < n; i++)
+        if (!get_host(names[i])) {
+            fprintf(stderr, "tabla llena en %s\n", names[i]);
+            exit(1);
+        }
+}
+
+// Bytes medios por línea.
+static double line_bytes(const lines_t *l) {
+    return l->n ? (double)(l->len - l->n) / l->n : 0;
+}
+
+// parse_cpu y parse_mem: una línea por operación, para hosts ya creados.
+static double bench_parse(const bench_case_t *c, rng_t *r, bench_result_t *res) {
+    table_setup(c->hosts, 1);
+    bench_attach(0);
+    char **names = gen_names(r, c->hosts, NAME_LEN);
+    add_hosts(names, c->hosts);
+    int cores = c->kind == B_PARSE_MEM ? -1 : c->variant;
+    lines_t l = gen_lines(r, names, c->hosts, bench_ops, cores, c->bad_pct);
+    parse_fn_t parse = c->kind == B_PARSE_MEM ? parse_mem : parse_cpu;
+    bench_meter_t warm = { 0 };
+    run_lines(&l, parse, &warm);
+    for (int rep = 0; rep < bench_reps; rep++) {
+        bench_meter_t t = { 0 };
+        run_lines(&l, parse, &t);
+        res[rep] = result_of(&t);
+    }
+    return line_bytes(&l);
+}
+
+// get_host de hosts que ya están en la tabla (el caso de cada línea).
+static double bench_get_host(const bench_case_t *c, rng_t *r, bench_result_t *res) {
+    table_setup(c->hosts, 1);
+    bench_attach(0);
+    char **names = gen_names(r, c->hosts, c->variant);
+    add_hosts(names, c->hosts);
+    uint32_t *seq = malloc(bench_ops * sizeof(uint32_t));
+    for (int i = 0; i < bench_ops; i++)
+        seq[i] = rng_below(r, c->hosts);
+    uintptr_t sink = 0;
+    for (int rep = -1; rep < bench_reps; rep++) {    // La -1 calienta cachés
+        bench_meter_t t = { 0 };
+        bench_mark_t m = bench_start();
+        for (int i = 0; i < bench_ops; i++)
+            sink += (uintptr_t)get_host(names[seq[i]]);
+        bench_stop(&t, m, bench_ops);
+        if (rep >= 0)
+            res[rep] = result_of(&t);
+    }
+    if (sink == 1) fprintf(stderr, "\n");   // Que el compilador no quite las búsquedas
+    return c->variant;
+}
+
+// render_table de una instantánea con todos los hosts, a /dev/null. Cada
+// host recibe datos de CPU (con 8 núcleos) y de memoria antes de medir.
+static double bench_render(const bench_case_t *c, rng_t *r, bench_result_t *res) {
+    table_setup(c->hosts, 1);
+    bench_attach(0);
+    char **names = gen_names(r, c->hosts, NAME_LEN);
+    add_hosts(names, c->hosts);
+    lines_t cpu = gen_lines(r, names, c->hosts, 4 * c->hosts, 8, 0);
+    lines_t mem = gen_lines(r, names, c->hosts, 4 * c->hosts, -1, 0);
+    bench_meter_t warm = { 0 };
+    run_lines(&cpu, parse_cpu, &warm);
+    run_lines(&mem, parse_mem, &warm);
+    snap_publish();
+
+    int slot;
+    const snapshot_t *s = snap_get(&slot);
+    char *text;
+    size_t size;
+    FILE *ms = open_memstream(&text, &size);
+    render_table(ms, s);
+    fclose(ms);
+    free(text);
+
+    FILE *out = fopen("/dev/null", "w");
+    if (!out) {
+        perror("/dev/null");
+        exit(1);
+    }
+    int ops = bench_ops / c->hosts < 20 ? 20 : bench_ops / c->hosts;
+    for (int rep = -1; rep < bench_reps; rep++) {
+        bench_meter_t t = { 0 };
+        bench_mark_t m = bench_start();
+        for (int i = 0; i < ops; i++) {
+            render_table(out, s);
+            fflush(out);
+        }
+        bench_stop(&t, m, ops);
+        if (rep >= 0)
+            res[rep] = result_of(&t);
+    }
+    fclose(out);
+    snap_put(slot);
+    return size;
+}
+
+// contend: 'threads' workers aplican líneas CPU de sus propios hosts a la
+// vez (cada uno en su parte de la tabla, como en el collector) y, con
+// 'readers', un hilo publica instantáneas sin parar, leyendo las entradas
+// que los workers escriben.
+
+typedef struct {
+    int w;
+    const bench_case_t *c;
+    char **names;             // Nombres cuyo worker es 'w'
+    int n_names;
+    uint64_t seed;
+    bench_meter_t t;
+    uint64_t start, end;      // Reloj de pared de la repetición (now_ns)
+    double bytes;
+} contend_arg_t;
+
+static pthread_barrier_t contend_bar;
+static _Atomic int contend_stop;
+
+static void *contend_writer(void *arg) {
+    contend_arg_t *a = arg;
+    bench_attach(a->w);
+    add_hosts(a->names, a->n_names);
+    rng_t r = { a->seed };
+    lines_t l = gen_lines(&r, a->names, a->n_names, bench_ops / a->c->threads,
+                          a->c->variant, a->c->bad_pct);
+    a->bytes = line_bytes(&l);
+    bench_meter_t warm = { 0 };
+    run_lines(&l, parse_cpu, &warm);
+    pthread_barrier_wait(&contend_bar);              // Todo listo
+    for (int rep = 0; rep < bench_reps; rep++) {
+        pthread_barrier_wait(&contend_bar);          // Empieza la repetición
+        memset(&a->t, 0, sizeof(a->t));
+        a->start = now_ns();
+        run_lines(&l, parse_cpu, &a->t);
+        a->end = now_ns();
+        pthread_barrier_wait(&contend_bar);          // Terminó
+        pthread_barrier_wait(&contend_bar);          // main ya leyó a->t
+    }
+    return NULL;
+}
+
+static void *contend_reader(void *arg) {
+    (void)arg;
+    while (!atomic_load_explicit(&contend_stop, memory_order_relaxed))
+        snap_publish();
+    return NULL;
+}
+
+static double bench_contend(const bench_case_t *c, rng_t *r, bench_result_t *res) {
+    int nt = c->threads;
+    table_setup(c->hosts, nt);
+    char **names = gen_names(r, c->hosts, NAME_LEN);
+    contend_arg_t a[WORKERS_MAX];
+    for (int w = 0; w < nt; w++) {
+        a[w] = (contend_arg_t){ .w = w, .c = c, .seed = rng_next(r) };
+        a[w].names = malloc(c->hosts * sizeof(char *));
+    }
+    for (int i = 0; i < c->hosts; i++) {
+        contend_arg_t *o = &a[host_worker(names[i], strlen(names[i]))];
+        o->names[o->n_names++] = names[i];
+    }
+
+    pthread_barrier_init(&contend_bar, NULL, nt + 1);
+    pthread_t th[WORKERS_MAX];
+    for (int w = 0; w < nt; w++)
+        pthread_create(&th[w], NULL, contend_writer, &a[w]);
+    pthread_barrier_wait(&contend_bar);
+    for (int rep = 0; rep < bench_reps; rep++) {
+        pthread_t rd;
+        atomic_store(&contend_stop, 0);
+        if (c->readers)
+            pthread_create(&rd, NULL, contend_reader, NULL);
+        pthread_barrier_wait(&contend_bar);
+        pthread_barrier_wait(&contend_bar);
+        atomic_store(&contend_stop, 1);
+        if (c->readers)
+            pthread_join(rd, NULL);
+
+        // Por operación, la media de los workers; el ritmo, el de todos
+        // juntos, desde que empezó el primero hasta que terminó el último
+        // (sin contar lo que tardan en salir de las barreras).
+        bench_result_t sum = { 0 };
+        uint64_t ops = 0, t0 = a[0].start, t1 = a[0].end;
+        for (int w = 0; w < nt; w++) {
+            if (a[w].start < t0) t0 = a[w].start;
+            if (a[w].end > t1) t1 = a[w].end;
+            bench_result_t x = result_of(&a[w].t);
+            sum.ns_op += x.ns_op / nt;
+            sum.cycles_op += x.cycles_op / nt;
+            sum.allocs_op += x.allocs_op / nt;
+            ops += a[w].t.ops;
+        }
+        sum.mops_s = ops * 1e3 / (t1 - t0);
+        res[rep] = sum;
+        pthread_barrier_wait(&contend_bar);
+    }
+    for (int w = 0; w < nt; w++)
+        pthread_join(th[w], NULL);
+    double bytes = 0;
+    for (int w = 0; w < nt; w++)
+        bytes += a[w].bytes / nt;
+    return bytes;
+}
+
+/*********** EJECUCIÓN ***********/
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Mediana de un campo de los resultados.
+static double median_of(const bench_result_t *res, size_t field) {
+    double v[bench_reps];
+    for (int i = 0; i < bench_reps; i++)
+        v[i] = *(const double *)((const char *)&res[i] + field);
+    qsort(v, bench_reps, sizeof(double), cmp_double);
+    return v[bench_reps / 2];
+}
+
+// Texto de la columna variant.
+static void variant_str(const bench_case_t *c, char *out, size_t size) {
+    switch (c->kind) {
+    case B_PARSE_CPU:
+    case B_CONTEND:  snprintf(out, size, "cores=%d", c->variant); break;
+    case B_GET_HOST: snprintf(out, size, "name=%d", c->variant); break;
+    default:         snprintf(out, size, "-"); break;
+    }
+}
+
+// Corre un caso en un proceso hijo (tabla y contadores nuevos) y escribe
+// su fila. Devuelve 0 o -1 si el hijo falló.
+static int run_case(const bench_case_t *c) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        // La semilla depende sólo de -s y del caso: lo mismo en cada corrida.
+        rng_t r = { bench_seed ^ ((uint64_t)c->kind << 56) ^ ((uint64_t)c->hosts << 32) ^
+                    ((uint64_t)c->variant << 16) ^ ((uint64_t)c->bad_pct << 8) ^
+                    ((uint64_t)c->threads << 4) ^ (uint64_t)c->readers };
+        bench_result_t *res = malloc(bench_reps * sizeof(bench_result_t));
+        double bytes = 0;
+        uint64_t ops = bench_ops;
+        switch (c->kind) {
+        case B_PARSE_CPU:
+        case B_PARSE_MEM: bytes = bench_parse(c, &r, res); break;
+        case B_GET_HOST:  bytes = bench_get_host(c, &r, res); break;
+        case B_RENDER:
+            bytes = bench_render(c, &r, res);
+            ops = bench_ops / c->hosts < 20 ? 20 : bench_ops / c->hosts;
+            break;
+        case B_CONTEND:   bytes = bench_contend(c, &r, res); break;
+        }
+        char var[32];
+        variant_str(c, var, sizeof(var));
+        printf("%s\t%d\t%s\t%d\t%d\t%d\t%.0f\t%llu\t%.1f\t%.1f\t%.3f\t%.4f\n",
+               bench_names[c->kind], c->hosts, var, c->bad_pct, c->threads, c->readers,
+               bytes, (unsigned long long)ops,
+               median_of(res, offsetof(bench_result_t, ns_op)),
+               median_of(res, offsetof(bench_result_t, cycles_op)),
+               median_of(res, offsetof(bench_result_t, allocs_op)),
+               median_of(res, offsetof(bench_result_t, mops_s)));
+        fflush(stdout);
+        _exit(0);
+    }
+    int st;
+    waitpid(pid, &st, 0);
+    if (WIFSIGNALED(st))
+        fprintf(stderr, "el caso terminó por la señal %d (%s)\n", WTERMSIG(st),
+                strsignal(WTERMSIG(st)));
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : -1;
+}
+
+// Lista de casos: cada parámetro varía por separado alrededor de uno base.
+static int make_cases(bench_case_t *out) {
+    int n = 0;
+    static const int parse_hosts[] = { 16, 1024, 16384 };
+    static const int cores[] = { 0, 8, 64 };
+    static const int bad[] = { 0, 10, 50 };
+    static const int name_len[] = { 12, 64, 200 };
+    static const int threads[] = { 1, 2, 4 };
+    for (int i = 0; i < 3; i++)
+        for (int k = 0; k < 3; k++)
+            out[n++] = (bench_case_t){ B_PARSE_CPU, parse_hosts[i], cores[k], 0, 1, 0 };
+    for (int b = 1; b < 3; b++)
+        out[n++] = (bench_case_t){ B_PARSE_CPU, 1024, 8, bad[b], 1, 0 };
+    for (int i = 0; i < 3; i++)
+        out[n++] = (bench_case_t){ B_PARSE_MEM, parse_hosts[i], 0, 0, 1, 0 };
+    out[n++] = (bench_case_t){ B_PARSE_MEM, 1024, 0, 10, 1, 0 };
+    for (int i = 0; i < 3; i++)
+        for (int k = 0; k < 3; k++)
+            out[n++] = (bench_case_t){ B_GET_HOST, parse_hosts[i], name_len[k], 0, 1, 0 };
+    for (int i = 0; i < 3; i++)
+        out[n++] = (bench_case_t){ B_RENDER, parse_hosts[i] / 4, 0, 0, 1, 0 };
+    for (int t = 0; t < 3; t++)
+        for (int rd = 0; rd < 2; rd++)
+            out[n++] = (bench_case_t){ B_CONTEND, 4096, 8, 0, threads[t], rd };
+    return n;
+}
+
+/*********** CLUSTER ***********/
+// -k N arranca N collectors (./collector) en localhost con -C/-M, les
+// presenta CLUSTER_HOSTS hosts con HELLO como lo haría un agente (a un nodo
+// cualquiera, siguiendo el REDIRECT) y cuenta con LOCAL HOSTS cuántos se
+// quedó cada nodo. Luego repite con N + 1 nodos y cuenta cuántos hosts
+// cambiaron de nodo. Todos los nodos comparten la CPU, así que no dice
+// nada de cómo escala la ingesta.
+
+#define CLUSTER_HOSTS 3000
+#define CLUSTER_PORT  47000       // Puerto del primer nodo; los demás, los siguientes
+
+static pid_t cluster_pids[CLUSTER_MAX];
+
+// Conexión TCP con el nodo 'node', o -1.
+static int cluster_connect(int node) {
+    struct sockaddr_in a = { .sin_family = AF_INET, .sin_port = htons(CLUSTER_PORT + node) };
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&a, sizeof(a)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Para los nodos que arrancó cluster_start.
+static void cluster_stop(int n) {
+    for (int i = 0; i < n; i++)
+        kill(cluster_pids[i], SIGINT);
+    for (int i = 0; i < n; i++)
+        waitpid(cluster_pids[i], NULL, 0);
+}
+
+// Arranca 'n' nodos y espera a que acepten conexiones. Devuelve 0 o -1.
+static int cluster_start(int n) {
+    char list[CLUSTER_MAX * 24];
+    size_t len = 0;
+    for (int i = 0; i < n; i++)
+        len = buf_printf(list, sizeof(list), len, "%s127.0.0.1:%d", i ? "," : "",
+                         CLUSTER_PORT + i);
+    for (int i = 0; i < n; i++) {
+        char me[24], port[8];
+        snprintf(me, sizeof(me), "127.0.0.1:%d", CLUSTER_PORT + i);
+        snprintf(port, sizeof(port), "%d", CLUSTER_PORT + i);
+        cluster_pids[i] = fork();
+        if (cluster_pids[i] == 0) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            execl("./collector", "collector", "-C", list, "-M", me, "-H", "8192", port,
+                  (char *)NULL);
+            _exit(127);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        int fd = -1;
+        for (int tries = 0; tries < 50 && fd < 0; tries++) {
+            struct timespec ts = { 0, 100000000 };
+            nanosleep(&ts, NULL);
+            fd = cluster_connect(i);
+        }
+        if (fd < 0) {
+            fprintf(stderr, "el nodo %d (puerto %d) no arrancó; ¿está ./collector compilado "
+                    "y el puerto libre?\n", i, CLUSTER_PORT + i);
+            cluster_stop(n);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Presenta el host 'name' al nodo 'node' como un agente: HELLO y, si el
+// nodo contesta REDIRECT, otra vez al nodo que indica. Devuelve 0 o -1.
+static int cluster_hello(int node, const char *name) {
+    for (int hop = 0; hop < 2; hop++) {
+        int fd = cluster_connect(node);
+        if (fd < 0) return -1;
+        char line[64];
+        int len = snprintf(line, sizeof(line), "HELLO;%s\n", name);
+        send_all(fd, line, len);
+        shutdown(fd, SHUT_WR);
+        ssize_t got = 0, r;
+        while (got < (ssize_t)sizeof(line) - 1 &&
+               (r = read(fd, line + got, sizeof(line) - 1 - got)) > 0)
+            got += r;
+        close(fd);
+        line[got] = '\0';
+        int port;
+        if (sscanf(line, "REDIRECT;127.0.0.1:%d", &port) != 1)
+            return 0;
+        node = port - CLUSTER_PORT;
+    }
+    return -1;
+}
+
+// Pregunta LOCAL HOSTS a cada nodo y deja en owner[i] el nodo que tiene el
+// host i (-1 si ninguno). Devuelve 0 o -1.
+static int cluster_owners(int n, int *owner) {
+    for (int i = 0; i < CLUSTER_HOSTS; i++)
+        owner[i] = -1;
+    size_t cap = CLUSTER_HOSTS * HOSTS_LINE_MAX;
+    char *buf = malloc(cap);
+    for (int node = 0; node < n; node++) {
+        int fd = cluster_connect(node);
+        if (fd < 0 || send_all(fd, "LOCAL HOSTS\n", 12) != 0) {
+            free(buf);
+            return -1;
+        }
+        size_t got = 0;
+        ssize_t r;
+        while (got < cap - 1 && (got < 4 || memcmp(buf + got - 4, "END\n", 4) != 0) &&
+               (r = read(fd, buf + got, cap - 1 - got)) > 0)
+            got += r;
+        close(fd);
+        buf[got] = '\0';
+        for (char *l = buf; l && *l; l = strchr(l, '\n') ? strchr(l, '\n') + 1 : NULL) {
+            int i;
+            if (sscanf(l, "host host%d ", &i) == 1 && i >= 0 && i < CLUSTER_HOSTS)
+                owner[i] = node;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+// Arranca 'n' nodos, les presenta los hosts y deja su dueño en 'owner'.
+// Muestra cuántos hosts tiene cada nodo. Devuelve 0 o -1.
+static int cluster_round(int n, int *owner) {
+    if (cluster_start(n) != 0) return -1;
+    int failed = 0;
+    for (int i = 0; i < CLUSTER_HOSTS && !failed; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "host%d", i);
+        failed = cluster_hello(i % n, name) != 0;
+    }
+    if (!failed) {
+        struct timespec ts = { 0, 500000000 };   // Que los workers apliquen los HELLO
+        nanosleep(&ts, NULL);
+        failed = cluster_owners(n, owner) != 0;
+    }
+    cluster_stop(n);
+    if (failed) {
+        fprintf(stderr, "falló la conexión con el cluster de %d nodos\n", n);
+        return -1;
+    }
+    int count[CLUSTER_MAX + 1] = { 0 };
+    for (int i = 0; i < CLUSTER_HOSTS; i++)
+        count[owner[i] + 1]++;
+    for (int node = 0; node < n; node++)
+        printf("%5d  127.0.0.1:%-6d %6d %6.1f%%\n", n, CLUSTER_PORT + node, count[node + 1],
+               count[node + 1] * 100.0 / CLUSTER_HOSTS);
+    if (count[0])
+        printf("%5d  %-16s %6d\n", n, "sin nodo", count[0]);
+    return 0;
+}
+
+// Reparto de los hosts con 'n' nodos y con uno más.
+static int cluster_check(int n) {
+    static int before[CLUSTER_HOSTS], after[CLUSTER_HOSTS];
+    printf("%5s  %-16s %6s %7s\n", "nodos", "nodo", "hosts", "%");
+    if (cluster_round(n, before) != 0 || cluster_round(n + 1, after) != 0)
+        return 1;
+    int moved = 0, to_new = 0;
+    for (int i = 0; i < CLUSTER_HOSTS; i++) {
+        moved += before[i] != after[i];
+        to_new += before[i] != after[i] && after[i] == n;
+    }
+    printf("al pasar de %d a %d nodos cambian de nodo %d de %d hosts (%.1f%%); "
+           "%d van al nodo nuevo\n", n, n + 1, moved, CLUSTER_HOSTS,
+           moved * 100.0 / CLUSTER_HOSTS, to_new);
+    return 0;
+}
+
+/*********** COMPARACIÓN ***********/
+// Filas de dos salidas: clave (las seis primeras columnas) y medidas.
+
+typedef struct {
+    char key[128];
+    double ns, cycles, allocs;
+} cmp_row_t;
+
+// Siguiente columna de una fila TSV (sin el '\n' final), o NULL.
+static char *next_col(char **p) {
+    char *s = *p;
+    if (!s) return NULL;
+    size_t n = strcspn(s, "\t\n");
+    *p = s[n] == '\t' ? s + n + 1 : NULL;
+    s[n] = '\0';
+    return s;
+}
+
+// Lee una salida del benchmark. Devuelve el número de filas o -1.
+static int read_rows(const char *path, cmp_row_t **rows) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int n = 0, cap = 64;
+    *rows = malloc(cap * sizeof(cmp_row_t));
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "bench\t", 6) == 0) continue;     // Cabecera
+        char *col[12], *save = line;
+        int nc = 0;
+        while (nc < 12 && (col[nc] = next_col(&save)))
+            nc++;
+        if (nc < 12) continue;
+        if (n == cap)
+            *rows = realloc(*rows, (cap *= 2) * sizeof(cmp_row_t));
+        cmp_row_t *r = &(*rows)[n++];
+        snprintf(r->key, sizeof(r->key), "%s %s %s %s %s %s",
+                 col[0], col[1], col[2], col[3], col[4], col[5]);
+        r->ns = atof(col[8]);
+        r->cycles = atof(col[9]);
+        r->allocs = atof(col[10]);
+    }
+    fclose(f);
+    return n;
+}
+
+// Diferencia de 'b' respecto de 'a' en %.
+static double pct(double a, double b) {
+    return a > 0 ? (b - a) * 100 / a : 0;
+}
+
+// Tabla de antes y después, en el orden de 'after'.
+static int compare(const char *before_path, const char *after_path) {
+    cmp_row_t *before, *after;
+    int nb = read_rows(before_path, &before);
+    int na = read_rows(after_path, &after);
+    if (nb < 0 || na < 0) return 1;
+    printf("%-40s %10s %10s %7s %10s %10s %7s %8s %8s\n", "caso",
+           "ns antes", "ns despues", "dif%", "cic antes", "cic desp", "dif%",
+           "allocs a", "allocs d");
+    for (int i = 0; i < na; i++) {
+        const cmp_row_t *a = &after[i], *b = NULL;
+        for (int k = 0; k < nb && !b; k++)
+            if (strcmp(before[k].key, a->key) == 0)
+                b = &before[k];
+        if (!b) {
+            printf("%-40s %10s %10.1f %7s %10s %10.1f %7s %8s %8.3f\n", a->key,
+                   "-", a->ns, "-", "-", a->cycles, "-", "-", a->allocs);
+            continue;
+        }
+        printf("%-40s %10.1f %10.1f %+6.1f%% %10.1f %10.1f %+6.1f%% %8.3f %8.3f\n",
+               a->key, b->ns, a->ns, pct(b->ns, a->ns), b->cycles, a->cycles,
+               pct(b->cycles, a->cycles), b->allocs, a->allocs);
+    }
+    return 0;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [-n ops] [-r repeticiones] [-s semilla] [-f filtro]\n"
+            "     %s -c antes.tsv despues.tsv\n"
+            "     %s -k nodos   (arranca ./collector en los puertos %d...)\n",
+            prog, prog, prog, CLUSTER_PORT);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    int cmp = 0, nodes = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:s:f:ck:")) != -1) {
+        switch (c) {
+        case 'n': bench_ops = atoi(optarg); break;
+        case 'r': bench_reps = atoi(optarg); break;
+        case 's': bench_seed = strtoull(optarg, NULL, 0); break;
+        case 'f': filter = optarg; break;
+        case 'c': cmp = 1; break;
+        case 'k': nodes = atoi(optarg); break;
+        default:  bench_usage(argv[0]); return 1;
+        }
+    }
+    if (cmp) {
+        if (argc - optind != 2) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        return compare(argv[optind], argv[optind + 1]);
+    }
+    if (nodes) {
+        if (argc != optind || nodes < 1 || nodes >= CLUSTER_MAX) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        return cluster_check(nodes);
+    }
+    if (argc != optind || bench_ops < 1000 || bench_reps < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    bench_case_t cases[64];
+    int n = make_cases(cases), failed = 0;
+    printf("bench\thosts\tvariant\tbad_pct\tthreads\treaders\tbytes\tops\t"
+           "ns_op\tcycles_op\tallocs_op\tmops_s\n");
+    for (int i = 0; i < n; i++) {
+        if (filter && !strstr(bench_names[cases[i].kind], filter)) continue;
+        if (run_case(&cases[i]) != 0) {
+            fprintf(stderr, "falló el caso %d (%s)\n", i, bench_names[cases[i].kind]);
+            failed = 1;
+        }
+    }
+    return failed;
+}
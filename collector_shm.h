@@ -0,0 +1,178 @@
+/*
+ * collector_shm.h - Tabla de hosts del collector en memoria compartida.
+ *
+ * Con "-X <nombre>" el collector publica su tabla de hosts en el segmento
+ * POSIX <nombre> (p. ej. "/collector", en /dev/shm). Este archivo define el
+ * formato del segmento y unas funciones para leerlo desde cualquier proceso
+ * de la misma máquina, sin pedirle nada al collector ni frenarlo:
+ *
+ *     #define _POSIX_C_SOURCE 200809L   // Antes de todo include (o -std=gnu11)
+ *     #include "collector_shm.h"
+ *
+ *     cshm_reader_t r;
+ *     if (cshm_open(&r, "/collector") != 0) { perror("cshm_open"); return 1; }
+ *     cshm_entry_t e;
+ *     for (uint32_t i = 0; i < cshm_capacity(&r); i++)
+ *         if (cshm_read(&r, i, &e) == 1 && (e.flags & CSHM_HAS_CPU))
+ *             printf("%s %.1f%%\n", e.name, e.cpu_usage);
+ *     cshm_close(&r);
+ *
+ * Formato: una cabecera (cshm_header_t) y 'capacity' entradas de
+ * 'entry_size' bytes a partir del byte 'header_size'. Cada entrada es un
+ * host (o está libre) y la escribe un solo hilo del collector, que deja
+ * 'seq' impar mientras la modifica; cshm_read copia la entrada y repite si
+ * 'seq' cambió, así que nunca devuelve una entrada a medio escribir.
+ *
+ * Versiones: 'version' cambia sólo si el formato deja de ser compatible.
+ * Los campos nuevos se añaden al final de las estructuras (entry_size y
+ * header_size crecen) y un lector antiguo los ignora.
+ */
+
+#ifndef COLLECTOR_SHM_H
+#define COLLECTOR_SHM_H
+
+#include <stdint.h>     // uint32_t, int64_t
+#include <string.h>     // memcpy, strcmp
+#include <errno.h>      // EPROTO, EAGAIN
+#include <time.h>       // clock_gettime (cshm_alive)
+#include <sched.h>      // sched_yield
+#include <fcntl.h>      // O_RDONLY
+#include <unistd.h>     // close
+#include <sys/mman.h>   // shm_open, mmap
+#include <sys/stat.h>   // fstat
+
+#define CSHM_MAGIC    0x4d485343u   // "CSHM"
+#define CSHM_VERSION  1
+#define CSHM_NAME_MAX 256           // Nombre del host, con el '\0'
+#define CSHM_COMM_MAX 16            // Nombre de proceso, con el '\0'
+
+// Bits de cshm_entry_t.flags.
+#define CSHM_USED      (1u << 0)    // La entrada es de un host
+#define CSHM_STALE     (1u << 1)    // El host dejó de reportar (valores viejos)
+#define CSHM_HAS_CPU   (1u << 2)    // Campos cpu_* válidos
+#define CSHM_HAS_MEM   (1u << 3)    // Campos mem_* y swap_* válidos
+#define CSHM_HAS_PROCS (1u << 4)    // Campos nprocs y top_* válidos
+
+typedef struct {
+    uint32_t magic;          // CSHM_MAGIC (se escribe la última al crear)
+    uint32_t version;        // CSHM_VERSION
+    uint32_t header_size;    // Byte en que empieza la primera entrada
+    uint32_t entry_size;     // Bytes de cada entrada
+    uint32_t capacity;       // Entradas (la -H del collector)
+    int32_t pid;             // Proceso del collector
+    int64_t started_ms;      // Arranque del collector (ms desde 1970)
+    int64_t heartbeat_ms;    // Se actualiza 4 veces por segundo mientras vive
+    uint8_t reserved[24];
+} cshm_header_t;
+
+typedef struct {
+    uint32_t seq;            // Seqlock: impar mientras el collector escribe
+    uint32_t flags;          // CSHM_*
+    uint32_t host_id;        // Cambia si la entrada pasa a ser de otro host
+    uint32_t reserved0;
+    int64_t updated_ms;      // Última escritura de la entrada (ms desde 1970)
+    int64_t cpu_ts_ms;       // Marca de tiempo de los datos de CPU
+    int64_t mem_ts_ms;       // Marca de tiempo de los datos de memoria
+    float cpu_usage, cpu_user, cpu_sys, cpu_idle, cpu_iowait, cpu_steal;   // %
+    float mem_used_mb, mem_free_mb, swap_total_mb, swap_free_mb;
+    int32_t ncores;          // Núcleos que envía el agente (0 si no los envía)
+    int32_t core_max_idx;    // Núcleo más cargado
+    int32_t core_max_pct;    // Uso de ese núcleo (0..100)
+    int32_t nprocs;          // Procesos en el host
+    int32_t top_cpu_pid;     // Proceso que más CPU usa
+    float top_cpu_pct;
+    char top_cpu_comm[CSHM_COMM_MAX];
+    int32_t top_rss_pid;     // Proceso que más memoria usa
+    float top_rss_mb;
+    char top_rss_comm[CSHM_COMM_MAX];
+    char name[CSHM_NAME_MAX]; // Nombre o IP del host
+    uint8_t reserved[48];
+} cshm_entry_t;
+
+_Static_assert(sizeof(cshm_header_t) == 64, "cabecera de 64 bytes");
+_Static_assert(sizeof(cshm_entry_t) % 64 == 0, "entradas en líneas de caché enteras");
+
+typedef struct {
+    const cshm_header_t *hdr;
+    const unsigned char *base;
+    size_t size;
+} cshm_reader_t;
+
+// Abre el segmento 'name' (el de -X) sólo para leer. Devuelve 0, o -1 con
+// errno (EPROTO si no es un segmento del collector o es de otra versión).
+static inline int cshm_open(cshm_reader_t *r, const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    r->hdr = p;
+    r->base = p;
+    r->size = st.st_size;
+    const cshm_header_t *h = r->hdr;
+    if (r->size < sizeof(*h) ||
+        __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != CSHM_MAGIC ||
+        h->version != CSHM_VERSION || h->entry_size < sizeof(cshm_entry_t) ||
+        h->header_size < sizeof(*h) ||
+        h->header_size + (size_t)h->capacity * h->entry_size > r->size) {
+        munmap(p, r->size);
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void cshm_close(cshm_reader_t *r) {
+    munmap((void *)r->base, r->size);
+}
+
+// Número de entradas (en uso o libres).
+static inline uint32_t cshm_capacity(const cshm_reader_t *r) {
+    return r->hdr->capacity;
+}
+
+// Copia coherente de la entrada i en 'out'. Devuelve 1 si es de un host, 0
+// si está libre o -1 (EAGAIN) si sigue a medio escribir tras muchos
+// intentos (el collector murió escribiéndola).
+static inline int cshm_read(const cshm_reader_t *r, uint32_t i, cshm_entry_t *out) {
+    const cshm_entry_t *e = (const cshm_entry_t *)
+        (r->base + r->hdr->header_size + (size_t)i * r->hdr->entry_size);
+    for (int tries = 0; tries < 10000; tries++) {
+        uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(out, (const void *)e, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq) {
+            out->name[CSHM_NAME_MAX - 1] = '\0';
+            return (out->flags & CSHM_USED) != 0;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Busca el host 'name'. Devuelve 1 y lo copia en 'out', o 0 si no está.
+static inline int cshm_find(const cshm_reader_t *r, const char *name, cshm_entry_t *out) {
+    for (uint32_t i = 0; i < r->hdr->capacity; i++)
+        if (cshm_read(r, i, out) == 1 && strcmp(out->name, name) == 0)
+            return 1;
+    return 0;
+}
+
+// 1 si el collector actualizó la cabecera hace menos de 'max_age_ms'.
+static inline int cshm_alive(const cshm_reader_t *r, int64_t max_age_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return now - __atomic_load_n(&r->hdr->heartbeat_ms, __ATOMIC_RELAXED) < max_age_ms;
+}
+
+#endif